@@ -0,0 +1,136 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <string>
+#include "libflatco.h"
+#include "scan.h"
+
+// Scanner benchmark: with each implementation of ScanAny, how fast it alone walks a big generated source from one
+// char of the parser's keyword set to the next, and how fast flatco::transform() flattens the source, the scan
+// being a part of it.
+
+static std::string MakeSource(size_t size) {
+    static const char* const lines[] = {
+        "    Buffer buf; int len = buf.size(); // count the bytes\n",
+        "    const char* msg = \"Bad packet \\\"header\\\"\";\n",
+        "    for (int i = 0; i < len; ++i) { total += data[i] * 31 / 7; }\n",
+        "    if (state->pending > limit) { state->pending = limit; } else { ++state->count; }\n",
+        "    /* The frame is complete,\n       hand it to the decoder */\n",
+        "    std::vector<std::pair<int, Blob>> frames{ {1, Blob{}} };\n",
+        "    char sep = ','; char quote = '\\'';\n",
+        "    result = decoder.decode(frame, options) / scale;\n",
+    };
+    std::string s =
+        "BL_func(task) int ReadVarint(Reader& reader) {\n"
+        "    int n = co_await reader.next();\n"
+        "    BL_return(n & 0x7f);\n"
+        "}\n";
+    s.reserve(size + 256);
+    unsigned n = 0;
+    while (s.size() < size) {
+        if (n % 400 == 0) {
+            if (n > 0)
+                s += "    co_return;\n}\n";
+            s += "task Handle" + std::to_string(n / 400) + "(Reader& reader) {\n    int n;\n";
+        }
+        if (n % 40 == 0)
+            s += "    BL_call(n = ReadVarint(reader));\n";
+        s += lines[(n * 7 + n / 3) % (sizeof(lines) / sizeof(lines[0]))];
+        ++n;
+    }
+    s += "    co_return;\n}\n";
+    return s;
+}
+
+// The stops of ScanAny on the chars of the set of the parser's top-level loop, best of 5 runs
+static double MeasureScan(const std::string& src, size_t& stops) {
+    static const ScanSet set('B', '"', '\'', '/', 'B');
+    double best = 1e30;
+    for (int i = 0; i < 5; ++i) {
+        auto start = std::chrono::steady_clock::now();
+        const char* p = src.data();
+        const char* pe = p + src.size();
+        stops = 0;
+        while ((p = ScanAny(p, pe, set)) < pe) {
+            ++stops;
+            ++p;
+        }
+        double t = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (t < best)
+            best = t;
+    }
+    return best;
+}
+
+static double Measure(const std::string& src, std::string& out) {
+    double best = 1e30;
+    for (int i = 0; i < 5; ++i) {
+        auto start = std::chrono::steady_clock::now();
+        flatco::Result result = flatco::transform(src, "bench.cxx");
+        double t = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (!result.ok) {
+            printf("transform failed at %zu:%zu: %s\n", result.diagnostics[0].row, result.diagnostics[0].col,
+                   result.diagnostics[0].message.c_str());
+            exit(1);
+        }
+        out = std::move(result.output);
+        if (t < best)
+            best = t;
+    }
+    return best;
+}
+
+int main(int argc, char** argv) {
+    size_t mb = argc > 1 ? (size_t)atoi(argv[1]) : 16;
+    std::string src = MakeSource(mb << 20);
+    static const struct { ScanImpl impl; const char* name; } impls[] = {
+        { ScanImpl::Scalar, "scalar" }, { ScanImpl::SSE2, "sse2" }, { ScanImpl::AVX2, "avx2" },
+    };
+    int r = 0;
+#ifndef NDEBUG
+    printf("not an optimized build, the timings are of little use\n\n");
+#endif
+
+    printf("scanning %zu MB of generated code, best of 5 runs\n\n", mb);
+    printf("%-10s %10s %10s %8s\n", "scan", "ms", "MB/s", "speedup");
+    size_t expectedStops = 0;
+    double base = 0;
+    for (auto& it : impls) {
+        if (!SetScanImpl(it.impl)) {
+            printf("%-10s %10s\n", it.name, "n/a");
+            continue;
+        }
+        size_t stops;
+        double t = MeasureScan(src, stops);
+        if (base == 0) {
+            base = t;
+            expectedStops = stops;
+        }
+        bool same = stops == expectedStops;
+        printf("%-10s %10.1f %10.0f %7.2fx%s\n", it.name, t * 1e3, mb / t, base / t, same ? "" : "  MISMATCH");
+        if (!same)
+            r = 1;
+    }
+
+    printf("\ntransforming %zu MB of generated code, best of 5 runs\n\n", mb);
+    printf("%-10s %10s %10s %8s\n", "scan", "ms", "MB/s", "speedup");
+    std::string expected;
+    base = 0;
+    for (auto& it : impls) {
+        if (!SetScanImpl(it.impl))
+            continue;
+        std::string out;
+        double t = Measure(src, out);
+        if (base == 0) {
+            base = t;
+            expected = out;
+        }
+        bool same = out == expected;
+        printf("%-10s %10.1f %10.0f %7.2fx%s\n", it.name, t * 1e3, mb / t, base / t, same ? "" : "  MISMATCH");
+        if (!same)
+            r = 1;
+    }
+    SetScanImpl(ScanImpl::Auto);
+    return r;
+}
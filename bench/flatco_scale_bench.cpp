@@ -0,0 +1,159 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <filesystem>
+#include "libflatco.h"
+
+// Scaling benchmark: run flatco on generated sources with more and more BL_funcs. Every BL_func calls the next
+// one and the one at twice its index, so callers come before their callees. The G_ chain is expanded from one
+// top-level BL_call, it's as deep as there are BL_funcs. The time per BL_func should stay flat as they grow.
+//
+// Then transform sources of growing outputs, all the top-level BL_calls of one BL_func, with one job and with
+// one per core and Options::parallelGenMinBytes at 1 so that the generation always takes the threads: the size
+// from which they pay is the basis of a value of parallelGenMinBytes, which is 0 (one thread) until that is
+// measured on a host with several cores. The parsing is the same for both and small.
+
+static std::string MakeSource(size_t nFuncs) {
+    std::string s = "#include \"flatco.h\"\n\n";
+    char buf[256];
+    for (size_t i = 0; i < nFuncs; ++i) {
+        snprintf(buf, sizeof(buf), "BL_func(task) int F%zu(int a, int b) {\n    int r = a * %zu + b;\n", i, i);
+        s += buf;
+        if (i + 1 < nFuncs) {
+            snprintf(buf, sizeof(buf), "    BL_call(r = F%zu(r, a));\n", i + 1);
+            s += buf;
+        }
+        if (2 * i + 1 < nFuncs) {
+            snprintf(buf, sizeof(buf), "    BL_call(r = F%zu(b, r));\n", 2 * i + 1);
+            s += buf;
+        }
+        s += "    BL_return(r);\n}\n\n";
+    }
+    for (size_t i = 0; i < nFuncs; ++i) {
+        snprintf(buf, sizeof(buf), "BL_func(task) void G%zu(int& n) {\n    ++n;\n", i);
+        s += buf;
+        if (i + 1 < nFuncs) {
+            snprintf(buf, sizeof(buf), "    BL_call(G%zu(n));\n", i + 1);
+            s += buf;
+        }
+        s += "}\n\n";
+    }
+    s += "task Run(int& n) {\n    BL_call(G0(n));\n}\n";
+    return s;
+}
+
+// About outputBytes of expansions of a BL_func which suspends, 100 BL_calls per top-level coroutine
+static std::string MakeGenSource(size_t outputBytes) {
+    std::string s = "#include \"flatco.h\"\n\nBL_func(task) int H(Source& src, int n) {\n"
+                    "    int v = co_await src.next();\n";
+    for (int i = 0; i < 16; ++i)
+        s += "    if (v > n) { n = n * 31 + v / 7; } else { n = (n ^ v) + limits.step; }\n";
+    s += "    BL_return(n);\n}\n\n";
+    const size_t k_expandBytes = 2400;
+    size_t nCalls = outputBytes / k_expandBytes + 1;
+    char buf[64];
+    for (size_t i = 0; i < nCalls; ++i) {
+        if (i % 100 == 0) {
+            if (i > 0)
+                s += "    co_return;\n}\n";
+            snprintf(buf, sizeof(buf), "task Run%zu(Source& src) {\n    int n = 0;\n", i / 100);
+            s += buf;
+        }
+        s += "    BL_call(n = H(src, n));\n";
+    }
+    s += "    co_return;\n}\n";
+    return s;
+}
+
+static bool WriteFile(const std::string& fileName, const std::string& s) {
+    FILE* f = fopen(fileName.c_str(), "wb");
+    if (!f)
+        return false;
+    bool ok = fwrite(s.data(), 1, s.size(), f) == s.size();
+    return fclose(f) == 0 && ok;
+}
+
+// The best of 3 runs of cmd in seconds, a negative value if it fails
+static double Run(const std::string& cmd) {
+    double best = 1e30;
+    for (int i = 0; i < 3; ++i) {
+        auto start = std::chrono::steady_clock::now();
+        int rc = system(cmd.c_str());
+        double t = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (rc != 0)
+            return -1;
+        if (t < best)
+            best = t;
+    }
+    return best;
+}
+
+// The best of 3 transforms of src in seconds, a negative value if it fails
+static double Transform(const std::string& src, const flatco::Options& options, std::string& out) {
+    double best = 1e30;
+    for (int i = 0; i < 3; ++i) {
+        auto start = std::chrono::steady_clock::now();
+        flatco::Result result = flatco::transform(src, "flatco_scale_bench.cxx", options);
+        double t = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (!result.ok)
+            return -1;
+        out = std::move(result.output);
+        if (t < best)
+            best = t;
+    }
+    return best;
+}
+
+int main(int argc, char** argv) {
+    const char* flatco = argc > 1 ? argv[1] : FLATCO_EXE;
+    size_t maxFuncs = argc > 2 ? (size_t)atoi(argv[2]) : 40000;
+    size_t maxOutputMB = argc > 3 ? (size_t)atoi(argv[3]) : 16;
+    std::filesystem::path dir = std::filesystem::temp_directory_path();
+    std::string inFileName = (dir / "flatco_scale_bench.cxx").string();
+    std::string outFileName = (dir / "flatco_scale_bench.cpp").string();
+    std::string exe = std::string("\"") + flatco + "\"";
+    std::string files = " -o \"" + outFileName + "\" \"" + inFileName + "\"";
+
+    printf("flatco on sources with n BL_funcs and 2n BL_calls, best of 3 runs\n\n");
+    printf("%-10s %10s %10s %12s\n", "BL_funcs", "KB", "ms", "us/BL_func");
+    int r = 0;
+    for (size_t n = 2500; n <= maxFuncs; n *= 2) {
+        std::string src = MakeSource(n);
+        if (!WriteFile(inFileName, src)) {
+            printf("Can't write '%s'.\n", inFileName.c_str());
+            return 1;
+        }
+        double t = Run(exe + files);
+        if (t < 0) {
+            printf("flatco failed on %zu BL_funcs.\n", n);
+            r = 1;
+            break;
+        }
+        printf("%-10zu %10zu %10.1f %12.2f\n", n, src.size() >> 10, t * 1e3, t * 1e6 / n);
+    }
+
+    unsigned jobs = std::max(std::thread::hardware_concurrency(), 1u);
+    printf("\ntransforms generating outputs of n KB with 1 and %u jobs, best of 3 runs\n\n", jobs);
+    printf("%-10s %10s %10s %8s\n", "KB", "ms -j1", "ms -jN", "speedup");
+    for (size_t kb = 64; r == 0 && kb <= (maxOutputMB << 10); kb *= 2) {
+        std::string src = MakeGenSource(kb << 10);
+        flatco::Options options;
+        options.parallelGenMinBytes = 1;
+        std::string out1, outN;
+        double t1 = Transform(src, options, out1);
+        options.jobs = jobs;
+        double tN = Transform(src, options, outN);
+        if (t1 < 0 || tN < 0 || out1 != outN) {
+            printf("%s on an output of %zu KB.\n", out1 != outN ? "Outputs differ" : "Transform failed", kb);
+            r = 1;
+            break;
+        }
+        printf("%-10zu %10.1f %10.1f %7.2fx\n", out1.size() >> 10, t1 * 1e3, tN * 1e3, t1 / tN);
+    }
+    std::filesystem::remove(inFileName);
+    std::filesystem::remove(outFileName);
+    return r;
+}
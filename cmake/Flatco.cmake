@@ -0,0 +1,102 @@
+# flatco_add_sources(<target> [BATCH] <sources>...)
+#
+# Flatten the .cxx <sources> by flatco into <name>.cpp files in the current binary directory and add them to
+# <target>. Every source is flattened by its own command with a depfile, so an incremental build runs flatco
+# only for the changed sources, and flatco rewrites an output only when its content changes, so the compiler
+# only runs for the outputs which really changed (make may still rerun flatco for a touched but unchanged
+# source, its output keeps the older mtime). The commands also depend on the flatco executable.
+#
+# With BATCH all sources are flattened by one flatco process taking its input/output pairs from a response
+# file. Any changed source reruns the whole batch, but the unchanged outputs are still left untouched.
+function(flatco_add_sources target)
+  cmake_parse_arguments(PARSE_ARGV 1 arg "BATCH" "" "")
+  if(TARGET flatco)
+    set(flatco_exe $<TARGET_FILE:flatco>)
+    set(flatco_dep flatco)
+  else()
+    find_program(FLATCO_EXECUTABLE flatco REQUIRED)
+    set(flatco_exe ${FLATCO_EXECUTABLE})
+    set(flatco_dep ${FLATCO_EXECUTABLE})
+  endif()
+
+  # DEPFILE is supported by the Ninja generators, and by all generators since CMake 3.21
+  set(use_depfile OFF)
+  if(CMAKE_GENERATOR MATCHES "Ninja" OR CMAKE_VERSION VERSION_GREATER_EQUAL 3.21)
+    set(use_depfile ON)
+  endif()
+  cmake_policy(PUSH)
+  if(POLICY CMP0116)
+    cmake_policy(SET CMP0116 NEW)
+  endif()
+
+  set(inputs)
+  set(outputs)
+  set(rsp "")
+  foreach(src ${arg_UNPARSED_ARGUMENTS})
+    get_filename_component(src ${src} ABSOLUTE)
+    get_filename_component(name ${src} NAME)
+    set(out "${CMAKE_CURRENT_BINARY_DIR}/${name}.cpp")
+    list(APPEND inputs ${src})
+    list(APPEND outputs ${out})
+    string(APPEND rsp "\"${src}\" \"${out}\"\n")
+    if(NOT arg_BATCH)
+      if(use_depfile)
+        add_custom_command(
+          OUTPUT ${out}
+          DEPENDS ${src} ${flatco_dep}
+          DEPFILE ${out}.d
+          COMMAND ${flatco_exe} -MD -o ${out} ${src}
+          COMMENT "Flattening ${name}"
+        )
+      else()
+        add_custom_command(
+          OUTPUT ${out}
+          DEPENDS ${src} ${flatco_dep}
+          COMMAND ${flatco_exe} -o ${out} ${src}
+          COMMENT "Flattening ${name}"
+        )
+      endif()
+    endif()
+  endforeach()
+
+  if(arg_BATCH AND outputs)
+    set(rspfile "${CMAKE_CURRENT_BINARY_DIR}/${target}_flatco.rsp")
+    set(depfile "${CMAKE_CURRENT_BINARY_DIR}/${target}_flatco.d")
+    file(WRITE ${rspfile} ${rsp})
+    if(use_depfile)
+      add_custom_command(
+        OUTPUT ${outputs}
+        DEPENDS ${inputs} ${rspfile} ${flatco_dep}
+        DEPFILE ${depfile}
+        COMMAND ${flatco_exe} -MF ${depfile} --batch @${rspfile}
+        COMMENT "Flattening sources of ${target}"
+      )
+    else()
+      add_custom_command(
+        OUTPUT ${outputs}
+        DEPENDS ${inputs} ${rspfile} ${flatco_dep}
+        COMMAND ${flatco_exe} --batch @${rspfile}
+        COMMENT "Flattening sources of ${target}"
+      )
+    endif()
+  endif()
+
+  cmake_policy(POP)
+  target_sources(${target} PRIVATE ${outputs})
+endfunction()
+
+# flatco_compile_with_wrapper(<target>)
+#
+# Compile all C++ sources of <target>, e.g. .cxx files using BL_func, through "flatco --cc": every source is
+# flattened in memory and piped to the compiler, no flattened file is written and there is no build step
+# before the compilation. Sources without BL_ keywords come out unchanged apart from #line directives.
+# Needs a compiler taking gcc style options (gcc, clang), and isn't supported on Windows.
+function(flatco_compile_with_wrapper target)
+  if(TARGET flatco)
+    set_target_properties(${target} PROPERTIES CXX_COMPILER_LAUNCHER "$<TARGET_FILE:flatco>;--cc")
+    add_dependencies(${target} flatco)
+  else()
+    find_program(FLATCO_EXECUTABLE flatco REQUIRED)
+    set_target_properties(${target} PROPERTIES CXX_COMPILER_LAUNCHER "${FLATCO_EXECUTABLE};--cc")
+  endif()
+endfunction()
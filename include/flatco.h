@@ -3,7 +3,7 @@
 #ifndef _flatco_h_
 #define _flatco_h_
 
-#define BL_func(ty)
+#define BL_func(...) // BL_func(ty), BL_func(ty, shared) or BL_func(ty, outline)
 #define BL_call(expr) (expr)
 #define BL_return(expr) return(expr)
 
@@ -0,0 +1,236 @@
+#pragma once
+
+#ifndef _flatco_rt_h_
+#define _flatco_rt_h_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <new>
+#include <type_traits>
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// The runtime of the code generated by flatco. RetSlot holds the variable declared by "T x = BL_call(f(args))" and
+// the result of a BL_call in an expression.
+//
+// With --profile-generate every flattened source has a table of its BL_call sites, registered when the program
+// starts, and every site counts its executions. The counts of all tables are appended to the profile
+// $FLATCO_PROFILE, flatco.profile by default, when the program exits or by flatco::WriteProfile(), for flatco
+// --profile-use.
+//
+// The code generated by flatco --instrument has a table of its BL_call sites as well, every site counts its
+// executions and the time they take, from the start of the expansion to its end, suspensions included. The table
+// is dumped as CSV, or JSON if the file name ends with .json, to $FLATCO_INSTRUMENT, stderr by default, when the
+// program exits or by flatco::WriteInstrument().
+namespace flatco {
+
+struct ProfileSite {
+    const char* file;
+    size_t row;
+    size_t col;
+    const char* func; // BL_func called
+    std::atomic<uint64_t> count{ 0 };
+
+    void hit() { count.fetch_add(1, std::memory_order_relaxed); }
+};
+
+struct ProfileTable {
+    ProfileSite* sites;
+    size_t n;
+    ProfileTable* next;
+
+    ProfileTable(ProfileSite* sitesA, size_t nA) : sites(sitesA), n(nA), next(head()) { head() = this; }
+
+    static ProfileTable*& head() {
+        static ProfileTable* tables = nullptr;
+        return tables;
+    }
+};
+
+// Append the counts of all sites to fileName, by default to $FLATCO_PROFILE or flatco.profile, and reset them
+inline bool WriteProfile(const char* fileName = nullptr) {
+    if (!fileName)
+        fileName = getenv("FLATCO_PROFILE");
+    FILE* f = fopen(fileName && *fileName ? fileName : "flatco.profile", "a");
+    if (!f)
+        return false;
+    for (ProfileTable* table = ProfileTable::head(); table; table = table->next) {
+        for (size_t i = 0; i < table->n; ++i) {
+            ProfileSite& site = table->sites[i];
+            fprintf(f, "%s\t%zu\t%zu\t%s\t%llu\n", site.file, site.row, site.col, site.func,
+                    (unsigned long long)site.count.exchange(0, std::memory_order_relaxed));
+        }
+    }
+    return fclose(f) == 0;
+}
+
+// Writes the profile when the program exits if it has sites
+struct ProfileWriter {
+    ~ProfileWriter() {
+        if (ProfileTable::head())
+            WriteProfile();
+    }
+};
+inline ProfileWriter s_profileWriter;
+
+// The time stamp counter where there's one, else the steady clock
+#if (defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))) || defined(__x86_64__) || defined(__i386__)
+inline uint64_t Ticks() { return __rdtsc(); }
+constexpr const char* k_ticksUnit = "cycles";
+#else
+inline uint64_t Ticks() {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+constexpr const char* k_ticksUnit = "ns";
+#endif
+
+struct InstrumentSite {
+    const char* file;
+    size_t row;
+    size_t col;
+    const char* func; // BL_func called
+    std::atomic<uint64_t> count{ 0 };
+    std::atomic<uint64_t> ticks{ 0 };
+};
+
+struct InstrumentTable {
+    InstrumentSite* sites;
+    size_t n;
+    InstrumentTable* next;
+
+    InstrumentTable(InstrumentSite* sitesA, size_t nA) : sites(sitesA), n(nA), next(head()) { head() = this; }
+
+    static InstrumentTable*& head() {
+        static InstrumentTable* tables = nullptr;
+        return tables;
+    }
+};
+
+// Times an execution of a site, from its construction at the start of the expansion to its destruction
+class SiteTimer {
+public:
+    explicit SiteTimer(InstrumentSite& site) : site_(site), start_(Ticks()) {}
+    ~SiteTimer() {
+        site_.count.fetch_add(1, std::memory_order_relaxed);
+        site_.ticks.fetch_add(Ticks() - start_, std::memory_order_relaxed);
+    }
+    SiteTimer(const SiteTimer&) = delete;
+    SiteTimer& operator=(const SiteTimer&) = delete;
+
+private:
+    InstrumentSite& site_;
+    uint64_t start_;
+};
+
+inline void DumpJsonString(FILE* f, const char* s) {
+    fputc('"', f);
+    for (; *s; ++s) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\')
+            fprintf(f, "\\%c", c);
+        else if (c < 0x20)
+            fprintf(f, "\\u%04x", c);
+        else
+            fputc(c, f);
+    }
+    fputc('"', f);
+}
+
+// Dump the counts and ticks of all sites to f as CSV or JSON
+inline void DumpInstrument(FILE* f, bool json) {
+    if (json)
+        fprintf(f, "{\"unit\":\"%s\",\"sites\":[", k_ticksUnit);
+    else
+        fprintf(f, "file,row,col,func,count,%s\n", k_ticksUnit);
+    bool first = true;
+    for (InstrumentTable* table = InstrumentTable::head(); table; table = table->next) {
+        for (size_t i = 0; i < table->n; ++i) {
+            InstrumentSite& site = table->sites[i];
+            unsigned long long count = site.count.load(std::memory_order_relaxed);
+            unsigned long long ticks = site.ticks.load(std::memory_order_relaxed);
+            if (!json) {
+                // the file name is quoted, the BL_func name has no comma
+                fputc('"', f);
+                for (const char* s = site.file; *s; ++s) {
+                    if (*s == '"')
+                        fputc('"', f);
+                    fputc(*s, f);
+                }
+                fprintf(f, "\",%zu,%zu,%s,%llu,%llu\n", site.row, site.col, site.func, count, ticks);
+                continue;
+            }
+            fputs(first ? "\n{\"file\":" : ",\n{\"file\":", f);
+            first = false;
+            DumpJsonString(f, site.file);
+            fprintf(f, ",\"row\":%zu,\"col\":%zu,\"func\":\"%s\",\"count\":%llu,\"ticks\":%llu}", site.row,
+                    site.col, site.func, count, ticks);
+        }
+    }
+    if (json)
+        fputs("\n]}\n", f);
+}
+
+// Dump the table to fileName, by default to $FLATCO_INSTRUMENT or stderr
+inline bool WriteInstrument(const char* fileName = nullptr) {
+    if (!fileName)
+        fileName = getenv("FLATCO_INSTRUMENT");
+    if (!fileName || !*fileName) {
+        DumpInstrument(stderr, false);
+        return true;
+    }
+    FILE* f = fopen(fileName, "w");
+    if (!f)
+        return false;
+    size_t len = strlen(fileName);
+    DumpInstrument(f, len >= 5 && strcmp(fileName + len - 5, ".json") == 0);
+    return fclose(f) == 0;
+}
+
+// Dumps the table when the program exits if it has sites
+struct InstrumentWriter {
+    ~InstrumentWriter() {
+        if (InstrumentTable::head())
+            WriteInstrument();
+    }
+};
+inline InstrumentWriter s_instrumentWriter;
+
+// The storage of the variable declared by "T x = BL_call(f(args))", constructed in place by the BL_return of the
+// expansion of f, the variable refers to it. The expression of a BL_call in one takes the result.
+template <typename T>
+class RetSlot {
+public:
+    using type = std::remove_cvref_t<T>;
+
+    RetSlot() noexcept {}
+    ~RetSlot() {
+        if (made_)
+            (**this).~type();
+    }
+    RetSlot(const RetSlot&) = delete;
+    RetSlot& operator=(const RetSlot&) = delete;
+
+    // Where to construct the value, made() once it is
+    void* place() noexcept { return storage_; }
+    void made() noexcept { made_ = true; }
+
+    type& operator*() noexcept { return *std::launder(reinterpret_cast<type*>(storage_)); }
+    type&& take() noexcept { return static_cast<type&&>(**this); }
+
+private:
+    alignas(type) unsigned char storage_[sizeof(type)];
+    bool made_ = false;
+};
+
+} // namespace flatco
+
+#endif /* !_flatco_rt_h_ */
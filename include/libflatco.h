@@ -0,0 +1,185 @@
+#pragma once
+
+#ifndef _libflatco_h_
+#define _libflatco_h_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// The flatco preprocessor as a library: transform a source using BL_func/BL_call/BL_return in memory.
+// transform() keeps no state between calls but in an optional Cache, it can be called from several threads at
+// the same time.
+//
+// A source imports the BL_funcs of a library by a line #include "<name>.bl.h", <name> relative to the directory
+// of the source. The line is commented out in the output, as is the one of flatco.h. A library holds BL_funcs,
+// comments and preprocessor lines, which are ignored but its own imports, the headers its BL_funcs need are
+// included by the sources. Libraries are read from the file system.
+//
+// "T x = BL_call(f(args))" declares the variable x initialized by the call, T can be auto when f's return type
+// isn't deduced. The BL_return of the expansion constructs the result in place, in a flatco::RetSlot of
+// flatco_rt.h which x refers to, so T needs no default constructor. Such calls aren't shared.
+//
+// A BL_call in an expression, like "if (BL_call(f(args)) == 0)" or "n += BL_call(f(args))", is expanded before its
+// statement into a RetSlot which the expression takes the result of, so f's return type can't be deduced. The code
+// of the statement before the call then runs after it, which C++ allows but for the operands of &&, ||, ?: and <<
+// before it, and the conditions of loops and of an if with an initializer, all refused, as are a BL_call in the
+// statement of a loop, else, if or switch without braces and two BL_calls in one expression. The slot lives to the
+// end of the block, so the call can't be directly in the body of a switch, whose case labels after it would jump
+// over the slot: the statements of its case go in braces.
+//
+// A BL_func of the source which can't suspend, i.e. without co_await, co_yield, co_return or return in its body,
+// and calling only such BL_funcs defined before it, is generated as an always inlined function where it's defined
+// and called as a function after that. The others, and the BL_funcs of libraries, are expanded at every BL_call.
+//
+// The calls in one block of a BL_func declared BL_func(ty, shared), or expanding to Options::sharedMinBytes or
+// more, share one expansion: the first call holds it, the others store their arguments to slots, jump to it and
+// are jumped back to by a switch. The slots are declared at the start of the block by the parameter types, which
+// must be default constructible and can't use auto, and the block can't declare initialized variables between
+// the calls. The BL_calls inside a library are not shared.
+//
+// A BL_func declared BL_func(ty, outline), or expanding to more than Options::maxInlineBytes, is outlined: it's
+// generated as a coroutine of type ty where it's defined, and the BL_calls following it co_await it, so ty must be
+// an awaitable task type whose co_return takes the result. A BL_func with co_yield, co_return or return in its
+// body acts on its caller's coroutine and is always expanded, as are the BL_funcs of libraries. The transform
+// reports every outlined BL_call as a diagnostic of its result.
+//
+// Options::profileGenerate counts the executions of every BL_call site of the source in a table of the output,
+// written to a profile by flatco_rt.h when the program exits. Transforming with that Profile, the cold sites are
+// outlined when their BL_func can be and marked [[unlikely]], the hot ones are expanded and not shared.
+//
+// Options::instrument counts the executions of every BL_call site of the source and times them, in a table of the
+// output dumped by flatco_rt.h when the program exits. The BL_calls aren't shared then, every one is timed alone.
+//
+// The parameters of a BL_func are bound to its arguments like the ones of a function: a reference parameter
+// refers to the argument, the others are initialized by it. A parameter taken by value is moved instead of copied
+// by a BL_return of it, and by a BL_call it's the only use of when the body has no loop, goto or lambda capturing by
+// reference and binds no reference to it. Options::warnCopies notes the variables passed by value to parameters
+// of types other than builtin ones, pointers and views, which the BL_calls copy.
+namespace flatco {
+
+class Cache;
+class Index;
+class Profile;
+
+struct Options {
+    unsigned jobs = 1;            // threads parsing one source, and generating it past parallelGenMinBytes
+    Cache* cache = nullptr;       // reuse the work of earlier transforms
+    const Index* index = nullptr; // precompiled libraries, the ones not in it or changed since are parsed
+    bool alwaysExpand = false;    // expand every BL_call, even of the BL_funcs which can't suspend
+    size_t sharedMinBytes = 0;    // the calls of BL_funcs expanding to as many bytes share an expansion, 0 for none
+    size_t maxInlineBytes = 0;    // BL_funcs expanding to more bytes are outlined, 0 for no limit
+    bool profileGenerate = false; // count the executions of the BL_call sites, see flatco_rt.h
+    const Profile* profile = nullptr; // the counts recorded, which rate the BL_call sites
+    bool instrument = false;      // count and time the executions of the BL_call sites, see flatco_rt.h
+    bool warnCopies = false;      // note the BL_call arguments copied to parameters which may be costly to copy
+    size_t parallelGenMinBytes = 0; // outputs of as many bytes are generated by the jobs threads, 0 for one thread,
+                                    // see bench/flatco_scale_bench.cpp
+};
+
+// Work kept between transforms: whole results by the hash of their source, file name and options, and the
+// parsed bodies of BL_funcs by the hash of their parameter names and text, so that when one BL_func of a source
+// changes only that one is parsed again. The least recently used entries are dropped past maxBytes. A Cache can
+// be shared by threads.
+class Cache {
+public:
+    struct Stats {
+        uint64_t resultHits;
+        uint64_t resultMisses;
+        uint64_t bodyHits;
+        uint64_t bodyMisses;
+        size_t entries;
+        size_t bytes;
+    };
+
+    explicit Cache(size_t maxBytes = 256 << 20);
+    ~Cache();
+    Cache(const Cache&) = delete;
+    Cache& operator=(const Cache&) = delete;
+
+    Stats stats() const;
+    void clear();
+
+    struct Impl;
+    Impl& impl() const { return *impl_; }
+
+private:
+    std::unique_ptr<Impl> impl_;
+};
+
+// Libraries compiled by writeIndex() to a file, which open() maps into memory: loading a library from it takes
+// no parsing. The index keeps the contents hash of every library, one changed since is parsed again.
+class Index {
+public:
+    Index();
+    ~Index();
+    Index(const Index&) = delete;
+    Index& operator=(const Index&) = delete;
+
+    // false if the file can't be read or isn't an index of this version
+    bool open(const char* fileName);
+
+    struct Impl;
+    Impl& impl() const { return *impl_; }
+
+private:
+    std::unique_ptr<Impl> impl_;
+};
+
+// The counts of BL_call site executions written by programs built with Options::profileGenerate. Several runs can
+// append to one profile, the counts of a site add up. A site is known by its file name, row and column, the sites
+// which moved since are not rated.
+class Profile {
+public:
+    Profile();
+    ~Profile();
+    Profile(const Profile&) = delete;
+    Profile& operator=(const Profile&) = delete;
+
+    // Add the counts of text, the contents of a profile file. false if a line isn't "<file>\t<row>\t<col>\t<BL_func>\t<count>".
+    bool parse(std::string_view text);
+
+    struct Impl;
+    Impl& impl() const { return *impl_; }
+
+private:
+    std::unique_ptr<Impl> impl_;
+};
+
+struct Diagnostic {
+    size_t row; // 1-based
+    size_t col; // 1-based
+    std::string message;
+    std::string fileName; // of the library the error is in, empty if it's in the source
+};
+
+struct Result {
+    bool ok = false;
+    std::string output;                   // the transformed source if ok
+    std::vector<Diagnostic> diagnostics;  // why not ok, else notes on the output like the BL_calls outlined
+    std::vector<std::string> libraries;   // paths of the libraries imported, directly or not, or failing to be
+};
+
+// fileName is the name of the source in the #line directives of the output
+Result transform(std::string_view src, std::string_view fileName, const Options& options = {});
+
+// Like transform() but append the output to out, return false with the diagnostics on errors, else true with the
+// notes appended to diagnostics. The paths of the imported libraries are appended to libraries if given.
+bool transform(std::string_view src, std::string_view fileName, const Options& options, std::string& out,
+               std::vector<Diagnostic>& diagnostics, std::vector<std::string>* libraries = nullptr);
+
+// Compile the libraries, and the ones they import, into the index fileName
+bool writeIndex(const std::vector<std::string>& libraries, const char* fileName, std::vector<Diagnostic>& diagnostics);
+
+const char* version();
+
+// The format of the code generated, changed by every version of flatco generating other code for the same source
+// and options: the keys of cached outputs include it
+unsigned outputFormat();
+
+} // namespace flatco
+
+#endif /* !_libflatco_h_ */
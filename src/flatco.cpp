@@ -1,76 +1,32 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <assert.h>
 #include <vector>
 #include <string>
 #include <string_view>
-#include <map>
-#include <set>
-#include "getopt.h"
-
-const char* const k_progname = "flatco";
-const char* const k_version = "0.1";
-const char* const k_helpstr =
-"Usage:\n"
-"flatco <options> <input_filename>\n"
-"Options:\n"
-"  -o,  --output <output_filename> Specify output file name\n"
-"  -v,  --version                  Display version\n"
-"  -h,  --help                     Display this help\n"
-;
-
-static const char* short_opts = "o:vh";
-
-namespace LongOpts {
-    enum {
-        version = 'v',
-        help = 'h',
-        output = 'o',
-    };
-}
-
-static const struct option long_opts[] = {
-    { "version", no_argument,       NULL, LongOpts::version },
-    { "help",    no_argument,       NULL, LongOpts::help    },
-
-    { "output",  required_argument, NULL, LongOpts::output  },
-
-    { NULL,           no_argument,  NULL,  0                }
-};
-
-static const char* s_outFileName = nullptr;
-static const char* s_inFileName = nullptr;
-
-int processing_cmd(int argc, char* const argv[]) {
-    int opt;
-
-    while ((opt = getopt_long(argc, argv, short_opts, long_opts, NULL)) != -1) {
-        switch (opt) {
-        case LongOpts::help:
-            puts(k_helpstr);
-            return 1;
-
-        case LongOpts::version:
-            printf("%s: version %s\n", k_progname, k_version);
-            return 1;
-
-        case LongOpts::output:
-            s_outFileName = optarg;
-            break;
-
-        default:
-            puts("for more detail see help\n");
-            break;
-        }
-    }
-    if (optind >= argc)
-        return 1;
-    s_inFileName = argv[optind++];
-    return 0;
-}
-
-enum ItemKind { CODE=0, BL_func, BL_call, BL_return };
+#include <memory>
+#include <optional>
+#include <deque>
+#include <type_traits>
+#include <algorithm>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <unordered_map>
+#include <filesystem>
+#include "libflatco.h"
+#include "parallel.h"
+#include "hash.h"
+#include "mapped.h"
+#include "scan.h"
+
+namespace flatco {
+
+enum ItemKind { CODE=0, BL_func, BL_call, BL_return, BL_import };
 
 bool IsIdentFirst(char c) {
     return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || c == '_';
@@ -84,6 +40,9 @@ bool IsSpaceChar(char c) {
     return c == ' ' || c == '\t' || c == '\n' || c == '\r';
 }
 
+// The chars the parser stops at: the start of BL_ keywords, strings and comments
+static const ScanSet s_keywordScanSet('B', '"', '\'', '/', 'B');
+
 ItemKind CheckKeyword(const char* p, size_t n) {
     if (n < 7 || p[0]!='B' || p[1]!='L' || p[2]!='_')
         return CODE;
@@ -96,67 +55,98 @@ ItemKind CheckKeyword(const char* p, size_t n) {
     return CODE;
 }
 
-struct Lexer;
+class Lexer;
 
+// pos points into the source, LineIndex turns it into row and column when the error is reported. An error in
+// a library imported by the source is located by fileName, row and col instead.
 struct BlError {
-    size_t row;
-    size_t col;
+    const char* pos;
     std::string s;
+    std::string fileName;
+    size_t row = 0;
+    size_t col = 0;
 
-    BlError(size_t rowA, size_t colA, const char* sA) : row(rowA), col(colA), s(sA) {}
+    BlError(const char* posA, const char* sA) : pos(posA), s(sA) {}
     BlError(const Lexer& lex, const char* sA);
 };
 
 struct Token {
-    size_t row;
-    size_t col;
     const char* s;
     size_t len;
 };
 
-class Lexer {
+// Maps positions in a source to 1-based rows and columns. Rows and columns are only needed for #line and
+// errors, so the table of line starts is built on the first query instead of being tracked by the Lexer.
+class LineIndex {
     const char* src_;
-    const char* pe_;
+    size_t len_;
+    std::vector<size_t> lineStarts_;
+
+    void build() {
+        lineStarts_.push_back(0);
+        const char* p = src_;
+        const char* pe = src_ + len_;
+        while ((p = (const char*)memchr(p, '\n', pe - p)) != nullptr)
+            lineStarts_.push_back(++p - src_);
+    }
+
+    size_t lineOf(size_t off) {
+        if (lineStarts_.empty())
+            build();
+        return std::upper_bound(lineStarts_.begin(), lineStarts_.end(), off) - lineStarts_.begin() - 1;
+    }
+
+public:
+    LineIndex(const char* src, size_t len) : src_(src), len_(len) {}
+
+    size_t row(const char* p) {
+        return lineOf(p - src_) + 1;
+    }
+
+    // The end of the source is reported as its last char, '\r' doesn't count in columns
+    void rowCol(const char* p, size_t& row, size_t& col) {
+        size_t off = p > src_ ? p - src_ : 0;
+        if (off >= len_ && len_ > 0)
+            off = len_ - 1;
+        size_t line = lineOf(off);
+        row = line + 1;
+        col = 0;
+        for (size_t i = lineStarts_[line]; i <= off && i < len_; ++i) {
+            if (src_[i] != '\r')
+                ++col;
+        }
+        if (col == 0)
+            col = 1;
+    }
+};
 
+class Lexer {
+    const char* src_;
     const char* p_;
-    size_t row_;
-    size_t col_;
+    const char* pe_;
 
 public:
-    Lexer(const char* s, size_t len) : src_(s), p_(s-1), pe_(s + len), row_(0), col_(1) {}
-    Lexer(const Lexer& lex, const char* s, size_t len, size_t row, size_t col) : src_(lex.src_), p_(s-1), pe_(s + len), row_(row), col_(col) {}
+    Lexer(const char* s, size_t len) : src_(s), p_(s-1), pe_(s + len) {}
 
-    void reset(const char* s, size_t len, size_t row, size_t col) {
+    void reset(const char* s, size_t len) {
         p_ = s - 1;
         pe_ = s + len;
-        row_ = row;
-        col_ = col;
     }
 
+    const char* src() const { return src_; }
     const char* curP() const { return p_; }
-    size_t curRow() const { return row_; }
-    size_t curCol() const { return col_; }
+    void setP(const char* p) { p_ = p; }
 
     char get() {
-        const char* p = p_;
-        if (p + 1 >= pe_) {
+        if (p_ + 1 >= pe_) {
             p_ = pe_;
             return 0;
         }
-
-        char c = *++p_;
-        if (p < src_ || *p == '\n') {
-            ++row_;
-            col_ = 0;
-        }
-        if (c != '\r')
-            ++col_;
-        return c;
+        return *++p_;
     }
 
     char skipGet(size_t n) {
         p_ += n;
-        col_ += n;
         assert(p_ <= pe_);
         if (p_ < pe_)
             return *p_;
@@ -169,23 +159,10 @@ public:
 
     char backward(size_t n) {
         p_ -= n;
-        col_ -= n;
         assert(p_ >= src_);
         return *p_;
     }
 
-    void savePos(size_t& row, size_t& col, const char*& p) {
-        row = row_;
-        col = col_;
-        p = p_;
-    }
-
-    void loadPos(size_t row, size_t col, const char* p) {
-        row_ = row;
-        col_ = col;
-        p_ = p;
-    }
-
     void skipMultilineComment() {
         bool findStar = false;
         char c = get();
@@ -200,7 +177,18 @@ public:
                 findStar = false;
             c = get();
         }
-        throw BlError(row_, col_, "Multi-line comments are not closed");
+        throw BlError(p_, "Multi-line comments are not closed");
+    }
+
+    // Does the current char follow an identifier char, i.e. it's not the start of an identifier
+    bool followsIdent() const {
+        return p_ > src_ && IsIdentOther(p_[-1]);
+    }
+
+    // Like skipCommentsGet() but first skip all chars not in set
+    char scanCommentsGet(const ScanSet& set) {
+        p_ = ScanAny(p_ + 1, pe_, set) - 1;
+        return skipCommentsGet();
     }
 
     char skipCommentsGet() {
@@ -208,9 +196,7 @@ public:
         if (c != '/')
             return c;
 
-        size_t row, col;
-        const char* p;
-        savePos(row, col, p);
+        const char* p = p_;
         c = get();
         if (c == '*')
             skipMultilineComment();
@@ -220,20 +206,18 @@ public:
                 c = get();
         }
         else {
-            loadPos(row, col, p);
+            p_ = p;
             return '/';
         }
         return ' ';
     }
 
     Token getString(char start) {
-        const char* p;
-        size_t row, col;
-        savePos(row, col, p);
+        const char* p = p_;
         char c = get();
         while (c && c != start) {
             if (c == '\n')
-                throw BlError(row_, col_, "String cross over line");
+                throw BlError(p_, "String cross over line");
             if (c == '\\') {
                 c = get();
                 if (c)
@@ -243,14 +227,12 @@ public:
                 c = get();
         }
         if (!c)
-            throw BlError(row_, col_, "String hasn't end");
-        return Token{ .row = row, .col=col, .s = p, .len = 1+(size_t)(p_ - p) };
+            throw BlError(p_, "String hasn't end");
+        return Token{ .s = p, .len = 1+(size_t)(p_ - p) };
     }
 
     Token peekIdent() {
-        const char* p;
-        size_t row, col;
-        savePos(row, col, p);
+        const char* p = p_;
         assert(IsIdentFirst(*p));
         const char* q = p+1;
         while (q < pe_) {
@@ -260,19 +242,17 @@ public:
             ++q;
         }
         size_t len = q - p;
-        return Token{ .row = row, .col = col, .s = p, .len = len };
+        return Token{ .s = p, .len = len };
     }
 
     Token getIdent() {
         Token tok = peekIdent();
-        size_t n = tok.len - 1;
-        p_ += n;
-        col_ += n;
+        p_ += tok.len - 1;
         return tok;
     }
 
     size_t getSizeFrom(const char* last) {
-        assert(p_ > last);
+        assert(p_ >= last);
         return p_ - last;
     }
 
@@ -287,9 +267,7 @@ public:
     }
 
     Token getBrackets(char start) {
-        const char* p;
-        size_t row, col;
-        savePos(row, col, p);
+        const char* p = p_;
         char end;
         if (start == '(')
             end = ')';
@@ -300,37 +278,36 @@ public:
         else if (start == '<')
             end = '>';
         else
-            throw BlError(row_, col_, "Not a left bracket");
+            throw BlError(p_, "Not a left bracket");
         int level = 1;
-        char c = skipCommentsGet();
+        const ScanSet set(start, end, '"', '\'', '/');
+        char c = scanCommentsGet(set);
         while (c) {
             if (c == end) {
                 if (level <= 0)
-                    throw BlError(row_, col_, "No matched left bracket");
+                    throw BlError(p_, "No matched left bracket");
                 --level;
                 if (level == 0)
-                    return Token{ .row = row, .col = col, .s = p, .len = 1+(size_t)(p_ - p) };
+                    return Token{ .s = p, .len = 1+(size_t)(p_ - p) };
             }
             else if (c == start)
                 ++level;
             else if (c == '"' || c == '\'')
                 getString(c);
-            c = skipCommentsGet();
+            c = scanCommentsGet(set);
         }
-        throw BlError(row_, col_, "No matched right bracket till end of file");
+        throw BlError(p_, "No matched right bracket till end of file");
     }
 
     Token getIdentSkipBlanks(char c) {
         if (!IsIdentFirst(c))
-            throw BlError(row_, col_, "Identifier should start with A-Za-z_");
+            throw BlError(p_, "Identifier should start with A-Za-z_");
         return getIdent();
     }
 
     bool getType(Token& tok, char& ch) {
         char c = skipBlanksGet();
-        const char* p;
-        size_t row, col;
-        savePos(row, col, p);
+        const char* p = p_;
         bool gotTypeName = false;
         for (;;) {
             if (gotTypeName) {
@@ -338,14 +315,14 @@ public:
                     Token tokN = getIdent();
                     if (strncmp(tokN.s, "const", tokN.len) != 0 && strncmp(tokN.s, "volatile", tokN.len) != 0) {
                         ch = backward(tokN.len - 1);
-                        tok = Token{ .row = row, .col = col, .s = p, .len = getSizeFrom(p) };
+                        tok = Token{ .s = p, .len = getSizeFrom(p) };
                         return true;
                     }
                 }
                 else if (c == '<')
                     getBrackets(c);
                 else if(c != '*' && c != '&') {
-                    tok = Token{ .row = row, .col = col, .s=p, .len=getSizeFrom(p) };
+                    tok = Token{ .s=p, .len=getSizeFrom(p) };
                     ch = c;
                     return true;
                 }
@@ -364,9 +341,7 @@ public:
 
     Token getExpr(char& c, char end) {
         c = skipBlanksGet();
-        const char* p;
-        size_t row, col;
-        savePos(row, col, p);
+        const char* p = p_;
         while(c && c!=end) {
             if (c == '"' || c == '\'')
                 getString(c);
@@ -375,20 +350,157 @@ public:
             c = skipBlanksGet();
         }
         size_t len = p_ - p;
-        return Token{ .row = row, .col = col, .s = p, .len = len};
+        return Token{ .s = p, .len = len};
+    }
+};
+
+BlError::BlError(const Lexer& lex, const char* sA) : pos(lex.curP()), s(sA) {}
+
+// Maps names in the source to indexes. Keys are views into the source, so neither inserts nor lookups
+// build strings. A few names, like a BL_func's parameters, are kept in insertion order and scanned
+// linearly, more names are also hashed into an open addressing table with linear probing.
+class NameTable {
+    static constexpr size_t k_linearMax = 8;
+
+    struct Entry {
+        std::string_view name;
+        size_t index;
+    };
+    std::vector<Entry> entries_;
+    std::vector<uint32_t> slots_; // 1 + index of entries_, 0 if empty, size is 0 or a power of 2
+
+    static size_t hash(std::string_view name) {
+        uint64_t h = 14695981039346656037ull; // FNV-1a
+        for (char c : name)
+            h = (h ^ (unsigned char)c) * 1099511628211ull;
+        return (size_t)(h ^ (h >> 32));
+    }
+
+    void place(uint32_t entry) {
+        size_t mask = slots_.size() - 1;
+        size_t i = hash(entries_[entry].name) & mask;
+        while (slots_[i])
+            i = (i + 1) & mask;
+        slots_[i] = entry + 1;
+    }
+
+    void rehash() {
+        slots_.assign(slots_.empty() ? 4 * k_linearMax : 2 * slots_.size(), 0);
+        for (uint32_t i = 0; i < entries_.size(); ++i)
+            place(i);
+    }
+
+public:
+    size_t size() const { return entries_.size(); }
+
+    void clear() {
+        entries_.clear();
+        slots_.clear();
+    }
+
+    // nullptr if name isn't in the table
+    const size_t* find(std::string_view name) const {
+        if (slots_.empty()) {
+            for (auto& entry : entries_) {
+                if (entry.name == name)
+                    return &entry.index;
+            }
+            return nullptr;
+        }
+        size_t mask = slots_.size() - 1;
+        for (size_t i = hash(name) & mask; slots_[i]; i = (i + 1) & mask) {
+            auto& entry = entries_[slots_[i] - 1];
+            if (entry.name == name)
+                return &entry.index;
+        }
+        return nullptr;
+    }
+
+    // false if name is already in the table
+    bool insert(std::string_view name, size_t index) {
+        if (find(name))
+            return false;
+        entries_.push_back(Entry{ .name = name, .index = index });
+        if (entries_.size() > k_linearMax) {
+            if (2 * entries_.size() > slots_.size())
+                rehash();
+            else
+                place((uint32_t)entries_.size() - 1);
+        }
+        return true;
+    }
+};
+
+// Bump allocator for the parser's nodes. Nodes never move and are all freed with the arena, so they can only
+// be trivially destructible.
+class Arena {
+    std::vector<std::unique_ptr<char[]>> blocks_;
+    char* p_ = nullptr;
+    char* pe_ = nullptr;
+    size_t size_ = 0;
+    size_t blockSize_;
+
+public:
+    explicit Arena(size_t blockSize = 64 * 1024) : blockSize_(blockSize) {}
+
+    // Bytes of the blocks
+    size_t size() const { return size_; }
+
+    void* alloc(size_t size, size_t align) {
+        char* p = (char*)(((uintptr_t)p_ + align - 1) & ~(uintptr_t)(align - 1));
+        if (!p_ || size > (size_t)(pe_ - p)) {
+            // Big allocations get a block of their own, the current block can still be filled
+            if (size > blockSize_ / 4) {
+                size_ += size;
+                return blocks_.emplace_back(new char[size]).get();
+            }
+            size_ += blockSize_;
+            p = blocks_.emplace_back(new char[blockSize_]).get();
+            pe_ = p + blockSize_;
+        }
+        p_ = p + size;
+        return p;
+    }
+
+    template <typename T>
+    T* copy(const T* src, size_t n) {
+        static_assert(std::is_trivially_copyable_v<T> && std::is_trivially_destructible_v<T>);
+        if (n == 0)
+            return nullptr;
+        T* p = (T*)alloc(n * sizeof(T), alignof(T));
+        memcpy((void*)p, src, n * sizeof(T));
+        return p;
+    }
+
+    std::string_view copy(std::string_view s) {
+        return std::string_view(copy(s.data(), s.size()), s.size());
     }
 };
 
-BlError::BlError(const Lexer& lex, const char* sA) : row(lex.curRow()), col(lex.curCol()), s(sA) {}
+// n contiguous T owned by an Arena
+template <typename T>
+struct Span {
+    T* p = nullptr;
+    size_t n = 0;
+
+    Span() = default;
+    Span(T* pA, size_t nA) : p(pA), n(nA) {}
+    Span(Arena& arena, const std::vector<T>& v) : p(arena.copy(v.data(), v.size())), n(v.size()) {}
+
+    size_t size() const { return n; }
+    bool empty() const { return n == 0; }
+    T* begin() const { return p; }
+    T* end() const { return p + n; }
+    T& operator[](size_t i) const { return p[i]; }
+};
 
 struct SeqInsertable {
     std::string_view s;
-    std::vector<size_t> seqPositions;
+    Span<size_t> seqPositions;
 };
 
 struct CxxItem {
-    size_t row;
-    size_t col;
+    const char* pos;
     ItemKind kind;
     SeqInsertable s;
     size_t index; // of Parser::funcs_, Parser::calls_, FuncItem::calls, FuncItem::returns
@@ -400,31 +512,334 @@ struct FuncParam {
 };
 
 struct ReturnItem {
-    size_t row;
-    size_t col;
+    const char* pos;
     SeqInsertable seqInsertable;
 };
 
+// How often a BL_call site runs by the profile, see Parser::planProfile()
+enum Heat : unsigned char { Unrated, Hot, Cold };
+
 struct CallItem {
-    size_t row;
-    size_t col;
+    const char* pos;
     std::string_view name; // BL_func name
     SeqInsertable lval;
-    std::vector<SeqInsertable> params;
+    SeqInsertable declType; // of the variable lval declared by "declType lval = BL_call(...)", empty if none
+    SeqInsertable stmt;     // the code of its statement before a BL_call in an expression, see ParseBlCall()
+    Span<SeqInsertable> params;
     size_t funcIndex;
+    size_t seqOffset; // seq of the callee's expansion relative to the caller's one, the seq of the shared
+                      // expansion for a top-level shared site
+    bool direct;      // the callee is a plain BL_func called as a function instead of expanded
+    uint32_t site;    // 1.. among the calls sharing one expansion of the callee, the first one holds it, 0 if none
+    uint32_t nSites;  // of the first site
+    bool outlined;    // the callee is outlined, the call co_awaits its coroutine
+    Heat heat;
+    uint32_t profileSite; // in the tables of the source counting its executions and time, see Parser::planProfile()
+    bool inExpr;      // the BL_call is in an expression, its expansion is hoisted before stmt
+
+    // The result is constructed in a flatco::RetSlot by the BL_return of the expansion
+    bool slotted() const { return !declType.s.empty() || inExpr; }
+};
+
+// One step of a BL_func's expansion template, see Parser::compile()
+struct TplPiece {
+    enum Kind : unsigned char {
+        Text,       // s[0..n) verbatim
+        SeqHex,     // seq of the expansion in hex
+        Insertable, // *si with the expansion's seq inserted
+        Lval,       // "<lval>=" of the call being expanded, " " if it has no lval
+        Param,      // argument n of the call being expanded
+        Call,       // expansion of calls[n]
+        SharedDecl, // declarations of the expansion shared by calls[n] and the following calls of its callee
+        Shared,     // calls[n] sharing an expansion of its callee
+        LvalEnd,    // closes Lval, after the value of a BL_return
+        CallSeq,    // seq of the expansion of calls[n] in hex
+    };
+
+    Kind kind;
+    const char* s;
+    size_t n;
+    const SeqInsertable* si;
 };
 
 struct FuncItem {
     Token name;
+    Token retType;
+    Token coType;             // ty of BL_func(ty), the return type of its coroutine when outlined
+    Span<FuncParam> params;
+    Span<CxxItem> items;
+    Span<ReturnItem> returns;
+    Span<CallItem> calls;
+    bool retvoid;
+    size_t seqCount;          // seqs used by an expansion, i.e. the number of BL_funcs expanded in it
+    size_t expandSize;        // about the bytes of an expansion, without the lval and arguments of the call
+    Span<TplPiece> tpl;
+    bool imported;            // compiled by the library it's imported from, which owns its nodes and template
+    bool suspends;            // co_await, co_yield, co_return or return may be in its body
+    bool leaves;              // co_yield, co_return or return may be in its body, acting on the caller's coroutine
+    bool plain;               // generated as a function where it's defined, see Parser::prepare()
+    bool shared;              // BL_func(ty, shared), its calls in one block share an expansion, see Parser::compile()
+    bool outline;             // BL_func(ty, outline)
+    bool outlinable;          // could run in a coroutine of its own, see Parser::compile()
+    bool outlined;            // the calls following it co_await its coroutine but the hot ones
+    bool coroutine;           // generated as a coroutine where it's defined, some calls co_await it
+};
+
+// Where a BL_func is parsed before its nodes are copied to the arena, reused for all BL_funcs of a source.
+// paramIndexes is empty outside BL_funcs.
+struct ParseScratch {
+    explicit ParseScratch(Arena& arenaA) : arena(arenaA) {}
+
+    Arena& arena;
+    NameTable paramIndexes;
+    std::vector<size_t> positions;
+    std::vector<SeqInsertable> args;
     std::vector<FuncParam> params;
-    std::map<std::string, size_t> paramIndexes;
     std::vector<CxxItem> items;
     std::vector<ReturnItem> returns;
     std::vector<CallItem> calls;
-    std::vector<size_t> callers;
-    bool retvoid;
 };
 
+// The nodes parsed from a BL_func body
+struct BodyNodes {
+    Span<CxxItem> items;
+    Span<ReturnItem> returns;
+    Span<CallItem> calls;
+    bool suspends;
+    bool leaves;
+};
+
+// p moved by delta, nullptr stays nullptr
+const char* Relocate(const char* p, intptr_t delta) {
+    return p ? (const char*)((uintptr_t)p + (uintptr_t)delta) : nullptr;
+}
+
+SeqInsertable Relocate(const SeqInsertable& si, intptr_t delta, Arena& arena) {
+    return SeqInsertable{ .s = std::string_view(Relocate(si.s.data(), delta), si.s.size()),
+                          .seqPositions = Span<size_t>(arena.copy(si.seqPositions.p, si.seqPositions.n), si.seqPositions.n) };
+}
+
+// Copy body to arena with all pointers into the source moved by delta. The Cache keeps bodies moved to offsets
+// from their '{' and moves them to the '{' of the source they are reused in, the pointers are never followed
+// in between.
+BodyNodes Relocate(const BodyNodes& body, intptr_t delta, Arena& arena) {
+    BodyNodes r{ .items = Span<CxxItem>(arena.copy(body.items.p, body.items.n), body.items.n),
+                 .returns = Span<ReturnItem>(arena.copy(body.returns.p, body.returns.n), body.returns.n),
+                 .calls = Span<CallItem>(arena.copy(body.calls.p, body.calls.n), body.calls.n),
+                 .suspends = body.suspends, .leaves = body.leaves };
+    for (auto& item : r.items) {
+        item.pos = Relocate(item.pos, delta);
+        item.s = Relocate(item.s, delta, arena);
+    }
+    for (auto& ret : r.returns) {
+        ret.pos = Relocate(ret.pos, delta);
+        ret.seqInsertable = Relocate(ret.seqInsertable, delta, arena);
+    }
+    for (auto& call : r.calls) {
+        call.pos = Relocate(call.pos, delta);
+        call.name = std::string_view(Relocate(call.name.data(), delta), call.name.size());
+        call.lval = Relocate(call.lval, delta, arena);
+        call.declType = Relocate(call.declType, delta, arena);
+        call.stmt = Relocate(call.stmt, delta, arena);
+        SeqInsertable* params = arena.copy(call.params.p, call.params.n);
+        for (size_t i = 0; i < call.params.n; ++i)
+            params[i] = Relocate(params[i], delta, arena);
+        call.params = Span<SeqInsertable>(params, call.params.n);
+        call.funcIndex = 0;
+        call.seqOffset = 0;
+        call.direct = false;
+        call.site = 0;
+        call.nSites = 0;
+        call.outlined = false;
+        call.heat = Unrated;
+        call.profileSite = 0;
+    }
+    return r;
+}
+
+struct CacheKey {
+    uint64_t h1, h2;
+
+    bool operator==(const CacheKey& other) const { return h1 == other.h1 && h2 == other.h2; }
+};
+
+struct CacheKeyHash {
+    size_t operator()(const CacheKey& key) const { return (size_t)key.h1; }
+};
+
+// Contents hashes of library files
+using LibraryHashes = std::vector<std::pair<std::string, CacheKey>>;
+
+struct CachedResult {
+    bool ok;
+    std::string output;
+    std::vector<Diagnostic> diagnostics;
+    LibraryHashes libraries; // the result is only valid while they are unchanged
+};
+
+struct CachedBody {
+    Arena arena{ 1024 }; // bodies are small and many
+    BodyNodes nodes;
+};
+
+// The counts of a profile by the key of their site, see ProfileKey()
+struct Profile::Impl {
+    std::unordered_map<std::string, uint64_t> counts;
+    uint64_t h1 = k_hashSeed1, h2 = k_hashSeed2; // of the text parsed
+
+    bool parse(std::string_view text);
+};
+
+// "<file>\t<row>\t<col>\t<BL_func>", how a site is written by flatco_rt.h
+void ProfileKey(std::string& key, std::string_view file, size_t row, size_t col, std::string_view func) {
+    char buf[48];
+    key.assign(file);
+    key.append(buf, snprintf(buf, sizeof(buf), "\t%zu\t%zu\t", row, col));
+    key += func;
+}
+
+// Lines "<file>\t<row>\t<col>\t<BL_func>\t<count>", the counts of a site written several times add up. Empty lines
+// and the ones starting with '#' are skipped.
+bool Profile::Impl::parse(std::string_view text) {
+    HashBytes(text.data(), text.size(), h1, h2);
+    while (!text.empty()) {
+        size_t n = text.find('\n');
+        std::string_view line = text.substr(0, n);
+        text.remove_prefix(n == text.npos ? text.size() : n + 1);
+        if (!line.empty() && line.back() == '\r')
+            line.remove_suffix(1);
+        if (line.empty() || line[0] == '#')
+            continue;
+        size_t tab = line.rfind('\t');
+        if (tab == line.npos || tab + 1 == line.size())
+            return false;
+        uint64_t count = 0;
+        for (char c : line.substr(tab + 1)) {
+            if (c < '0' || c > '9' || count > (UINT64_MAX - 9) / 10)
+                return false;
+            count = count * 10 + (c - '0');
+        }
+        uint64_t& sum = counts[std::string(line.substr(0, tab))];
+        sum = count > UINT64_MAX - sum ? UINT64_MAX : sum + count;
+    }
+    return true;
+}
+
+struct Library;
+
+// One LRU list for results, bodies and libraries, the keys of each kind are hashed with a different tag. Entries
+// are shared so that they can be used after the lock is released even if they are dropped meanwhile.
+struct Cache::Impl {
+    struct Entry {
+        CacheKey key;
+        std::shared_ptr<const CachedResult> result;
+        std::shared_ptr<const CachedBody> body;
+        std::shared_ptr<const Library> library;
+        size_t bytes;
+    };
+
+    mutable std::mutex mutex;
+    size_t maxBytes;
+    size_t bytes = 0;
+    std::list<Entry> lru; // most recently used first
+    std::unordered_map<CacheKey, std::list<Entry>::iterator, CacheKeyHash> index;
+    Stats stats{};
+
+    explicit Impl(size_t maxBytesA) : maxBytes(maxBytesA) {}
+
+    const Entry* find(const CacheKey& key) {
+        auto it = index.find(key);
+        if (it == index.end())
+            return nullptr;
+        lru.splice(lru.begin(), lru, it->second);
+        return &*it->second;
+    }
+
+    void insert(Entry entry) {
+        auto it = index.find(entry.key);
+        if (it != index.end()) {
+            bytes -= it->second->bytes;
+            lru.erase(it->second);
+            index.erase(it);
+        }
+        bytes += entry.bytes;
+        lru.push_front(std::move(entry));
+        index.emplace(lru.front().key, lru.begin());
+        while (bytes > maxBytes && lru.size() > 1) {
+            bytes -= lru.back().bytes;
+            index.erase(lru.back().key);
+            lru.pop_back();
+        }
+    }
+
+    std::shared_ptr<const CachedResult> findResult(const CacheKey& key) {
+        std::lock_guard<std::mutex> lock(mutex);
+        const Entry* entry = find(key);
+        ++(entry ? stats.resultHits : stats.resultMisses);
+        return entry ? entry->result : nullptr;
+    }
+
+    std::shared_ptr<const CachedBody> findBody(const CacheKey& key) {
+        std::lock_guard<std::mutex> lock(mutex);
+        const Entry* entry = find(key);
+        ++(entry ? stats.bodyHits : stats.bodyMisses);
+        return entry ? entry->body : nullptr;
+    }
+
+    // Count a hit of findResult() which turned out out of date as a miss
+    void staleResult() {
+        std::lock_guard<std::mutex> lock(mutex);
+        --stats.resultHits;
+        ++stats.resultMisses;
+    }
+
+    std::shared_ptr<const Library> findLibrary(const CacheKey& key) {
+        std::lock_guard<std::mutex> lock(mutex);
+        const Entry* entry = find(key);
+        return entry ? entry->library : nullptr;
+    }
+
+    void insert(const CacheKey& key, std::shared_ptr<const CachedResult> result) {
+        size_t size = sizeof(CachedResult) + result->output.size();
+        for (auto& diag : result->diagnostics)
+            size += sizeof(Diagnostic) + diag.message.size() + diag.fileName.size();
+        for (auto& lib : result->libraries)
+            size += sizeof(lib) + lib.first.size();
+        std::lock_guard<std::mutex> lock(mutex);
+        insert(Entry{ .key = key, .result = std::move(result), .body = nullptr, .library = nullptr, .bytes = size });
+    }
+
+    void insert(const CacheKey& key, std::shared_ptr<const CachedBody> body) {
+        size_t size = sizeof(CachedBody) + body->arena.size();
+        std::lock_guard<std::mutex> lock(mutex);
+        insert(Entry{ .key = key, .result = nullptr, .body = std::move(body), .library = nullptr, .bytes = size });
+    }
+
+    void insert(const CacheKey& key, std::shared_ptr<const Library> library, size_t size) {
+        std::lock_guard<std::mutex> lock(mutex);
+        insert(Entry{ .key = key, .result = nullptr, .body = nullptr, .library = std::move(library), .bytes = size });
+    }
+};
+
+Cache::Cache(size_t maxBytes) : impl_(new Impl(maxBytes)) {}
+
+Cache::~Cache() = default;
+
+Cache::Stats Cache::stats() const {
+    std::lock_guard<std::mutex> lock(impl_->mutex);
+    Stats stats = impl_->stats;
+    stats.entries = impl_->lru.size();
+    stats.bytes = impl_->bytes;
+    return stats;
+}
+
+void Cache::clear() {
+    std::lock_guard<std::mutex> lock(impl_->mutex);
+    impl_->lru.clear();
+    impl_->index.clear();
+    impl_->bytes = 0;
+}
+
 bool CheckParamPrefix(const char* s, const char* src) {
     while (--s >= src) {
         char c = *s;
@@ -445,16 +860,17 @@ bool CheckParamPrefix(const char* s, const char* src) {
     return true;
 }
 
-SeqInsertable FindParams(const std::string_view& s, const std::map<std::string, size_t>& paramIndexes) {
-    std::vector<size_t> positions;
+SeqInsertable FindParams(const std::string_view& s, ParseScratch& scratch) {
+    const NameTable& paramIndexes = scratch.paramIndexes;
+    std::vector<size_t>& positions = scratch.positions;
+    positions.clear();
     if (paramIndexes.size() > 0) {
         Lexer lex(s.data(), s.size());
         char c = lex.skipBlanksGet();
         while (c) {
             if (IsIdentFirst(c)) {
                 Token tok = lex.getIdent();
-                auto it = paramIndexes.find(std::string(tok.s, tok.len));
-                if (it != paramIndexes.cend()) {
+                if (paramIndexes.find(std::string_view(tok.s, tok.len))) {
                     if (CheckParamPrefix(tok.s, s.data()))
                         positions.push_back(tok.s - s.data());
                 }
@@ -462,29 +878,276 @@ SeqInsertable FindParams(const std::string_view& s, const std::map<std::string,
             c = lex.skipBlanksGet();
         }
     }
-    return SeqInsertable{ .s = s, .seqPositions = positions };
+    return SeqInsertable{ .s = s, .seqPositions = Span<size_t>(scratch.arena, positions) };
+}
+
+// Is the identifier ident in s
+bool HasIdent(std::string_view s, std::string_view ident) {
+    for (size_t i = 0; i < s.size(); ) {
+        if (!IsIdentFirst(s[i]) || (i > 0 && IsIdentOther(s[i - 1]))) {
+            ++i;
+            continue;
+        }
+        size_t n = 1;
+        while (i + n < s.size() && IsIdentOther(s[i + n]))
+            ++n;
+        if (s.substr(i, n) == ident)
+            return true;
+        i += n;
+    }
+    return false;
+}
+
+std::string_view TrimRight(std::string_view s) {
+    while (!s.empty() && IsSpaceChar(s.back()))
+        s.remove_suffix(1);
+    return s;
+}
+
+// The index of the last char of the string, char literal or comment starting at s[i], i if none starts there
+size_t SkipNonCode(std::string_view s, size_t i) {
+    char c = s[i];
+    if (c == '"' || (c == '\'' && !(i > 0 && isdigit((unsigned char)s[i - 1])))) { // not a digit separator
+        for (++i; i < s.size() && s[i] != c; ++i) {
+            if (s[i] == '\\')
+                ++i;
+        }
+        return std::min(i, s.size() - 1);
+    }
+    if (c != '/' || i + 1 >= s.size())
+        return i;
+    if (s[i + 1] == '/')
+        return std::min(s.find('\n', i), s.size() - 1);
+    if (s[i + 1] == '*')
+        return std::min(s.find("*/", i + 2) + 1, s.size() - 1);
+    return i;
+}
+
+// The identifier s ends with, empty if none
+std::string_view LastWord(std::string_view s) {
+    size_t n = s.size();
+    while (n > 0 && IsIdentOther(s[n - 1]))
+        --n;
+    return s.substr(n);
+}
+
+// Does a '{' following the code of a statement open a block instead of an initializer or a lambda
+bool OpensBlock(std::string_view stmt) {
+    stmt = TrimRight(stmt);
+    if (stmt.empty())
+        return true;
+    char last = stmt.back();
+    std::string_view word = LastWord(stmt);
+    if (strchr("=,([]", last) || word == "return" || word == "co_return" || word == "co_yield" || word == "throw")
+        return false;
+    if (!IsIdentOther(last) && last != '>')
+        return true;
+    if (word == "else" || word == "do" || word == "try" || word == "const" || word == "noexcept" ||
+        word == "override" || word == "final")
+        return true;
+    for (const char* keyword : { "namespace", "class", "struct", "union", "enum" }) {
+        if (HasIdent(stmt, keyword))
+            return true;
+    }
+    return false;
+}
+
+// The start of the statement the code before a BL_call ends in: after the last ';' out of parentheses, '{' or '}'
+// of a block, and the comments, preprocessor lines and labels following. bounded is false if the statement starts
+// before the code, inSwitch is true if the innermost block opened in the code is the body of a switch.
+size_t StatementStart(std::string_view code, bool& bounded, bool& inSwitch) {
+    std::string opens; // '(', '[', '{' of an initializer, 'B' of a block or 'S' of the body of a switch
+    size_t start = 0;
+    bounded = false;
+    for (size_t i = 0; i < code.size(); ++i) {
+        size_t j = SkipNonCode(code, i);
+        if (j != i) {
+            i = j;
+            continue;
+        }
+        char c = code[i];
+        bool inBlock = opens.empty() || opens.back() == 'B' || opens.back() == 'S';
+        if (c == '(' || c == '[')
+            opens += c;
+        else if (c == ')' || c == ']') {
+            if (!inBlock)
+                opens.pop_back();
+        }
+        else if (c == '{') {
+            std::string_view header = code.substr(start, i - start);
+            bool block = inBlock && OpensBlock(header);
+            if (block) {
+                size_t j = 0;
+                while (j < header.size() && IsSpaceChar(header[j]))
+                    ++j;
+                size_t n = j;
+                while (n < header.size() && IsIdentOther(header[n]))
+                    ++n;
+                opens += header.substr(j, n - j) == "switch" ? 'S' : 'B';
+                start = i + 1;
+            }
+            else
+                opens += '{';
+        }
+        else if (c == '}') {
+            if (!opens.empty())
+                opens.pop_back();
+            if (inBlock)
+                start = i + 1;
+        }
+        else if (c == ';' && inBlock)
+            start = i + 1;
+        else
+            continue;
+        bounded = bounded || start == i + 1;
+    }
+    size_t block = opens.find_last_of("BS");
+    inSwitch = block != opens.npos && opens[block] == 'S';
+
+    for (;;) {
+        while (start < code.size() && IsSpaceChar(code[start]))
+            ++start;
+        if (start >= code.size())
+            return code.size();
+        size_t j = SkipNonCode(code, start);
+        if (j != start || code[start] == '#') {
+            start = code[start] == '#' ? std::min(code.find('\n', start), code.size()) : j + 1;
+            continue;
+        }
+        // A label: "case <constant>:", "default:" or "<identifier>:"
+        if (!IsIdentFirst(code[start]))
+            return start;
+        size_t n = start;
+        while (n < code.size() && IsIdentOther(code[n]))
+            ++n;
+        if (code.substr(start, n - start) == "case") {
+            for (; n < code.size(); ++n) {
+                n = SkipNonCode(code, n);
+                if (code[n] == ':' && code.substr(n, 2) != "::" && (n == 0 || code[n - 1] != ':'))
+                    break;
+            }
+        }
+        else {
+            while (n < code.size() && IsSpaceChar(code[n]))
+                ++n;
+        }
+        if (n >= code.size() || code[n] != ':' || code.substr(n, 2) == "::")
+            return start;
+        start = n + 1;
+    }
+}
+
+// Does the code of a statement from start, before a BL_call, end with "T x =", the declaration of a variable the
+// call initializes: name is the position of x
+bool FindDecl(std::string_view code, size_t start, size_t& name) {
+    std::string_view s = TrimRight(code);
+    if (s.empty() || s.back() != '=')
+        return false;
+    s = TrimRight(s.substr(0, s.size() - 1));
+    if (s.empty() || strchr("=!<>+-*/%^|&", s.back()) || start >= s.size())
+        return false;
+    name = s.size();
+    while (name > start && IsIdentOther(s[name - 1]))
+        --name;
+    if (name == s.size() || !IsIdentFirst(s[name]))
+        return false;
+    std::string_view type = TrimRight(s.substr(start, name - start));
+    if (type.empty() || (!IsIdentFirst(type[0]) && type[0] != ':') || type.find('=') != type.npos ||
+        type.find(';') != type.npos || (type.size() >= 2 && type.substr(type.size() - 2) == "->") ||
+        !(IsIdentOther(type.back()) || strchr(">*&)", type.back())))
+        return false;
+    for (const char* keyword : { "return", "co_return", "co_yield", "throw", "else", "case", "if", "while", "for", "switch" }) {
+        if (HasIdent(type, keyword))
+            return false;
+    }
+    // Commas only in template arguments or parentheses
+    int depth = 0;
+    for (char c : type) {
+        if (c == '<' || c == '(' || c == '[')
+            ++depth;
+        else if (c == '>' || c == ')' || c == ']')
+            --depth;
+        else if (c == ',' && depth == 0)
+            return false;
+    }
+    return true;
+}
+
+// The expansion of a BL_call in an expression runs before its statement, whose code before the call, head, runs
+// after it. That must not change whether the call runs, how often, or its order with the code C++ sequences
+// before it.
+void CheckHoist(std::string_view head) {
+    size_t n = 0;
+    while (n < head.size() && IsIdentOther(head[n]))
+        ++n;
+    std::string_view keyword = head.substr(0, n);
+    if (keyword == "while" || keyword == "for" || keyword == "do")
+        throw BlError(head.data(), "BL_call in an expression can't be in a loop condition or a loop without braces");
+    if (keyword == "else")
+        throw BlError(head.data(), "BL_call in an expression can't follow else without braces");
+    bool condition = keyword == "if" || keyword == "switch";
+    int depth = 0;
+    for (size_t i = n; i < head.size(); ++i) {
+        size_t j = SkipNonCode(head, i);
+        if (j != i) {
+            i = j;
+            continue;
+        }
+        char c = head[i];
+        if (c == '(')
+            ++depth;
+        else if (c == ')' && --depth == 0 && condition)
+            throw BlError(head.data(), "BL_call in an expression can't be in the statement of an if or switch without braces");
+        else if (c == ';' && condition)
+            throw BlError(head.data() + i, "BL_call in an expression can't be in the condition of an if or switch with an initializer");
+        else if (c == '?' || ((c == '&' || c == '|' || c == '<') && head.substr(i + 1, 1) == std::string_view(&c, 1) &&
+                              head.substr(i + 2, 1) != "="))
+            throw BlError(head.data() + i, "BL_call in an expression can't follow &&, ||, ? or <<, which may skip it or run before it");
+    }
+}
+
+// Does the code of a statement before a BL_call, ending with ')', end with the condition of an if, a loop or a
+// switch, the call being its statement, instead of a cast or a call the BL_call is in
+bool EndsWithCondition(std::string_view head) {
+    std::vector<size_t> opens;
+    size_t open = head.npos;
+    for (size_t i = 0; i < head.size(); ++i) {
+        size_t j = SkipNonCode(head, i);
+        if (j != i) {
+            i = j;
+            continue;
+        }
+        if (head[i] == '(')
+            opens.push_back(i);
+        else if (head[i] == ')' && !opens.empty()) {
+            open = opens.back();
+            opens.pop_back();
+        }
+    }
+    if (open == head.npos)
+        return false;
+    std::string_view word = LastWord(TrimRight(head.substr(0, open)));
+    return word == "if" || word == "while" || word == "for" || word == "switch" || word == "constexpr";
 }
 
-void ParseBlCall(Lexer& lex, std::vector<CxxItem>& items, std::vector<CallItem>& calls, const std::map<std::string, size_t>& paramIndexes) {
+void ParseBlCall(Lexer& lex, std::vector<CxxItem>& items, std::vector<CallItem>& calls, ParseScratch& scratch) {
     char c = lex.skipSkipBlanksGet(7); // strlen("BL_call")
     if (c != '(')
         throw BlError(lex, "Should be '(' after BL_call");
     Token tok = lex.getBrackets(c);
 
-    Lexer callLex(lex, tok.s + 1, tok.len - 2, tok.row, tok.col+1);
+    Lexer callLex(tok.s + 1, tok.len - 2);
     Token tokLval = callLex.getExpr(c, '=');
     SeqInsertable lval;
     if (c == '=') {
         if (tokLval.len <= 0)
             throw BlError(callLex, "BL_call expected left value before '='");
-        lval = FindParams(std::string_view(tokLval.s, tokLval.len), paramIndexes);
-        const char* p;
-        size_t row, col;
-        callLex.savePos(row, col, p);
-        callLex.reset(p + 1, tok.len - 3 - (p - tokLval.s), row, col + 1);
+        lval = FindParams(std::string_view(tokLval.s, tokLval.len), scratch);
+        const char* p = callLex.curP();
+        callLex.reset(p + 1, tok.len - 3 - (p - tokLval.s));
     }
     else
-        callLex.reset(tok.s + 1, tok.len - 2, tok.row, tok.col + 1);
+        callLex.reset(tok.s + 1, tok.len - 2);
 
     Token tokName = callLex.getIdentSkipBlanks(callLex.skipBlanksGet());
     c = callLex.skipBlanksGet();
@@ -496,12 +1159,13 @@ void ParseBlCall(Lexer& lex, std::vector<CxxItem>& items, std::vector<CallItem>&
     if (c)
         throw BlError(callLex, "BL_call syntax error after ')'");
 
-    Lexer paramLex(callLex, tokParams.s + 1, tokParams.len - 2, tokParams.row, tokParams.col+1);
-    std::vector<SeqInsertable> params;
+    Lexer paramLex(tokParams.s + 1, tokParams.len - 2);
+    std::vector<SeqInsertable>& params = scratch.args;
+    params.clear();
     Token tokPara = paramLex.getExpr(c, ',');
     for (;;) {
         if (tokPara.len > 0)
-            params.push_back(FindParams(std::string_view(tokPara.s, tokPara.len), paramIndexes));
+            params.push_back(FindParams(std::string_view(tokPara.s, tokPara.len), scratch));
         if (c != ',')
             break;
         tokPara = paramLex.getExpr(c, ',');
@@ -509,51 +1173,315 @@ void ParseBlCall(Lexer& lex, std::vector<CxxItem>& items, std::vector<CallItem>&
     if (c)
         throw BlError(paramLex, "',' expected");
 
-    calls.emplace_back(tokName.row, tokName.col, std::string_view(tokName.s, tokName.len), lval, params, 0);
-    items.emplace_back(tok.row, tok.col, BL_call, SeqInsertable{}, calls.size() - 1);
+    // "T x = BL_call(f(args))" declares the variable x initialized by the call, the code before it ends at the
+    // declaration. A BL_call in an expression takes the code of its statement before it, see Parser::genItems().
+    SeqInsertable declType, stmt;
+    bool inExpr = false;
+    Lexer next = lex;
+    bool ends = next.skipBlanksGet() == ';';
+    if (!items.empty() && items.back().kind == CODE) {
+        SeqInsertable& code = items.back().s;
+        bool bounded, inSwitch;
+        size_t start = StatementStart(code.s, bounded, inSwitch), name;
+        std::string_view head = TrimRight(code.s.substr(start));
+        if (ends && FindDecl(code.s, start, name)) {
+            if (!lval.s.empty())
+                throw BlError(tokLval.s, "BL_call initializing a variable can't assign a left value");
+            std::string_view decl = code.s.substr(start, head.size() - 1);
+            declType = FindParams(TrimRight(decl.substr(0, name - start)), scratch);
+            lval = FindParams(TrimRight(decl.substr(name - start)), scratch);
+        }
+        else if (ends && (head.empty() || (head.back() == ')' && EndsWithCondition(head)) || LastWord(head) == "else" ||
+                          LastWord(head) == "do"))
+            start = code.s.size(); // a statement
+        else {
+            if (!bounded && items.size() >= 2 && items[items.size() - 2].kind == BL_call)
+                throw BlError(tok.s, "Only one BL_call can be in an expression");
+            // Its slot is declared in the block, the case labels after it couldn't jump over the declaration
+            if (inSwitch)
+                throw BlError(tok.s, "BL_call in an expression can't be directly in a switch, put its case in braces");
+            CheckHoist(head);
+            stmt = FindParams(code.s.substr(start), scratch);
+            inExpr = true;
+        }
+        if (start < code.s.size()) {
+            code.s = code.s.substr(0, start);
+            while (code.seqPositions.n > 0 && code.seqPositions[code.seqPositions.n - 1] >= start)
+                --code.seqPositions.n;
+            if (code.s.empty())
+                items.pop_back();
+        }
+    }
+    else if (!ends)
+        inExpr = true;
+    if (inExpr && !lval.s.empty())
+        throw BlError(tokLval.s, "BL_call in an expression can't assign a left value");
+
+    calls.emplace_back(tokName.s, std::string_view(tokName.s, tokName.len), lval, declType, stmt,
+                       Span<SeqInsertable>(scratch.arena, params), 0);
+    calls.back().inExpr = inExpr;
+    items.emplace_back(tok.s, BL_call, SeqInsertable{}, calls.size() - 1);
 }
 
-void ParseBlReturn(Lexer& lex, std::vector<CxxItem>& items, std::vector<ReturnItem>& returns, const std::map<std::string, size_t>& paramIndexes) {
+void ParseBlReturn(Lexer& lex, std::vector<CxxItem>& items, std::vector<ReturnItem>& returns, ParseScratch& scratch) {
     char c = lex.skipSkipBlanksGet(9); // strlen("BL_return")
     if (c != '(')
         throw BlError(lex, "Should be '(' after BL_return");
     Token tok = lex.getBrackets(c);
-    returns.emplace_back(tok.row, tok.col, FindParams(std::string_view(tok.s+1, tok.len-2), paramIndexes));
-    items.emplace_back(tok.row, tok.col, BL_return, SeqInsertable{}, returns.size()-1);
+    returns.emplace_back(tok.s, FindParams(std::string_view(tok.s+1, tok.len-2), scratch));
+    items.emplace_back(tok.s, BL_return, SeqInsertable{}, returns.size()-1);
 }
 
-class Parser {
-    Lexer lex_;
-    std::vector<CxxItem> items_;
-    std::vector<FuncItem> funcs_;
-    std::vector<CallItem> calls_;
-    std::map<std::string, size_t> name2Func_;
-
-    void checkAddCode(size_t row, size_t col, const char* p) {
-        size_t n = lex_.getSizeFrom(p);
-        if (n > 0)
-            items_.emplace_back(row, col, CODE, SeqInsertable{ std::string_view(p, n), {} }, 0);
-    }
-
-    void parseBlFunc();
-    void prepare();
-    void expand(FILE* fOut, const char* srcFileName, size_t funcIndex, const std::string& lval, const std::vector<std::string>& params, size_t& seq);
-
-public:
-    Parser(const char* src, size_t len);
+// A BL_call of a shareable BL_func, in the block whose '{' is before block
+struct SharedSite {
+    size_t funcIndex;
+    const char* block;
+    size_t call;  // index of the CallItem
+    size_t first; // of the first site of the calls sharing its expansion
+};
 
-    void gen(FILE* fOut, const char* srcFileName);
+// Where the declarations of a shared expansion go: after the '{' of the block of its calls, nullptr for the body
+// of a BL_func, where they follow the parameters
+struct SharedDecl {
+    const char* pos;
+    size_t call; // the first site
 };
 
-void Parser::parseBlFunc() {
-    const char* p0;
-    size_t row0, col0;
-    lex_.savePos(row0, col0, p0);
+// The block of every BL_call among items by the braces of the code around it: the position following the '{'
+// of the innermost block holding it, nullptr if none.
+void FindCallBlocks(const CxxItem* items, size_t n, std::vector<const char*>& blocks) {
+    std::vector<const char*> open;
+    blocks.assign(n, nullptr);
+    for (size_t i = 0; i < n; ++i) {
+        if (items[i].kind == CODE) {
+            Lexer lex(items[i].s.s.data(), items[i].s.s.size());
+            for (char c = lex.skipCommentsGet(); c; c = lex.skipCommentsGet()) {
+                if (c == '"' || c == '\'')
+                    lex.getString(c);
+                else if (c == '{')
+                    open.push_back(lex.curP() + 1);
+                else if (c == '}' && !open.empty())
+                    open.pop_back();
+            }
+        }
+        else if (items[i].kind == BL_call && !open.empty())
+            blocks[i] = open.back();
+    }
+}
+
+// The calls of a shareable BL_func in one block share an expansion when there are two or more: the first one
+// holds it, the others store their arguments to slots, jump to it and are jumped back to by a switch. Calls in
+// different blocks don't share one, jumping into a block would skip the initializations in it, e.g. of a for
+// loop. Number the sites, given in the order of the calls, and add the declarations of their expansions to
+// decls by position.
+void GroupSites(std::vector<SharedSite>& sites, CallItem* calls, std::vector<SharedDecl>& decls) {
+    std::stable_sort(sites.begin(), sites.end(), [](const SharedSite& a, const SharedSite& b) {
+        return a.funcIndex != b.funcIndex ? a.funcIndex < b.funcIndex : a.block < b.block;
+    });
+    for (size_t g = 0, end; g < sites.size(); g = end) {
+        end = g + 1;
+        while (end < sites.size() && sites[end].funcIndex == sites[g].funcIndex && sites[end].block == sites[g].block)
+            ++end;
+        if (end - g < 2)
+            continue;
+        for (size_t k = g; k < end; ++k) {
+            calls[sites[k].call].site = (uint32_t)(k - g + 1);
+            sites[k].first = sites[g].call;
+        }
+        calls[sites[g].call].nSites = (uint32_t)(end - g);
+        decls.push_back(SharedDecl{ sites[g].block, sites[g].call });
+    }
+    std::sort(decls.begin(), decls.end(), [](const SharedDecl& a, const SharedDecl& b) { return a.pos < b.pos; });
+}
+
+// A line #include "<name>.bl.h" of a source
+struct Import {
+    const char* pos;       // of the line
+    std::string_view name; // between the quotes
+};
+
+// The settings of a Parser, the ones of the Options of a transform by default
+struct ParserOptions {
+    unsigned jobs = 1;
+    Cache::Impl* cache = nullptr;
+    bool alwaysExpand = false;
+    size_t sharedMinBytes = 0;
+    size_t maxInlineBytes = 0;
+    bool profileGenerate = false;
+    const Profile::Impl* profile = nullptr;
+    bool instrument = false;
+    bool warnCopies = false;
+    size_t parallelGenMinBytes = 0;
+
+    ParserOptions() = default;
+    explicit ParserOptions(const Options& options)
+        : jobs(options.jobs), cache(options.cache ? &options.cache->impl() : nullptr),
+          alwaysExpand(options.alwaysExpand), sharedMinBytes(options.sharedMinBytes),
+          maxInlineBytes(options.maxInlineBytes), profileGenerate(options.profileGenerate),
+          profile(options.profile ? &options.profile->impl() : nullptr), instrument(options.instrument),
+          warnCopies(options.warnCopies), parallelGenMinBytes(options.parallelGenMinBytes) {}
+};
+
+class Libraries;
+
+class Parser {
+    Lexer lex_;
+    LineIndex lines_;
+    Arena arena_; // the nodes of BL_funcs and their templates, the generated text referenced by templates
+    ParseScratch scratch_{ arena_ };
+    std::vector<CxxItem> items_;
+    std::vector<FuncItem> funcs_;
+    std::vector<CallItem> calls_;
+    NameTable name2Func_;
+    std::vector<size_t> sorted_; // funcs_ indexes, callees before callers
+    std::vector<Token> bodies_;  // of funcs_, found by phase one of parsing and parsed by phase two
+    std::deque<Arena> bodyArenas_; // the nodes of bodies parsed in parallel
+    std::vector<TplPiece> tpl_;  // the template being compiled
+    std::string text_;           // scratch for generated text
+    std::vector<Import> imports_;
+    std::vector<std::shared_ptr<const Library>> libraries_; // imported, each one after those it imports
+
+    struct ExpandFrame {
+        const FuncItem* func;
+        size_t piece;
+        size_t seq;
+        const CallItem* call;
+        size_t callerSeq;
+        bool shared;   // the expansion shared by call and the following calls of its callee
+        bool outlined; // the body of func's coroutine, call is null
+    };
+
+    unsigned jobs_;
+    Cache::Impl* cache_;
+    bool alwaysExpand_;          // no plain BL_funcs
+    size_t firstPlain_ = 0;      // items_ index of the first plain BL_func, where _BLinline is defined
+    size_t sharedMinBytes_;      // BL_funcs expanding to at least as many bytes are shared, 0 for none but BL_func(ty, shared)
+    bool library_ = false;       // compiling a library, whose BL_calls are all expanded
+    bool usesShared_ = false;    // the output needs <type_traits> for shared expansions
+    bool usesSlots_ = false;     // the output needs flatco_rt.h for the slots of BL_calls declaring variables
+    std::vector<SharedDecl> sharedDecls_; // of the top-level calls, by pos
+    std::vector<SharedDecl> funcDecls_;   // scratch of compile()
+    std::vector<SharedSite> sites_;       // scratch of compile() and planShared()
+    std::vector<const char*> blocks_;     // scratch of compile() and planShared()
+    size_t maxInlineBytes_;      // BL_funcs expanding to more bytes are outlined, 0 for no limit
+    std::vector<const CallItem*> outlinedCalls_; // the BL_calls which co_await the coroutine of their callee
+    bool profileGenerate_;       // count the executions of the BL_call sites
+    bool instrument_;            // count the executions of the BL_call sites and time them
+    bool warnCopies_;            // note the arguments copied to parameters not cheap to copy
+    std::vector<std::pair<const CallItem*, size_t>> copiedArgs_; // the BL_calls and arguments noted
+    const Profile::Impl* profile_; // rates the BL_call sites, or null
+    std::vector<CallItem*> profileSites_;  // the BL_call sites counted of the source, by CallItem::profileSite
+    size_t parallelGenMinBytes_; // outputs of as many bytes are generated on jobs_ threads, 0 for one thread
+
+    void checkAddCode(const char* p) {
+        size_t n = lex_.getSizeFrom(p);
+        if (n > 0)
+            items_.emplace_back(p, CODE, SeqInsertable{ std::string_view(p, n), Span<size_t>() }, 0);
+    }
+
+    void parseTopLevel();
+    const char* checkImport(const Token& str, const char* p);
+    void parseBlFunc();
+    void parseBodies(unsigned jobs);
+    void importLibrary(Libraries& libs, const std::string& path, const char* pos);
+    void prepare();
+    void compile(FuncItem& func, std::string_view srcFileName);
+    void planMoves(FuncItem& func);
+    void noteCopies(const CallItem& call);
+    size_t callSeqCount(const CallItem& call) const {
+        return call.direct || call.outlined || call.site > 1 ? 0 : funcs_[call.funcIndex].seqCount;
+    }
+    bool shareable(const FuncItem& func) const;
+    void planShared();
+    void appendSharedDecls(std::string& out, const FuncItem& func, size_t seq) const;
+    void pushCall(std::string& out, const CallItem& call, size_t seq, size_t callerSeq, std::vector<ExpandFrame>& stack) const;
+    void appendSiteEnd(std::string& out, const CallItem& call, size_t seq, size_t callerSeq) const;
+    bool outline(CallItem& call, bool after);
+    void outlineCalls();
+    void planProfile(std::string_view srcFileName);
+    void appendSiteStart(std::string& out, const CallItem& call) const;
+    void appendSiteClose(std::string& out) const;
+    void appendSiteExpr(std::string& out, const CallItem& call) const;
+    void appendDirectCall(std::string& out, const CallItem& call) const;
+    void appendSiteTable(std::string& out, std::string_view srcFileName, const char* kind, const char* name);
+    void genFunction(std::string& out, const FuncItem& func, std::string_view srcFileName);
+    void genCoroutine(std::string& out, const FuncItem& func, std::string_view srcFileName, std::vector<ExpandFrame>& stack);
+    void expand(std::string& out, const CallItem& call, size_t seq, std::vector<ExpandFrame>& stack) const;
+    void expandFrames(std::string& out, std::vector<ExpandFrame>& stack) const;
+    void genItems(std::string& out, size_t begin, size_t end, size_t seq, size_t firstCode, std::string_view srcFileName,
+                  std::vector<ExpandFrame>& stack);
+
+public:
+    Parser(const char* src, size_t len, const ParserOptions& options);
+
+    // Import the libraries of the source, relative to the directory of fileName, and resolve the BL_calls
+    void link(Libraries& libs, std::string_view fileName);
+    void gen(std::string& out, std::string_view srcFileName);
+    // After gen(), a note for every BL_call made to an outlined coroutine
+    void appendNotes(std::vector<Diagnostic>& notes);
+    // Compile the source as the library lib.path
+    void compileLibrary(Library& lib);
+};
+
+// The start of the line if str is the file name of #include "<name>.bl.h", else nullptr
+const char* ImportLineStart(const Token& str, const char* src) {
+    static const char k_ext[] = ".bl.h\"";
+    const size_t extLen = sizeof(k_ext) - 1;
+    if (str.len <= extLen || memcmp(str.s + str.len - extLen, k_ext, extLen) != 0)
+        return nullptr;
+    const char* p = str.s;
+    auto skipBlanks = [&]() {
+        while (p > src && (p[-1] == ' ' || p[-1] == '\t'))
+            --p;
+    };
+    skipBlanks();
+    if (p - src < 7 || memcmp(p - 7, "include", 7) != 0)
+        return nullptr;
+    p -= 7;
+    skipBlanks();
+    if (p == src || p[-1] != '#')
+        return nullptr;
+    --p;
+    skipBlanks();
+    return (p == src || p[-1] == '\n') ? p : nullptr;
+}
+
+// Make the line of an import a BL_import item, return where the code following it starts
+const char* Parser::checkImport(const Token& str, const char* p) {
+    const char* line = ImportLineStart(str, lex_.src());
+    if (!line || line < p)
+        return p;
+    if (line > p)
+        items_.emplace_back(p, CODE, SeqInsertable{ std::string_view(p, line - p), Span<size_t>() }, 0);
+    const char* end = str.s + str.len;
+    items_.emplace_back(line, BL_import, SeqInsertable{ std::string_view(line, end - line), Span<size_t>() }, imports_.size());
+    imports_.push_back(Import{ .pos = line, .name = std::string_view(str.s + 1, str.len - 2) });
+    return end;
+}
+
+// Phase one of parsing a BL_func: its prototype and the extent of its body
+void Parser::parseBlFunc() {
+    const char* p0 = lex_.curP();
 
     char c = lex_.skipSkipBlanksGet(7); // strlen("BL_func")
     if (c != '(')
         throw BlError(lex_, "Shoud be '(' following BL_func");
-    lex_.getBrackets(c);
+    Token tokAttrs = lex_.getBrackets(c);
+    Lexer attrLex(tokAttrs.s + 1, tokAttrs.len - 2);
+    Token tokCoType = attrLex.getExpr(c, ',');
+    bool shared = false, outline = false;
+    if (c == ',') {
+        Token tokAttr = attrLex.getIdentSkipBlanks(attrLex.skipBlanksGet());
+        std::string_view attr(tokAttr.s, tokAttr.len);
+        if (attr == "shared")
+            shared = true;
+        else if (attr == "outline")
+            outline = true;
+        else
+            throw BlError(tokAttr.s, "Unknown BL_func attribute");
+        if (attrLex.skipBlanksGet())
+            throw BlError(attrLex, "BL_func syntax error after attribute");
+    }
 
     Token tokRetType;
     if(!lex_.getType(tokRetType, c))
@@ -564,20 +1492,23 @@ void Parser::parseBlFunc() {
     if (c != '(')
         throw BlError(lex_, "Should be '(' after function name");
     Token tokParams = lex_.getBrackets(c);
-    Lexer paramLex(lex_, tokParams.s+1, tokParams.len-2, tokParams.row, tokParams.col);
+    Lexer paramLex(tokParams.s+1, tokParams.len-2);
     Token tokParamType;
-    std::vector<FuncParam> params;
-    std::map<std::string, size_t> paramIndexes;
+    std::vector<FuncParam>& params = scratch_.params;
+    NameTable& paramIndexes = scratch_.paramIndexes;
+    params.clear();
+    paramIndexes.clear();
     while (paramLex.getType(tokParamType, c)) {
         Token tokParamName = paramLex.getIdentSkipBlanks(c);
         params.emplace_back(tokParamType, tokParamName);
         size_t idx = params.size() - 1;
-        if (!paramIndexes.insert(std::make_pair(std::string(tokParamName.s, tokParamName.len), idx)).second)
-            throw BlError(tokParamName.row, tokParamName.col, "BL_func parameter is duplicated");
+        if (!paramIndexes.insert(std::string_view(tokParamName.s, tokParamName.len), idx))
+            throw BlError(tokParamName.s, "BL_func parameter is duplicated");
         c = paramLex.skipBlanksGet();
         if (c != ',')
             break;
     }
+    paramIndexes.clear();
     if(c)
         throw BlError(paramLex, "Syntax error or missing ','");
 
@@ -585,63 +1516,294 @@ void Parser::parseBlFunc() {
     if(c != '{')
         throw BlError(lex_, "Should be '{' after function prototype");
     Token tokBody = lex_.getBrackets(c);
-    Lexer bodyLex(lex_, tokBody.s+1, tokBody.len-2, tokBody.row, tokBody.col+1);
 
-    size_t row, col;
-    const char* p;
-    c = bodyLex.skipCommentsGet();
-    bodyLex.savePos(row, col, p);
-    std::vector<CxxItem> items;
-    std::vector<ReturnItem> returns;
-    std::vector<CallItem> calls;
+    funcs_.push_back(FuncItem{ .name = tokFuncName, .retType = tokRetType, .coType = tokCoType,
+                               .params = Span<FuncParam>(arena_, params), .items = {}, .returns = {}, .calls = {},
+                               .retvoid = true, .seqCount = 0, .expandSize = 0, .tpl = {}, .imported = false,
+                               .suspends = true, .leaves = true, .plain = false, .shared = shared, .outline = outline,
+                               .outlinable = false, .outlined = false, .coroutine = false });
+    bodies_.push_back(tokBody);
+    items_.emplace_back(p0, BL_func, SeqInsertable{}, funcs_.size()-1);
+}
+
+// Is the parameter type a reference to non-const, whose argument is passed to a shared expansion by its address.
+// The arguments of other parameters are copied, or moved for rvalue references.
+bool IsMutableRef(const Token& type) {
+    std::string_view t = TrimRight(std::string_view(type.s, type.len));
+    if (t.empty() || t.back() != '&' || (t.size() >= 2 && t[t.size() - 2] == '&'))
+        return false;
+    t = TrimRight(t.substr(0, t.size() - 1));
+    bool constRef = (t.size() >= 5 && t.substr(t.size() - 5) == "const") ||
+                    (t.substr(0, 5) == "const" && (t.size() == 5 || !IsIdentOther(t[5])) && t.find('*') == t.npos);
+    return !constRef;
+}
+
+// Does an argument bind to the parameter type as an rvalue, i.e. it's taken by value or by rvalue reference
+bool BindsRvalue(const Token& type) {
+    std::string_view t = TrimRight(std::string_view(type.s, type.len));
+    return t.empty() || t.back() != '&' || (t.size() >= 2 && t[t.size() - 2] == '&');
+}
+
+// Is the parameter type an object owned by the expansion, which can be moved from
+bool IsOwned(const Token& type) {
+    std::string_view t = TrimRight(std::string_view(type.s, type.len));
+    return !t.empty() && t.back() != '&' && t.back() != '*' && !HasIdent(t, "const");
+}
+
+// Is a copy of the parameter type cheap: a reference, pointer, builtin arithmetic type or view, by the first name
+// of the type but qualifiers and std
+bool IsCheapCopy(const Token& type) {
+    static const std::string_view k_cheap[] = {
+        "bool", "char", "char8_t", "char16_t", "char32_t", "wchar_t", "short", "int", "long", "float", "double",
+        "unsigned", "signed", "size_t", "ssize_t", "ptrdiff_t", "intptr_t", "uintptr_t", "int8_t", "int16_t",
+        "int32_t", "int64_t", "uint8_t", "uint16_t", "uint32_t", "uint64_t", "nullptr_t", "byte", "string_view",
+        "span",
+    };
+    std::string_view t = TrimRight(std::string_view(type.s, type.len));
+    if (t.empty() || t.back() == '&' || t.back() == '*')
+        return true;
+    for (size_t i = 0; i < t.size(); ) {
+        if (!IsIdentFirst(t[i])) {
+            ++i;
+            continue;
+        }
+        size_t n = 1;
+        while (i + n < t.size() && IsIdentOther(t[i + n]))
+            ++n;
+        std::string_view ident = t.substr(i, n);
+        i += n;
+        if (ident == "const" || ident == "volatile" || ident == "std" || ident == "typename")
+            continue;
+        return std::find(std::begin(k_cheap), std::end(k_cheap), ident) != std::end(k_cheap);
+    }
+    return true;
+}
+
+// s without the blanks around it
+std::string_view Trim(std::string_view s) {
+    s = TrimRight(s);
+    while (!s.empty() && IsSpaceChar(s.front()))
+        s.remove_prefix(1);
+    return s;
+}
+
+bool IsIdent(std::string_view s) {
+    if (s.empty() || !IsIdentFirst(s[0]))
+        return false;
+    for (char c : s) {
+        if (!IsIdentOther(c))
+            return false;
+    }
+    return true;
+}
+
+// Is the parameter at pos of s aliased there: its address taken, or a reference bound to it or to a part of it
+bool TakesReference(std::string_view s, size_t pos) {
+    size_t i = pos;
+    while (i > 0 && IsSpaceChar(s[i - 1]))
+        --i;
+    if (i == 0)
+        return false;
+    if (s[i - 1] == '&')
+        return true;
+    if (s[i - 1] != '=' || (i >= 2 && strchr("=!<>+-*/%^|&", s[i - 2])))
+        return false;
+    // The declaration "T& r = p", the start of the statement is the last ';', '{' or '}' before
+    size_t start = s.find_last_of(";{}", i - 1);
+    std::string_view decl = s.substr(start == s.npos ? 0 : start + 1, i - 1 - (start == s.npos ? 0 : start + 1));
+    return decl.find('&') != decl.npos;
+}
+
+// What the code s can do to the coroutine it's expanded in, by co_await, co_yield, co_return or return outside
+// comments and strings: suspend by any of them, leave or yield from it by the last three
+void ScanBody(std::string_view s, bool& suspends, bool& leaves) {
+    static const ScanSet scanSet('c', 'r', '"', '\'', '/');
+    suspends = leaves = false;
+    Lexer lex(s.data(), s.size());
+    char c = lex.skipCommentsGet();
+    while (c) {
+        if (c == '"' || c == '\'')
+            lex.getString(c);
+        else if ((c == 'c' || c == 'r') && !lex.followsIdent()) {
+            Token tok = lex.getIdent();
+            std::string_view ident(tok.s, tok.len);
+            if (ident == "co_await")
+                suspends = true;
+            else if (ident == "co_yield" || ident == "co_return" || ident == "return") {
+                suspends = leaves = true;
+                return;
+            }
+        }
+        c = lex.scanCommentsGet(scanSet);
+    }
+}
+
+// Phase two of parsing a BL_func: the items of its body. It only touches func and scratch, so the bodies of
+// different BL_funcs can be parsed at the same time.
+void ParseBlFuncBody(FuncItem& func, const Token& tokBody, ParseScratch& scratch) {
+    NameTable& paramIndexes = scratch.paramIndexes;
+    paramIndexes.clear();
+    for (size_t i = 0; i < func.params.size(); ++i)
+        paramIndexes.insert(std::string_view(func.params[i].name.s, func.params[i].name.len), i);
+
+    Lexer bodyLex(tokBody.s+1, tokBody.len-2);
+    char c = bodyLex.skipCommentsGet();
+    const char* p = bodyLex.curP();
+    std::vector<CxxItem>& items = scratch.items;
+    std::vector<ReturnItem>& returns = scratch.returns;
+    std::vector<CallItem>& calls = scratch.calls;
+    items.clear();
+    returns.clear();
+    calls.clear();
     while (c) {
         if (c == '"' || c == '\'') {
             bodyLex.getString(c);
-            c = bodyLex.skipCommentsGet();
+            c = bodyLex.scanCommentsGet(s_keywordScanSet);
         }
-        else if (IsIdentFirst(c)) {
+        else if (c == 'B' && !bodyLex.followsIdent()) {
             Token tok = bodyLex.peekIdent();
             ItemKind kind = CheckKeyword(tok.s, tok.len);
             if (kind != CODE) {
                 size_t n = bodyLex.getSizeFrom(p);
                 if (n > 0) {
-                    SeqInsertable s = FindParams(std::string_view(p, n), paramIndexes);
-                    items.emplace_back(row, col, CODE, s, 0);
+                    SeqInsertable s = FindParams(std::string_view(p, n), scratch);
+                    items.emplace_back(p, CODE, s, 0);
                 }
             }
             if (kind == BL_return || kind == BL_call) {
                 if (kind == BL_return)
-                    ParseBlReturn(bodyLex, items, returns, paramIndexes);
+                    ParseBlReturn(bodyLex, items, returns, scratch);
                 else
-                    ParseBlCall(bodyLex, items, calls, paramIndexes);
+                    ParseBlCall(bodyLex, items, calls, scratch);
                 c = bodyLex.skipCommentsGet();
-                bodyLex.savePos(row, col, p);
+                p = bodyLex.curP();
             }
             else if (kind == BL_func)
-                throw BlError(tok.row, tok.col, "Can't use BL_func inside BL_func");
+                throw BlError(tok.s, "Can't use BL_func inside BL_func");
             else
-                c = bodyLex.skipSkipBlanksGet(tok.len);
+                c = bodyLex.scanCommentsGet(s_keywordScanSet);
         }
         else
-            c = bodyLex.skipCommentsGet();
+            c = bodyLex.scanCommentsGet(s_keywordScanSet);
     }
     size_t n = bodyLex.getSizeFrom(p);
     if (n > 0) {
-        SeqInsertable s = FindParams(std::string_view(p, n), paramIndexes);
-        items.emplace_back(row, col, CODE, s, 0);
+        SeqInsertable s = FindParams(std::string_view(p, n), scratch);
+        items.emplace_back(p, CODE, s, 0);
+    }
+    paramIndexes.clear();
+
+    func.items = Span<CxxItem>(scratch.arena, items);
+    func.returns = Span<ReturnItem>(scratch.arena, returns);
+    func.calls = Span<CallItem>(scratch.arena, calls);
+    ScanBody(std::string_view(tokBody.s + 1, tokBody.len - 2), func.suspends, func.leaves);
+}
+
+// ParseBlFuncBody() reusing the nodes of a body with the same parameter names and text parsed before. The nodes
+// are cached with the pointers made offsets from the body's '{', as the items start after it no pointer becomes
+// nullptr.
+void ParseBlFuncBody(FuncItem& func, const Token& tokBody, ParseScratch& scratch, Cache::Impl* cache) {
+    if (!cache) {
+        ParseBlFuncBody(func, tokBody, scratch);
+        return;
+    }
+    uint64_t h1 = k_hashSeed1, h2 = k_hashSeed2;
+    HashBytes("body", 4, h1, h2);
+    for (auto& param : func.params)
+        HashBytes(param.name.s, param.name.len, h1, h2);
+    HashBytes(tokBody.s, tokBody.len, h1, h2);
+    CacheKey key{ HashFinal(h1), HashFinal(h2) };
+
+    if (auto body = cache->findBody(key)) {
+        BodyNodes nodes = Relocate(body->nodes, (intptr_t)tokBody.s, scratch.arena);
+        func.items = nodes.items;
+        func.returns = nodes.returns;
+        func.calls = nodes.calls;
+        func.suspends = nodes.suspends;
+        func.leaves = nodes.leaves;
+        return;
+    }
+    ParseBlFuncBody(func, tokBody, scratch);
+    auto body = std::make_shared<CachedBody>();
+    body->nodes = Relocate(BodyNodes{ func.items, func.returns, func.calls, func.suspends, func.leaves }, -(intptr_t)tokBody.s, body->arena);
+    cache->insert(key, std::shared_ptr<const CachedBody>(std::move(body)));
+}
+
+// Parse the bodies found by phase one. Big sources are split into chunks of consecutive BL_funcs of about the
+// same size, each with its own arena and scratch, parsed on up to jobs threads. A chunk stops at its first
+// error and the error of the first chunk wins, i.e. the one a sequential parse would report.
+void Parser::parseBodies(unsigned jobs) {
+    static const size_t k_parallelMin = 256 * 1024; // bytes of bodies worth the threads
+
+    size_t nFuncs = funcs_.size();
+    size_t total = 0;
+    for (auto& body : bodies_)
+        total += body.len;
+    if (jobs <= 1 || nFuncs < 2 || total < k_parallelMin) {
+        for (size_t i = 0; i < nFuncs; ++i)
+            ParseBlFuncBody(funcs_[i], bodies_[i], scratch_, cache_);
+        return;
+    }
+
+    size_t nChunks = std::min(nFuncs, (size_t)jobs * 4);
+    std::vector<size_t> chunkStart{ 0 };
+    size_t done = 0;
+    for (size_t i = 0; i < nFuncs && chunkStart.size() < nChunks; ++i) {
+        done += bodies_[i].len;
+        if (done * nChunks >= total * chunkStart.size())
+            chunkStart.push_back(i + 1);
+    }
+    nChunks = chunkStart.size();
+    chunkStart.push_back(nFuncs);
+
+    bodyArenas_.resize(nChunks);
+    std::vector<ParseScratch> scratches;
+    scratches.reserve(nChunks);
+    for (size_t k = 0; k < nChunks; ++k)
+        scratches.emplace_back(bodyArenas_[k]);
+    std::vector<std::optional<BlError>> errors(nChunks);
+    ParallelFor(nChunks, jobs, [&](size_t k) {
+        try {
+            for (size_t i = chunkStart[k]; i < chunkStart[k + 1]; ++i)
+                ParseBlFuncBody(funcs_[i], bodies_[i], scratches[k], cache_);
+        }
+        catch (BlError& err) {
+            errors[k] = std::move(err);
+        }
+    });
+    for (auto& err : errors) {
+        if (err)
+            throw std::move(*err);
     }
+}
 
-    funcs_.emplace_back(tokFuncName, params, paramIndexes, items, returns, calls, std::vector<size_t>{}, true);
-    items_.emplace_back(row0, col0, BL_func, SeqInsertable{}, funcs_.size()-1);
+// A BL_call declaring a variable or in an expression needs a result, of a type known without deducing it for
+// auto or the slot of the expression
+void CheckDecl(const CallItem& call, const FuncItem& callee) {
+    std::string_view retType(callee.retType.s, callee.retType.len);
+    if (call.inExpr) {
+        if (callee.retvoid)
+            throw BlError(call.pos, "BL_call in an expression but the called BL_func returns void");
+        if (HasIdent(retType, "auto") || HasIdent(retType, "decltype"))
+            throw BlError(call.pos, "BL_call in an expression needs the return type of the BL_func, not deduced");
+    }
+    if (call.declType.s.empty())
+        return;
+    if (callee.retvoid)
+        throw BlError(call.pos, "The caller declares a variable but the called BL_func returns void");
+    if (HasIdent(call.declType.s, "auto") && (HasIdent(retType, "auto") || HasIdent(retType, "decltype")))
+        throw BlError(call.pos, "BL_call declaring an auto variable needs the return type of the BL_func, not deduced");
 }
 
 void Parser::prepare() {
     size_t nFuncs = funcs_.size();
-    for (size_t i = 0; i < nFuncs; ++i) {
+    // The imported BL_funcs follow the ones of the source and are named by importLibrary(), so that a duplicate
+    // is reported in the source
+    size_t nLocal = bodies_.size();
+    for (size_t i = 0; i < nLocal; ++i) {
         auto& func = funcs_[i];
-        std::string funcName(func.name.s, func.name.len);
-        if (!name2Func_.insert(std::make_pair(funcName, i)).second)
-            throw BlError(func.name.row, func.name.col, "Duplicated BL_func");
+        if (!name2Func_.insert(std::string_view(func.name.s, func.name.len), i))
+            throw BlError(func.name.s, "Duplicated BL_func");
         bool first = true;
         for (auto& ret : func.returns) {
             bool retvoid = ret.seqInsertable.s.empty();
@@ -650,133 +1812,201 @@ void Parser::prepare() {
                 func.retvoid = retvoid;
             }
             else if (func.retvoid != retvoid)
-                throw BlError(ret.row, ret.col, "Multiple BL_return returns are inconsistent, some have no return value, some have");
+                throw BlError(ret.pos, "Multiple BL_return returns are inconsistent, some have no return value, some have");
         }
     }
 
-    std::map<size_t, std::set<size_t>> callDag;
-    for (size_t i = 0; i < nFuncs; ++i)
-        callDag[i] = std::set<size_t>{};
+    // Callers of every BL_func in flat arrays: those of funcs_[i] are callers[callerStart[i]..callerStart[i+1])
+    std::vector<size_t> callerStart(nFuncs + 1, 0);
     for (size_t i = 0; i < nFuncs; ++i) {
         auto& func = funcs_[i];
         for (auto& callItem : func.calls) {
-            std::string callee(callItem.name);
-            auto it = name2Func_.find(callee);
-            if (it == name2Func_.cend()) {
-                throw BlError(callItem.row, callItem.col, "BL_call undefined BL_func");
+            const size_t* callee = name2Func_.find(callItem.name);
+            if (!callee) {
+                throw BlError(callItem.pos, "BL_call undefined BL_func");
             }
-            if (it->second == i)
-                throw BlError(callItem.row, callItem.col, "BL_call itself");
-            callItem.funcIndex = it->second;
-            funcs_[it->second].callers.push_back(i);
-
-            if (callItem.params.size() != funcs_[it->second].params.size())
-                throw BlError(callItem.row, callItem.col, "The number of parameters of the calling and called functions are not equal");
-            if (!callItem.lval.s.empty() && funcs_[it->second].retvoid)
-                throw BlError(callItem.row, callItem.col, "The caller needs a return value but the called BL_func returns void");
-
-            auto it2 = callDag.find(i);
-            assert(it2 != callDag.cend());
-            it2->second.insert(it->second);
+            if (*callee == i)
+                throw BlError(callItem.pos, "BL_call itself");
+            callItem.funcIndex = *callee;
+            ++callerStart[*callee + 1];
+
+            if (callItem.params.size() != funcs_[*callee].params.size())
+                throw BlError(callItem.pos, "The number of parameters of the calling and called functions are not equal");
+            if (!callItem.lval.s.empty() && funcs_[*callee].retvoid)
+                throw BlError(callItem.pos, "The caller needs a return value but the called BL_func returns void");
+            CheckDecl(callItem, funcs_[*callee]);
         }
     }
+    for (size_t i = 0; i < nFuncs; ++i)
+        callerStart[i + 1] += callerStart[i];
+    std::vector<size_t> callers(callerStart[nFuncs]);
+    std::vector<size_t> fill(callerStart.begin(), callerStart.end() - 1);
+    for (size_t i = 0; i < nFuncs; ++i) {
+        for (auto& callItem : funcs_[i].calls)
+            callers[fill[callItem.funcIndex]++] = i;
+    }
 
     for (auto& callItem : calls_) {
-        std::string callee(callItem.name);
-        auto it = name2Func_.find(callee);
-        if (it == name2Func_.cend()) {
-            throw BlError(callItem.row, callItem.col, "BL_call undefined BL_func");
+        const size_t* callee = name2Func_.find(callItem.name);
+        if (!callee) {
+            throw BlError(callItem.pos, "BL_call undefined BL_func");
         }
-        callItem.funcIndex = it->second;
+        callItem.funcIndex = *callee;
+        CheckDecl(callItem, funcs_[*callee]);
     }
 
-    std::vector<size_t> sorted;
-    bool foundLeaf;
-    do {
-        foundLeaf = false;
-        for (auto it = callDag.begin(); it != callDag.end(); ) {
-            size_t funcIndex = it->first;
-            foundLeaf = (it->second.size() == 0);
-            auto itNext = it;
-            ++itNext;
-            if (foundLeaf) {
-                sorted.push_back(funcIndex);
-                callDag.erase(it);
-                for (auto caller : funcs_[funcIndex].callers)
-                    callDag[caller].erase(funcIndex);
-            }
-            it = itNext;
-        }
-    } while (foundLeaf);
+    // Kahn's algorithm on the reversed call graph: a BL_func is sorted once all its callees are, sorted_ is
+    // the queue. pending counts the calls to callees not sorted yet.
+    std::vector<size_t>& sorted = sorted_;
+    sorted.reserve(nFuncs);
+    std::vector<size_t> pending(nFuncs);
+    for (size_t i = 0; i < nFuncs; ++i) {
+        pending[i] = funcs_[i].calls.size();
+        if (pending[i] == 0)
+            sorted.push_back(i);
+    }
+    for (size_t k = 0; k < sorted.size(); ++k) {
+        size_t funcIndex = sorted[k];
+        for (size_t c = callerStart[funcIndex]; c < callerStart[funcIndex + 1]; ++c) {
+            if (--pending[callers[c]] == 0)
+                sorted.push_back(callers[c]);
+        }
+    }
     if (sorted.size() != funcs_.size()) {
-        assert(callDag.size() > 0);
         std::string funcNames;
-        size_t row = 0, col = 0;
-        for (auto i : callDag) {
-            auto& func = funcs_[i.first];
+        const char* pos = nullptr;
+        for (size_t i = 0; i < nFuncs; ++i) {
+            if (pending[i] == 0)
+                continue;
+            auto& func = funcs_[i];
             funcNames += " " + std::string(func.name.s, func.name.len);
-            if (row == 0) {
-                row = func.name.row;
-                col = func.name.col;
-            }
+            if (!pos)
+                pos = func.name.s;
+        }
+        throw BlError(pos, std::string("There is recursive calls:" + funcNames).c_str());
+    }
+
+    // A BL_func of the source which can't suspend, and only calls plain BL_funcs defined before it, is plain: it's
+    // generated as an always inlined function where it's defined, and called as a function by the code following
+    // it. The calls before its definition still expand it.
+    if (alwaysExpand_)
+        return;
+    for (size_t i : sorted) {
+        if (i >= nLocal)
+            continue;
+        auto& func = funcs_[i];
+        bool plain = !func.suspends;
+        for (auto& callItem : func.calls) {
+            callItem.direct = funcs_[callItem.funcIndex].plain && callItem.funcIndex < i;
+            plain = plain && callItem.direct;
         }
-        throw BlError(row, col, std::string("There is recursive calls:" + funcNames).c_str());
+        func.plain = plain;
+    }
+    for (auto& callItem : calls_) {
+        const FuncItem& callee = funcs_[callItem.funcIndex];
+        callItem.direct = callee.plain && callee.name.s < callItem.pos;
+    }
+}
+
+Parser::Parser(const char* src, size_t len, const ParserOptions& options)
+    : lex_(src, len), lines_(src, len), jobs_(options.jobs), cache_(options.cache),
+      alwaysExpand_(options.alwaysExpand), sharedMinBytes_(options.sharedMinBytes),
+      maxInlineBytes_(options.maxInlineBytes), profileGenerate_(options.profileGenerate),
+      instrument_(options.instrument), warnCopies_(options.warnCopies), profile_(options.profile),
+      parallelGenMinBytes_(options.parallelGenMinBytes) {
+    // An error of phase one is reported once the bodies before it are known to have none
+    std::optional<BlError> error;
+    try {
+        parseTopLevel();
+    }
+    catch (BlError& err) {
+        error = std::move(err);
     }
+    parseBodies(jobs_);
+    if (error)
+        throw std::move(*error);
 }
 
-Parser::Parser(const char* src, size_t len) : lex_(src, len) {
-    std::map<std::string, size_t> emptyParamIndexes;
-    size_t row, col;
-    const char* p;
+// Phase one of parsing: the code outside BL_funcs, the BL_calls in it and the prototypes of BL_funcs
+void Parser::parseTopLevel() {
     char c = lex_.skipCommentsGet();
-    lex_.savePos(row, col, p);
+    const char* p = lex_.curP();
     while (c) {
         if (c == '"' || c == '\'') {
-            lex_.getString(c);
-            c = lex_.skipCommentsGet();
+            Token str = lex_.getString(c);
+            if (c == '"')
+                p = checkImport(str, p);
+            c = lex_.scanCommentsGet(s_keywordScanSet);
         }
-        else if (IsIdentFirst(c)) {
+        else if (c == 'B' && !lex_.followsIdent()) {
             Token tok = lex_.peekIdent();
             ItemKind kind = CheckKeyword(tok.s, tok.len);
             if (kind != CODE) {
-                checkAddCode(row, col, p);
+                checkAddCode(p);
                 if (kind == BL_func || kind == BL_call) {
                     if (kind == BL_func)
                         parseBlFunc();
                     else
-                        ParseBlCall(lex_, items_, calls_, emptyParamIndexes);
+                        ParseBlCall(lex_, items_, calls_, scratch_);
                     c = lex_.skipCommentsGet();
-                    lex_.savePos(row, col, p);
+                    p = lex_.curP();
                 }
                 else if (kind == BL_return)
-                    throw BlError(tok.row, tok.col, "Can't use BL_return outside BL_func");
+                    throw BlError(tok.s, "Can't use BL_return outside BL_func");
                 else
                     assert(false);
             }
             else
-                c = lex_.skipSkipBlanksGet(tok.len);
+                c = lex_.scanCommentsGet(s_keywordScanSet);
         }
         else
-            c = lex_.skipCommentsGet();
+            c = lex_.scanCommentsGet(s_keywordScanSet);
     }
-    checkAddCode(row, col, p);
-    prepare();
+    checkAddCode(p);
+}
+
+// Format v in lowercase hex ending at end, return the start
+char* FormatHex(char* end, size_t v) {
+    do {
+        *--end = "0123456789abcdef"[v & 15];
+        v >>= 4;
+    } while (v);
+    return end;
+}
+
+void AppendHex(std::string& out, size_t v) {
+    char buf[24];
+    char* p = FormatHex(buf + sizeof(buf), v);
+    out.append(p, buf + sizeof(buf) - p);
 }
 
-std::string FromSeqInsertable(const SeqInsertable& si, size_t seq) {
+// Append si to out, with "_BLparam<seq>_" inserted at si.seqPositions
+void AppendSeqInsertable(std::string& out, const SeqInsertable& si, size_t seq) {
     size_t n = si.seqPositions.size();
-    if (n <= 0)
-        return std::string(si.s);
+    if (n <= 0) {
+        out += si.s;
+        return;
+    }
     char buf[32];
-    snprintf(buf, sizeof(buf), "_BLparam%zx_" , seq);
-    std::string s(si.s.substr(0, si.seqPositions[0]));
-    for (size_t i = 1; i < n; ++i) {
-        s += buf;
-        s += si.s.substr(si.seqPositions[i - 1], si.seqPositions[i] - si.seqPositions[i - 1]);
-    }
-    s += buf;
-    s += si.s.substr(si.seqPositions[n-1]);
-    return s;
+    char* end = buf + sizeof(buf);
+    *--end = '_';
+    char* p = FormatHex(end, seq) - 8;
+    memcpy(p, "_BLparam", 8);
+    size_t len = buf + sizeof(buf) - p;
+    size_t last = 0;
+    for (size_t pos : si.seqPositions) {
+        out.append(si.s.data() + last, pos - last);
+        out.append(p, len);
+        last = pos;
+    }
+    out.append(si.s.data() + last, si.s.size() - last);
+}
+
+void AppendLine(std::string& out, size_t row, std::string_view srcFileName) {
+    char buf[32];
+    out.append(buf, snprintf(buf, sizeof(buf), "\n#line %zu \"", row));
+    out += srcFileName;
+    out += "\"\n";
 }
 
 bool CheckBlInclude(const std::string_view& s) {
@@ -817,120 +2047,1811 @@ bool CheckBlInclude(const std::string_view& s) {
     return false;
 }
 
-void GetRidBlInclude(FILE* fOut, const std::string_view& s) {
+void GetRidBlInclude(std::string& out, const std::string_view& s) {
     size_t off = 0, pos;
     for (size_t off=0;; off = pos+1) {
         pos = s.find_first_of('\n', off);
         std::string_view t = (pos == s.npos ? s.substr(off) : s.substr(off, pos - off));
         if (CheckBlInclude(t)) {
-            if(off > 0)
-                fwrite(s.data(), 1, off, fOut);
-            fputs("//", fOut);
-            fwrite(s.data()+off, 1, s.size()-off, fOut);
+            out += s.substr(0, off);
+            out += "//";
+            out += s.substr(off);
             return;
         }
         if (pos == s.npos)
             break;
     }
-    fwrite(s.data(), 1, s.size(), fOut);
+    out += s;
 }
 
-void Parser::gen(FILE* fOut, const char* srcFileName) {
-    size_t seq = 0;
-    bool firstCode = true;
-    for (auto& item : items_) {
+// About the bytes of the lval and arguments of call in its expansion
+size_t CallArgsSize(const CallItem& call) {
+    size_t n = call.lval.s.size() + 1;
+    for (auto& param : call.params)
+        n += param.s.size() + param.seqPositions.size() * 12;
+    return n;
+}
+
+// "<lval>=<name>(<arguments>)" of a direct call, as written
+void AppendDirectCall(std::string& out, const CallItem& call) {
+    if (!call.lval.s.empty() && call.declType.s.empty()) {
+        out += call.lval.s;
+        out += '=';
+    }
+    if (call.outlined)
+        out += "co_await ";
+    out += call.name;
+    out += '(';
+    for (size_t i = 0; i < call.params.size(); ++i) {
+        if (i > 0)
+            out += ',';
+        out += call.params[i].s;
+    }
+    out += ')';
+}
+
+// A BL_call of a plain or outlined BL_func as a function call, in its expression as written. A declaration or
+// an expression can't be in a block, the count and timer of its site are operands of a comma expression then.
+void Parser::appendDirectCall(std::string& out, const CallItem& call) const {
+    if (!call.slotted()) {
+        appendSiteStart(out, call);
+        AppendDirectCall(out, call);
+        appendSiteClose(out);
+        return;
+    }
+    if (call.inExpr)
+        out += call.stmt.s;
+    else {
+        out += call.declType.s;
+        out += ' ';
+        out += call.lval.s;
+        out += '=';
+    }
+    out += '(';
+    appendSiteExpr(out, call);
+    AppendDirectCall(out, call);
+    out += ')';
+}
+
+// Defines the attribute of plain BL_funcs, before the first one
+const char k_inlineMacro[] =
+    "\n#ifndef _BLinline\n"
+    "#ifdef _MSC_VER\n"
+    "#define _BLinline __forceinline\n"
+    "#else\n"
+    "#define _BLinline [[gnu::always_inline]] inline\n"
+    "#endif\n"
+    "#endif";
+
+// A plain BL_func as a function. Its parameters and the code of its body keep their names, BL_return returns
+// and its BL_calls are all direct.
+void Parser::genFunction(std::string& out, const FuncItem& func, std::string_view srcFileName) {
+    AppendLine(out, lines_.row(func.retType.s), srcFileName);
+    out += "_BLinline ";
+    out.append(func.retType.s, func.retType.len);
+    out += ' ';
+    out.append(func.name.s, func.name.len);
+    out += '(';
+    for (size_t i = 0; i < func.params.size(); ++i) {
+        if (i > 0)
+            out += ", ";
+        out.append(func.params[i].type.s, func.params[i].type.len);
+        out += ' ';
+        out.append(func.params[i].name.s, func.params[i].name.len);
+    }
+    out += ") {";
+    for (auto& item : func.items) {
+        if (item.kind == CODE) {
+            AppendLine(out, lines_.row(item.pos), srcFileName);
+            out += item.s.s;
+        }
+        else if (item.kind == BL_call)
+            appendDirectCall(out, func.calls[item.index]);
+        else if (item.kind == BL_return) {
+            if (func.retvoid)
+                out += "return";
+            else {
+                out += "return(";
+                out += func.returns[item.index].seqInsertable.s;
+                out += ')';
+            }
+        }
+    }
+    out += '}';
+}
+
+// The coroutine of an outlined BL_func where it's defined, of the type given by BL_func(ty): its template streamed
+// as the expansion of seq 0 with the arguments bound to the coroutine's parameters and BL_return made co_return
+void Parser::genCoroutine(std::string& out, const FuncItem& func, std::string_view srcFileName,
+                          std::vector<ExpandFrame>& stack) {
+    AppendLine(out, lines_.row(func.retType.s), srcFileName);
+    std::string_view coType = TrimRight(std::string_view(func.coType.s, func.coType.len));
+    while (!coType.empty() && IsSpaceChar(coType.front()))
+        coType.remove_prefix(1);
+    out += coType;
+    out += ' ';
+    out.append(func.name.s, func.name.len);
+    out += '(';
+    for (size_t i = 0; i < func.params.size(); ++i) {
+        if (i > 0)
+            out += ", ";
+        out.append(func.params[i].type.s, func.params[i].type.len);
+        out += ' ';
+        out.append(func.params[i].name.s, func.params[i].name.len);
+    }
+    out += ") {";
+    stack.clear();
+    stack.push_back(ExpandFrame{ &func, 0, 0, nullptr, 0, false, true });
+    expandFrames(out, stack);
+    out += ";}";
+}
+
+// Generate items_[begin..end), seq is the seq of the first BL_call expanded, items_[firstCode] is the first code
+void Parser::genItems(std::string& out, size_t begin, size_t end, size_t seq, size_t firstCode, std::string_view srcFileName,
+                      std::vector<ExpandFrame>& stack) {
+    for (size_t i = begin; i < end; ++i) {
+        const CxxItem& item = items_[i];
         if (item.kind == CODE) {
             assert(item.s.s.size() > 0);
-            fprintf(fOut, "\n#line %zu \"%s\"\n", item.row, srcFileName);
-            if (firstCode) {
-                firstCode = false;
-                GetRidBlInclude(fOut, item.s.s);
+            if (i == firstCode && usesShared_)
+                out += "\n#include <type_traits>";
+            bool siteTables = !profileSites_.empty() && (profileGenerate_ || instrument_);
+            if (i == firstCode && (siteTables || usesSlots_))
+                out += "\n#include \"flatco_rt.h\"";
+            if (i == firstCode && siteTables) {
+                if (profileGenerate_)
+                    appendSiteTable(out, srcFileName, "Profile", "_BLprofile");
+                if (instrument_)
+                    appendSiteTable(out, srcFileName, "Instrument", "_BLinstrument");
             }
+            AppendLine(out, lines_.row(item.pos), srcFileName);
+            // The declarations of shared expansions are inserted after the '{' of their blocks
+            std::string_view s = item.s.s;
+            const char* end = s.data() + s.size();
+            auto decl = std::upper_bound(sharedDecls_.begin(), sharedDecls_.end(), s.data(),
+                                         [](const char* pos, const SharedDecl& d) { return pos < d.pos; });
+            for (; decl != sharedDecls_.end() && decl->pos <= end; ++decl) {
+                size_t n = decl->pos - s.data();
+                if (i == firstCode)
+                    GetRidBlInclude(out, s.substr(0, n));
+                else
+                    out += s.substr(0, n);
+                const CallItem& first = calls_[decl->call];
+                appendSharedDecls(out, funcs_[first.funcIndex], first.seqOffset);
+                s.remove_prefix(n);
+            }
+            if (i == firstCode)
+                GetRidBlInclude(out, s);
             else
-                fwrite(item.s.s.data(), 1, item.s.s.size(), fOut);
+                out += s;
         }
         else if (item.kind == BL_call) {
-            CallItem call = calls_[item.index];
-            std::vector<std::string> params;
-            for (auto& v : call.params)
-                params.push_back(std::string(v.s));
-            expand(fOut, srcFileName, call.funcIndex, std::string(call.lval.s), params, seq);
+            const CallItem& call = calls_[item.index];
+            if (call.direct || call.outlined)
+                appendDirectCall(out, call);
+            else {
+                // A variable declared is declared after the expansion, referring to the slot its BL_return
+                // constructs. The statement of a call in an expression follows it, taking the result of the slot.
+                bool declares = !call.declType.s.empty();
+                if (call.slotted()) {
+                    out += "flatco::RetSlot<";
+                    if (call.inExpr || HasIdent(call.declType.s, "auto"))
+                        out.append(funcs_[call.funcIndex].retType.s, funcs_[call.funcIndex].retType.len);
+                    else
+                        out += call.declType.s;
+                    out += ">_BLret";
+                    AppendHex(out, seq);
+                    out += ';';
+                }
+                appendSiteStart(out, call);
+                expand(out, call, call.site > 1 ? call.seqOffset : seq, stack);
+                appendSiteClose(out);
+                if (call.inExpr) {
+                    out += ';';
+                    if (!call.stmt.s.empty())
+                        AppendLine(out, lines_.row(call.stmt.s.data()), srcFileName);
+                    out += call.stmt.s;
+                    out += "_BLret";
+                    AppendHex(out, seq);
+                    out += ".take()";
+                }
+                else if (declares) {
+                    out += ';';
+                    out += call.declType.s;
+                    if (call.declType.s.back() != '&')
+                        out += '&';
+                    out += ' ';
+                    out += call.lval.s;
+                    out += "=*_BLret";
+                    AppendHex(out, seq);
+                }
+            }
+            seq += callSeqCount(call);
+        }
+        else if (item.kind == BL_import) {
+            AppendLine(out, lines_.row(item.pos), srcFileName);
+            out += "//";
+            out += item.s.s;
         }
         else {
             assert(item.kind == BL_func);
+            const FuncItem& func = funcs_[item.index];
+            if (func.plain) {
+                if (i == firstPlain_)
+                    out += k_inlineMacro;
+                genFunction(out, func, srcFileName);
+            }
+            else if (func.coroutine)
+                genCoroutine(out, func, srcFileName, stack);
         }
     }
 }
 
-void Parser::expand(FILE* fOut, const char* srcFileName, size_t funcIndex, const std::string& lval, const std::vector<std::string>& params, size_t& seq) {
-    const FuncItem& func = funcs_[funcIndex];
-    size_t seqCurrent = seq++;
-    fputs("do {", fOut);
-    assert(params.size() == func.params.size());
-    size_t i = 0;
-    for (auto& pi : func.params) {
-        fprintf(fOut, "%s _BLparam%zx_%s=%s;", std::string(pi.type.s, pi.type.len).c_str(), seqCurrent, std::string(pi.name.s, pi.name.len).c_str(), params[i].c_str());
-        ++i;
+// The top-level BL_calls of a shareable BL_func in one block share an expansion, like the ones of a BL_func
+void Parser::planShared() {
+    sharedDecls_.clear();
+    std::vector<SharedSite>& sites = sites_;
+    sites.clear();
+    bool any = false;
+    for (auto& call : calls_) {
+        call.site = 0;
+        call.nSites = 0;
+        any = any || (!call.direct && !call.outlined && call.heat != Hot && !call.slotted() &&
+                      shareable(funcs_[call.funcIndex]));
     }
-    for (auto& item : func.items) {
+    if (!any)
+        return;
+    std::vector<const char*>& blocks = blocks_;
+    FindCallBlocks(items_.data(), items_.size(), blocks);
+    for (size_t i = 0; i < items_.size(); ++i) {
+        if (items_[i].kind != BL_call || !blocks[i])
+            continue;
+        const CallItem& call = calls_[items_[i].index];
+        if (!call.direct && !call.outlined && call.heat != Hot && !call.slotted() && shareable(funcs_[call.funcIndex]))
+            sites.push_back(SharedSite{ call.funcIndex, blocks[i], items_[i].index, 0 });
+    }
+    GroupSites(sites, calls_.data(), sharedDecls_);
+    if (sharedDecls_.empty())
+        return;
+    usesShared_ = true;
+
+    // The seqs of the shared expansions, taken by their first sites
+    size_t seq = 0;
+    for (auto& item : items_) {
+        if (item.kind != BL_call)
+            continue;
+        CallItem& call = calls_[item.index];
+        if (call.site == 1)
+            call.seqOffset = seq;
+        seq += callSeqCount(call);
+    }
+    for (auto& site : sites) {
+        if (calls_[site.call].site > 1)
+            calls_[site.call].seqOffset = calls_[site.first].seqOffset;
+    }
+}
+
+// Every top-level item knows its seq and about its size once the BL_funcs are compiled. When the output is at
+// least parallelGenMinBytes_, the items are split into chunks of about the same output size which are generated
+// on up to jobs_ threads, the first one into out and the others into buffers appended to out in order. The output
+// is the same as when generating the items one by one.
+void Parser::gen(std::string& out, std::string_view srcFileName) {
+    planProfile(srcFileName);
+    for (size_t i : sorted_)
+        compile(funcs_[i], srcFileName);
+    if (warnCopies_) {
+        for (auto& call : calls_)
+            noteCopies(call);
+    }
+    outlineCalls();
+    planShared();
+    for (auto& call : calls_)
+        usesSlots_ = usesSlots_ || (call.slotted() && !call.direct && !call.outlined);
+    size_t nItems = items_.size();
+    size_t firstCode = nItems;
+    size_t total = 0;
+    std::vector<size_t> sizes(nItems);
+    firstPlain_ = nItems;
+    for (size_t i = 0; i < nItems; ++i) {
+        const CxxItem& item = items_[i];
         if (item.kind == CODE) {
-            assert(item.s.s.size() > 0);
-            std::string s = FromSeqInsertable(item.s, seqCurrent);
-            fprintf(fOut, "\n#line %zu \"%s\"\n%s", item.row, srcFileName, s.c_str());
+            sizes[i] = item.s.s.size() + 32;
+            if (firstCode == nItems)
+                firstCode = i;
         }
+        else if (item.kind == BL_import)
+            sizes[i] = item.s.s.size() + 34;
         else if (item.kind == BL_call) {
-            CallItem call = func.calls[item.index];
-            std::vector<std::string> params;
-            for (auto& v : call.params)
-                params.push_back(FromSeqInsertable(v, seqCurrent));
-            expand(fOut, srcFileName, call.funcIndex, FromSeqInsertable(call.lval, seqCurrent), params, seq);
+            const CallItem& call = calls_[item.index];
+            if (call.direct || call.outlined)
+                sizes[i] = call.name.size() + 9 + CallArgsSize(call);
+            else
+                sizes[i] = (call.site > 1 ? 128 : funcs_[call.funcIndex].expandSize) + CallArgsSize(call);
         }
-        else if (item.kind == BL_return) {
-            bool lvalEmpty = lval.empty();
-            ReturnItem ri = func.returns[item.index];
-            std::string rets = FromSeqInsertable(ri.seqInsertable, seqCurrent);
-            fprintf(fOut, "do{ %s%c%s; goto _BLexit%zx; }while(0)", lvalEmpty? "": lval.c_str(), lvalEmpty? ' ': '=', rets.c_str(), seqCurrent);
+        else if (funcs_[item.index].coroutine)
+            sizes[i] = funcs_[item.index].expandSize + 256;
+        else if (funcs_[item.index].plain) {
+            const FuncItem& func = funcs_[item.index];
+            sizes[i] = bodies_[item.index].len + (func.items.size() + 1) * 32;
+            if (firstPlain_ == nItems)
+                firstPlain_ = i;
         }
-        else {
-            assert(false);
+        total = std::min(total + sizes[i], (size_t)PTRDIFF_MAX);
+    }
+    std::vector<ExpandFrame> stack;
+    if (jobs_ <= 1 || parallelGenMinBytes_ == 0 || total < parallelGenMinBytes_) {
+        genItems(out, 0, nItems, 0, firstCode, srcFileName, stack);
+        return;
+    }
+
+    size_t nChunks = std::min(nItems, (size_t)jobs_ * 4);
+    std::vector<size_t> chunkStart{ 0 }, chunkSeq{ 0 };
+    size_t done = 0, seq = 0;
+    for (size_t i = 0; i < nItems && chunkStart.size() < nChunks; ++i) {
+        done += sizes[i];
+        if (items_[i].kind == BL_call)
+            seq += callSeqCount(calls_[items_[i].index]);
+        if (done * (double)nChunks >= total * (double)chunkStart.size()) {
+            chunkStart.push_back(i + 1);
+            chunkSeq.push_back(seq);
         }
     }
-    fprintf(fOut, "_BLexit%zx:;}while(0)", seqCurrent);
-}
-
-int main(int argc,char* const* argv) {
-    if (processing_cmd(argc, argv))
-        return 1;
-    FILE* fIn = fopen(s_inFileName, "r");
-    if (!fIn) {
-        printf("Can't open file '%s'.\n", s_inFileName);
-        return 1;
-    }
-    fseek(fIn, 0, SEEK_END);
-    size_t bufLen = ftell(fIn);
-    char* src = (char*)malloc(bufLen);
-    int r = 1;
-    if (src) {
-        fseek(fIn, 0, SEEK_SET);
-        size_t len = fread(src, 1, bufLen, fIn);
-        if (ferror(fIn)==0) {
-            try {
-                Parser parser(src, len);
-                FILE* fOut = fopen(s_outFileName, "w");
-                if (fOut) {
-                    parser.gen(fOut, s_inFileName);
-                    r = 0;
-                    fclose(fOut);
-                }
+    nChunks = chunkStart.size();
+    chunkStart.push_back(nItems);
+
+    lines_.row(lex_.curP()); // build the line index before the threads share it
+    std::vector<std::string> bufs(nChunks - 1);
+    ParallelFor(nChunks, jobs_, [&](size_t k) {
+        std::string& buf = (k == 0 ? out : bufs[k - 1]);
+        std::vector<ExpandFrame> stack;
+        genItems(buf, chunkStart[k], chunkStart[k + 1], chunkSeq[k], firstCode, srcFileName, stack);
+    });
+    size_t size = out.size();
+    for (auto& buf : bufs)
+        size += buf.size();
+    out.reserve(size);
+    for (auto& buf : bufs)
+        out += buf;
+}
+
+// The argument s moved from the parameter named name, i.e. "static_cast<decltype(name)&&>(name)"
+SeqInsertable MoveParam(std::string_view name, Arena& arena) {
+    std::string text = "static_cast<decltype(";
+    size_t positions[2] = { text.size(), 0 };
+    text += name;
+    text += ")&&>(";
+    positions[1] = text.size();
+    text += name;
+    text += ')';
+    return SeqInsertable{ arena.copy(std::string_view(text)), Span<size_t>(arena.copy(positions, 2), 2) };
+}
+
+// Move the parameters of func owning their objects instead of copying them at their last uses: a BL_return of
+// one, like the return of a function, and an argument of a BL_call which is the only use of one. The latter only
+// when the body has no loop, goto or lambda capturing by reference, and never binds a reference to the parameter:
+// a view, pointer or copy taken earlier may still refer to what the move takes away.
+// Every use of a parameter is at a seq position, in the order of the expansion: code, the arguments of a BL_call
+// then its lval, the value of a BL_return.
+void Parser::planMoves(FuncItem& func) {
+    size_t nParams = func.params.size();
+    if (nParams == 0)
+        return;
+    auto paramAt = [&func, nParams](const SeqInsertable& si, size_t pos) {
+        std::string_view s = si.s.substr(pos);
+        for (size_t k = 0; k < nParams; ++k) {
+            std::string_view name(func.params[k].name.s, func.params[k].name.len);
+            if (s.substr(0, name.size()) == name && (s.size() == name.size() || !IsIdentOther(s[name.size()])))
+                return k;
+        }
+        return nParams;
+    };
+    // The parameter which is the whole of si, else nParams
+    auto paramOnly = [&](const SeqInsertable& si) {
+        std::string_view s = Trim(si.s);
+        if (si.seqPositions.size() != 1 || si.seqPositions[0] != (size_t)(s.data() - si.s.data()))
+            return nParams;
+        size_t k = paramAt(si, si.seqPositions[0]);
+        return k < nParams && s.size() == func.params[k].name.len && IsOwned(func.params[k].type) ? k : nParams;
+    };
+
+    for (auto& ret : func.returns) {
+        size_t k = paramOnly(ret.seqInsertable);
+        if (k < nParams)
+            ret.seqInsertable = MoveParam(std::string_view(func.params[k].name.s, func.params[k].name.len), arena_);
+    }
+
+    // Number the uses in order, lastUse[k] is the number of the last SeqInsertable using parameter k and
+    // nUses[k] the count of its uses
+    const size_t k_aliased = SIZE_MAX;
+    std::vector<size_t> lastUse(nParams, 0);
+    std::vector<size_t> nUses(nParams, 0);
+    size_t n = 0;
+    auto use = [&](const SeqInsertable& si) {
+        ++n;
+        for (size_t pos : si.seqPositions) {
+            size_t k = paramAt(si, pos);
+            if (k < nParams) {
+                ++nUses[k];
+                if (lastUse[k] != k_aliased)
+                    lastUse[k] = TakesReference(si.s, pos) ? k_aliased : n;
             }
-            catch (BlError& err) {
-                printf("At %zu:%zu: %s\n", err.row, err.col, err.s.c_str());
+        }
+    };
+    // No move when the code loops, jumps or captures by reference
+    auto moveless = [](std::string_view s) {
+        if (HasIdent(s, "for") || HasIdent(s, "while") || HasIdent(s, "goto") || HasIdent(s, "do"))
+            return true;
+        for (size_t i = s.find('['); i != s.npos; i = s.find('[', i + 1)) {
+            std::string_view capture = Trim(s.substr(i + 1, s.find(']', i) - i - 1));
+            if (!capture.empty() && (capture[0] == '&' || capture[0] == '=' || capture.find(",&") != capture.npos))
+                return true;
+        }
+        return false;
+    };
+    for (auto& item : func.items) {
+        if (item.kind == CODE) {
+            if (moveless(item.s.s))
+                return;
+            use(item.s);
+        }
+        else if (item.kind == BL_call) {
+            CallItem& call = func.calls[item.index];
+            if (moveless(call.stmt.s))
+                return;
+            use(call.declType);
+            for (auto& arg : call.params)
+                use(arg);
+            use(call.lval);
+            use(call.stmt); // after the expansion
+        }
+        else
+            use(func.returns[item.index].seqInsertable);
+    }
+
+    n = 0;
+    for (auto& item : func.items) {
+        if (item.kind == CODE)
+            ++n;
+        else if (item.kind == BL_call) {
+            CallItem& call = func.calls[item.index];
+            const FuncItem& callee = funcs_[call.funcIndex];
+            ++n;
+            for (size_t i = 0; i < call.params.size(); ++i) {
+                ++n;
+                size_t k = paramOnly(call.params[i]);
+                if (k < nParams && nUses[k] == 1 && lastUse[k] == n && BindsRvalue(callee.params[i].type))
+                    call.params[i] = MoveParam(std::string_view(func.params[k].name.s, func.params[k].name.len), arena_);
             }
+            n += 2;
         }
         else
-            printf("Read input file error.\n");
-        free(src);
+            ++n;
+    }
+}
+
+// Note the arguments of call copied to parameters not cheap to copy, when the argument is a variable which could
+// be moved
+void Parser::noteCopies(const CallItem& call) {
+    const FuncItem& callee = funcs_[call.funcIndex];
+    for (size_t i = 0; i < call.params.size(); ++i) {
+        const FuncParam& param = callee.params[i];
+        std::string_view type = TrimRight(std::string_view(param.type.s, param.type.len));
+        if (!type.empty() && type.back() != '&' && !IsCheapCopy(param.type) && IsIdent(Trim(call.params[i].s)))
+            copiedArgs_.emplace_back(&call, i);
+    }
+}
+
+// Compile func's items into a flat list of pieces once, so that every expansion just streams them. The
+// callees must be compiled before, their seqCount is needed for the seqs of the expansions inside func.
+// Add the bytes of func's template but its calls to its expandSize
+void AddTplSize(FuncItem& func) {
+    for (auto& piece : func.tpl) {
+        if (piece.kind == TplPiece::Text)
+            func.expandSize += piece.n;
+        else if (piece.kind == TplPiece::SeqHex)
+            func.expandSize += 4;
+        else if (piece.kind == TplPiece::Insertable)
+            func.expandSize += piece.si->s.size() + piece.si->seqPositions.size() * 12;
+        else if (piece.kind == TplPiece::SharedDecl || piece.kind == TplPiece::Shared)
+            func.expandSize += 128;
+        else if (piece.kind == TplPiece::Lval || piece.kind == TplPiece::LvalEnd)
+            func.expandSize += 40;
+        else if (piece.kind == TplPiece::CallSeq)
+            func.expandSize += 4;
     }
-    fclose(fIn);
-	return r;
+    func.expandSize = std::min(func.expandSize, (size_t)PTRDIFF_MAX);
 }
+
+void Parser::compile(FuncItem& func, std::string_view srcFileName) {
+    auto& tpl = tpl_;
+    auto text = [&tpl](const char* s, size_t n) { tpl.push_back(TplPiece{ TplPiece::Text, s, n, nullptr }); };
+    // Copy text_ to the arena
+    auto poolText = [&]() {
+        std::string_view pooled = arena_.copy(std::string_view(text_));
+        text(pooled.data(), pooled.size());
+        text_.clear();
+    };
+    auto piece = [&tpl](TplPiece::Kind kind, size_t n, const SeqInsertable* si) { tpl.push_back(TplPiece{ kind, nullptr, n, si }); };
+    tpl.clear();
+    text_.clear();
+    func.seqCount = 1;
+    func.expandSize = 0;
+
+    // An imported BL_func is compiled by its library, only the seqs of its calls depend on the callees here
+    if (func.imported) {
+        for (auto& piece : func.tpl) {
+            if (piece.kind == TplPiece::Call) {
+                CallItem& call = func.calls[piece.n];
+                call.seqOffset = func.seqCount;
+                func.seqCount += funcs_[call.funcIndex].seqCount;
+                func.expandSize = std::min(func.expandSize + funcs_[call.funcIndex].expandSize + CallArgsSize(call), (size_t)PTRDIFF_MAX);
+            }
+            else if (piece.kind == TplPiece::CallSeq)
+                usesSlots_ = true;
+        }
+        AddTplSize(func);
+        return;
+    }
+    planMoves(func);
+    if (warnCopies_ && !library_) {
+        for (auto& call : func.calls)
+            noteCopies(call);
+    }
+
+    text("do {", 4);
+    for (size_t i = 0; i < func.params.size(); ++i) {
+        auto& pi = func.params[i];
+        text_.append(pi.type.s, pi.type.len);
+        text_ += " _BLparam";
+        poolText();
+        piece(TplPiece::SeqHex, 0, nullptr);
+        text_ += '_';
+        text_.append(pi.name.s, pi.name.len);
+        text_ += '=';
+        poolText();
+        piece(TplPiece::Param, i, nullptr);
+        text(";", 1);
+    }
+
+    // The calls of an outlined BL_func defined before func co_await its coroutine. The calls of a shareable
+    // BL_func in one block share an expansion, declared at the start of the block, after the parameters for the
+    // body.
+    size_t funcIndex = &func - funcs_.data();
+    std::vector<SharedSite>& sites = sites_;
+    std::vector<SharedDecl>& decls = funcDecls_;
+    sites.clear();
+    decls.clear();
+    FindCallBlocks(func.items.p, func.items.n, blocks_);
+    for (size_t i = 0; i < func.items.n; ++i) {
+        if (func.items[i].kind != BL_call)
+            continue;
+        CallItem& call = func.calls[func.items[i].index];
+        call.site = 0;
+        call.nSites = 0;
+        if (outline(call, call.funcIndex < funcIndex))
+            continue;
+        if (!call.direct && call.heat != Hot && !call.slotted() && shareable(funcs_[call.funcIndex]))
+            sites.push_back(SharedSite{ call.funcIndex, blocks_[i], func.items[i].index, 0 });
+    }
+    GroupSites(sites, func.calls.p, decls);
+    usesShared_ = usesShared_ || !decls.empty();
+    size_t nextDecl = 0;
+    for (; nextDecl < decls.size() && !decls[nextDecl].pos; ++nextDecl)
+        piece(TplPiece::SharedDecl, decls[nextDecl].call, nullptr);
+    for (auto& item : func.items) {
+        if (item.kind == CODE) {
+            assert(item.s.s.size() > 0);
+            AppendLine(text_, lines_.row(item.pos), srcFileName);
+            poolText();
+            // Split the code at the blocks starting in it which hold shared expansions
+            const SeqInsertable* si = &item.s;
+            while (nextDecl < decls.size() && decls[nextDecl].pos <= si->s.data() + si->s.size()) {
+                size_t at = decls[nextDecl].pos - si->s.data();
+                size_t k = 0;
+                while (k < si->seqPositions.size() && si->seqPositions[k] < at)
+                    ++k;
+                SeqInsertable head{ si->s.substr(0, at), Span<size_t>(si->seqPositions.p, k) };
+                piece(TplPiece::Insertable, 0, arena_.copy(&head, 1));
+                piece(TplPiece::SharedDecl, decls[nextDecl++].call, nullptr);
+                size_t* positions = arena_.copy(si->seqPositions.p + k, si->seqPositions.size() - k);
+                for (size_t j = 0; j < si->seqPositions.size() - k; ++j)
+                    positions[j] -= at;
+                SeqInsertable tail{ si->s.substr(at), Span<size_t>(positions, si->seqPositions.size() - k) };
+                si = arena_.copy(&tail, 1);
+            }
+            piece(TplPiece::Insertable, 0, si);
+        }
+        else if (item.kind == BL_call) {
+            CallItem& call = func.calls[item.index];
+            bool declares = !call.declType.s.empty();
+            if (call.slotted() && (call.direct || call.outlined)) {
+                // A declaration or an expression can't be in a block, the count and timer of its site are operands
+                // of a comma expression
+                if (call.inExpr)
+                    piece(TplPiece::Insertable, 0, &call.stmt);
+                else {
+                    piece(TplPiece::Insertable, 0, &call.declType);
+                    text(" ", 1);
+                    piece(TplPiece::Insertable, 0, &call.lval);
+                    text("=", 1);
+                }
+                text_ += '(';
+                appendSiteExpr(text_, call);
+                if (call.outlined)
+                    text_ += "co_await ";
+                text_ += call.name;
+                text_ += '(';
+                poolText();
+                for (size_t k = 0; k < call.params.size(); ++k) {
+                    if (k > 0)
+                        text(",", 1);
+                    piece(TplPiece::Insertable, 0, &call.params[k]);
+                }
+                text("))", 2);
+                continue;
+            }
+            if (call.slotted()) {
+                // The variable is declared after the expansion, referring to the slot its BL_return constructs, the
+                // statement of a call in an expression follows it
+                usesSlots_ = true;
+                text("flatco::RetSlot<", 16);
+                if (call.inExpr || HasIdent(call.declType.s, "auto"))
+                    text(funcs_[call.funcIndex].retType.s, funcs_[call.funcIndex].retType.len);
+                else
+                    piece(TplPiece::Insertable, 0, &call.declType);
+                text(">_BLret", 7);
+                piece(TplPiece::CallSeq, item.index, nullptr);
+                text(";", 1);
+            }
+            appendSiteStart(text_, call);
+            if (!text_.empty())
+                poolText();
+            if (call.direct || call.outlined) {
+                if (!call.lval.s.empty()) {
+                    piece(TplPiece::Insertable, 0, &call.lval);
+                    text("=", 1);
+                }
+                if (call.outlined)
+                    text("co_await ", 9);
+                text(call.name.data(), call.name.size());
+                text("(", 1);
+                for (size_t k = 0; k < call.params.size(); ++k) {
+                    if (k > 0)
+                        text(",", 1);
+                    piece(TplPiece::Insertable, 0, &call.params[k]);
+                }
+                text(")", 1);
+            }
+            else if (call.site > 1) {
+                func.expandSize = std::min(func.expandSize + CallArgsSize(call), (size_t)PTRDIFF_MAX);
+                piece(TplPiece::Shared, item.index, nullptr);
+            }
+            else {
+                call.seqOffset = func.seqCount;
+                func.seqCount += funcs_[call.funcIndex].seqCount;
+                func.expandSize = std::min(func.expandSize + funcs_[call.funcIndex].expandSize + CallArgsSize(call), (size_t)PTRDIFF_MAX);
+                piece(call.site == 1 ? TplPiece::Shared : TplPiece::Call, item.index, nullptr);
+            }
+            appendSiteClose(text_);
+            if (!text_.empty())
+                poolText();
+            if (call.inExpr) {
+                text(";", 1);
+                if (!call.stmt.s.empty()) {
+                    AppendLine(text_, lines_.row(call.stmt.s.data()), srcFileName);
+                    poolText();
+                }
+                piece(TplPiece::Insertable, 0, &call.stmt);
+                text("_BLret", 6);
+                piece(TplPiece::CallSeq, item.index, nullptr);
+                text(".take()", 7);
+            }
+            else if (declares) {
+                text(";", 1);
+                piece(TplPiece::Insertable, 0, &call.declType);
+                if (call.declType.s.back() != '&')
+                    text("&", 1);
+                text(" ", 1);
+                piece(TplPiece::Insertable, 0, &call.lval);
+                text("=*_BLret", 8);
+                piece(TplPiece::CallSeq, item.index, nullptr);
+            }
+        }
+        else if (item.kind == BL_return) {
+            text("do{ ", 4);
+            piece(TplPiece::Lval, 0, nullptr);
+            piece(TplPiece::Insertable, 0, &func.returns[item.index].seqInsertable);
+            piece(TplPiece::LvalEnd, 0, nullptr);
+            text("; goto _BLexit", 14);
+            piece(TplPiece::SeqHex, 0, nullptr);
+            text("; }while(0)", 11);
+        }
+        else {
+            assert(false);
+        }
+    }
+    text("_BLexit", 7);
+    piece(TplPiece::SeqHex, 0, nullptr);
+    text(":;}while(0)", 11);
+    for (auto& site : sites) {
+        if (func.calls[site.call].site > 1)
+            func.calls[site.call].seqOffset = func.calls[site.first].seqOffset;
+    }
+    func.tpl = Span<TplPiece>(arena_, tpl);
+    AddTplSize(func);
+
+    // A BL_func which suspends but doesn't act on the caller's coroutine by itself can run in a coroutine of its
+    // own, it's outlined when declared so or too big to be expanded at every call
+    func.outlinable = !alwaysExpand_ && !library_ && func.suspends && !func.leaves && !func.plain;
+    func.outlined = func.outlinable && (func.outline || (maxInlineBytes_ > 0 && func.expandSize > maxInlineBytes_));
+}
+
+// Does call co_await the coroutine of its callee, defined before it if after: the callee is outlined and the call
+// isn't hot, or the call is cold
+bool Parser::outline(CallItem& call, bool after) {
+    FuncItem& callee = funcs_[call.funcIndex];
+    bool outline = call.heat == Cold ? callee.outlinable : callee.outlined && call.heat != Hot;
+    call.outlined = !call.direct && after && outline;
+    if (call.outlined) {
+        callee.coroutine = true;
+        outlinedCalls_.push_back(&call);
+    }
+    return call.outlined;
+}
+
+// The top-level calls of an outlined BL_func defined before them co_await its coroutine
+void Parser::outlineCalls() {
+    for (auto& call : calls_)
+        outline(call, funcs_[call.funcIndex].name.s < call.pos);
+}
+
+// Number the BL_call sites of the source in the tables counting them, and rate them by the profile: a
+// site is cold when it ran at most a thousandth of the times of the hottest one of the source, hot when at least a
+// tenth. Cold sites are outlined and marked [[unlikely]], hot ones are expanded and not shared.
+void Parser::planProfile(std::string_view srcFileName) {
+    profileSites_.clear();
+    if (!profileGenerate_ && !instrument_ && !profile_)
+        return;
+    auto add = [this](CallItem& call) {
+        call.profileSite = (uint32_t)profileSites_.size();
+        call.heat = Unrated;
+        profileSites_.push_back(&call);
+    };
+    for (auto& func : funcs_) {
+        if (!func.imported) {
+            for (auto& call : func.calls)
+                add(call);
+        }
+    }
+    for (auto& call : calls_)
+        add(call);
+    if (!profile_)
+        return;
+
+    std::vector<uint64_t> counts(profileSites_.size());
+    std::vector<bool> found(profileSites_.size());
+    uint64_t max = 0;
+    std::string key;
+    for (size_t k = 0; k < profileSites_.size(); ++k) {
+        size_t row, col;
+        lines_.rowCol(profileSites_[k]->pos, row, col);
+        ProfileKey(key, srcFileName, row, col, profileSites_[k]->name);
+        auto it = profile_->counts.find(key);
+        if (it != profile_->counts.end()) {
+            counts[k] = it->second;
+            found[k] = true;
+            max = std::max(max, it->second);
+        }
+    }
+    for (size_t k = 0; k < profileSites_.size(); ++k) {
+        CallItem& call = *profileSites_[k];
+        if (!found[k])
+            continue;
+        if (counts[k] <= max / 1000)
+            call.heat = Cold;
+        else if (counts[k] >= max / 10)
+            call.heat = Hot;
+    }
+}
+
+// A cold site is marked [[unlikely]], a counted one is a block starting with the count of its executions, a timed
+// one is a block timed by a variable of its own
+void Parser::appendSiteStart(std::string& out, const CallItem& call) const {
+    char buf[64];
+    if (call.heat == Cold)
+        out += "[[unlikely]] ";
+    if (profileGenerate_)
+        out.append(buf, snprintf(buf, sizeof(buf), "do{_BLprofile[%u].hit();", call.profileSite));
+    if (instrument_) {
+        out.append(buf, snprintf(buf, sizeof(buf), "do{flatco::SiteTimer _BLtimer%x(_BLinstrument[%u]);",
+                                 call.profileSite, call.profileSite));
+    }
+}
+
+void Parser::appendSiteClose(std::string& out) const {
+    if (profileGenerate_)
+        out += ";}while(0)";
+    if (instrument_)
+        out += ";}while(0)";
+}
+
+// The count and timer of a site as operands of a comma expression, for a BL_call declaring a variable
+void Parser::appendSiteExpr(std::string& out, const CallItem& call) const {
+    char buf[64];
+    if (profileGenerate_)
+        out.append(buf, snprintf(buf, sizeof(buf), "_BLprofile[%u].hit(),", call.profileSite));
+    if (instrument_)
+        out.append(buf, snprintf(buf, sizeof(buf), "flatco::SiteTimer(_BLinstrument[%u]),", call.profileSite));
+}
+
+// The table flatco::<kind>Site <name>[] of the sites counted, registered to flatco_rt.h
+void Parser::appendSiteTable(std::string& out, std::string_view srcFileName, const char* kind, const char* name) {
+    char buf[48];
+    out.append(buf, snprintf(buf, sizeof(buf), "\nstatic flatco::%sSite ", kind));
+    out += name;
+    out += "[] = {";
+    for (const CallItem* call : profileSites_) {
+        size_t row, col;
+        lines_.rowCol(call->pos, row, col);
+        out += "{\"";
+        out += srcFileName;
+        out.append(buf, snprintf(buf, sizeof(buf), "\",%zu,%zu,\"", row, col));
+        out += call->name;
+        out += "\"},";
+    }
+    out.append(buf, snprintf(buf, sizeof(buf), "};\nstatic flatco::%sTable ", kind));
+    out += name;
+    out += "Table(";
+    out += name;
+    out.append(buf, snprintf(buf, sizeof(buf), ", %zu);", profileSites_.size()));
+}
+
+// The notes on the output: the BL_calls outlined, and the arguments copied with Options::warnCopies, by position
+void Parser::appendNotes(std::vector<Diagnostic>& notes) {
+    std::vector<std::pair<const char*, std::string>> all;
+    for (const CallItem* call : outlinedCalls_) {
+        const FuncItem& callee = funcs_[call->funcIndex];
+        all.emplace_back(call->pos, "BL_call of '" + std::string(call->name) + "' outlined, co_awaits its coroutine instead of expanding " +
+                         (callee.outline ? "a BL_func declared outline" : std::to_string(callee.expandSize) + " bytes") +
+                         (call->heat == Cold ? " at a cold site" : ""));
+    }
+    for (auto& [call, i] : copiedArgs_) {
+        const FuncParam& param = funcs_[call->funcIndex].params[i];
+        std::string_view arg = Trim(call->params[i].s);
+        all.emplace_back(call->pos, "BL_call of '" + std::string(call->name) + "' copies '" + std::string(arg) + "' to its parameter '" +
+                         std::string(Trim(std::string_view(param.type.s, param.type.len))) + ' ' +
+                         std::string(param.name.s, param.name.len) + "', pass std::move(" + std::string(arg) +
+                         ") if it isn't used after");
+    }
+    std::stable_sort(all.begin(), all.end(), [](auto& a, auto& b) { return a.first < b.first; });
+    for (auto& [pos, message] : all) {
+        Diagnostic& note = notes.emplace_back();
+        lines_.rowCol(pos, note.row, note.col);
+        note.message = std::move(message);
+    }
+}
+
+// Can the calls of func share an expansion: it's marked shared or big enough, and its parameters and result can
+// be held by variables declared with their types
+bool Parser::shareable(const FuncItem& func) const {
+    // A timer can't be jumped over to a shared expansion, which has no site of its own to time anyway
+    if (library_ || instrument_ || func.plain || func.retType.len == 0)
+        return false;
+    if (!func.shared && (sharedMinBytes_ == 0 || func.expandSize < sharedMinBytes_))
+        return false;
+    std::string_view retType = TrimRight(std::string_view(func.retType.s, func.retType.len));
+    if (HasIdent(retType, "auto") || HasIdent(retType, "decltype") || (!func.retvoid && retType.back() == '&'))
+        return false;
+    for (auto& param : func.params) {
+        std::string_view type(param.type.s, param.type.len);
+        if (HasIdent(type, "auto") || HasIdent(type, "decltype"))
+            return false;
+    }
+    return true;
+}
+
+// The variables of the expansion of func shared at seq, declared in a block holding all the calls sharing it:
+// the site which called it, a slot for every argument and the result
+void Parser::appendSharedDecls(std::string& out, const FuncItem& func, size_t seq) const {
+    out += "int _BLsite";
+    AppendHex(out, seq);
+    out += ';';
+    for (auto& param : func.params) {
+        std::string_view type = TrimRight(std::string_view(param.type.s, param.type.len));
+        if (IsMutableRef(param.type)) {
+            out += "std::remove_reference_t<";
+            out += type;
+            out += ">* _BLslot";
+        }
+        else {
+            out += "std::remove_cvref_t<";
+            out += type;
+            out += "> _BLslot";
+        }
+        AppendHex(out, seq);
+        out += '_';
+        out.append(param.name.s, param.name.len);
+        out += ';';
+    }
+    if (!func.retvoid) {
+        out += "std::remove_cv_t<";
+        out += TrimRight(std::string_view(func.retType.s, func.retType.len));
+        out += "> _BLresult";
+        AppendHex(out, seq);
+        out += ';';
+    }
+}
+
+// Start the expansion of call at seq, or the site of an expansion shared at seq: store the site and the arguments
+// to the slots, then go to the expansion, held by the first site
+void Parser::pushCall(std::string& out, const CallItem& call, size_t seq, size_t callerSeq,
+                      std::vector<ExpandFrame>& stack) const {
+    const FuncItem& callee = funcs_[call.funcIndex];
+    if (call.site == 0) {
+        stack.push_back(ExpandFrame{ &callee, 0, seq, &call, callerSeq, false, false });
+        return;
+    }
+    char buf[16];
+    out += "do{_BLsite";
+    AppendHex(out, seq);
+    out.append(buf, snprintf(buf, sizeof(buf), "=%u;", call.site));
+    for (size_t i = 0; i < callee.params.size(); ++i) {
+        const FuncParam& param = callee.params[i];
+        out += "_BLslot";
+        AppendHex(out, seq);
+        out += '_';
+        out.append(param.name.s, param.name.len);
+        bool ref = IsMutableRef(param.type);
+        out += ref ? "=__builtin_addressof(" : "=";
+        AppendSeqInsertable(out, call.params[i], callerSeq);
+        out += ref ? ");" : ";";
+    }
+    if (call.site == 1) {
+        out += "_BLshared";
+        AppendHex(out, seq);
+        out += ':';
+        stack.push_back(ExpandFrame{ &callee, 0, seq, &call, callerSeq, true, false });
+    }
+    else {
+        out += "goto _BLshared";
+        AppendHex(out, seq);
+        out += ';';
+        appendSiteEnd(out, call, seq, callerSeq);
+    }
+}
+
+// End the site of an expansion shared at seq: the first site returns to the one which called the expansion, every
+// site takes the result
+void Parser::appendSiteEnd(std::string& out, const CallItem& call, size_t seq, size_t callerSeq) const {
+    char buf[32];
+    if (call.site == 1) {
+        out += ";switch(_BLsite";
+        AppendHex(out, seq);
+        out += "){";
+        for (uint32_t k = 2; k <= call.nSites; ++k) {
+            out.append(buf, snprintf(buf, sizeof(buf), "case %u:goto _BLret", k));
+            AppendHex(out, seq);
+            out.append(buf, snprintf(buf, sizeof(buf), "_%u;", k));
+        }
+        out += '}';
+    }
+    else {
+        out += "_BLret";
+        AppendHex(out, seq);
+        out.append(buf, snprintf(buf, sizeof(buf), "_%u:;", call.site));
+    }
+    if (!call.lval.s.empty()) {
+        AppendSeqInsertable(out, call.lval, callerSeq);
+        out += "=static_cast<decltype(_BLresult";
+        AppendHex(out, seq);
+        out += ")&&>(_BLresult";
+        AppendHex(out, seq);
+        out += ");";
+    }
+    out += "}while(0)";
+}
+
+// Stream the template of call's callee, and of the BL_funcs called in it, to out. seq is the seq of the
+// callee's expansion, the nested expansions are tracked by stack instead of recursion. In a shared expansion
+// the parameters are bound to the slots and BL_return stores the result.
+void Parser::expand(std::string& out, const CallItem& call, size_t seq, std::vector<ExpandFrame>& stack) const {
+    stack.clear();
+    pushCall(out, call, seq, 0, stack);
+    expandFrames(out, stack);
+}
+
+void Parser::expandFrames(std::string& out, std::vector<ExpandFrame>& stack) const {
+    while (!stack.empty()) {
+        ExpandFrame& f = stack.back();
+        if (f.piece >= f.func->tpl.size()) {
+            if (f.shared)
+                appendSiteEnd(out, *f.call, f.seq, f.callerSeq);
+            stack.pop_back();
+            continue;
+        }
+        const TplPiece& piece = f.func->tpl[f.piece++];
+        switch (piece.kind) {
+        case TplPiece::Text:
+            out.append(piece.s, piece.n);
+            break;
+        case TplPiece::SeqHex:
+            AppendHex(out, f.seq);
+            break;
+        case TplPiece::Insertable:
+            AppendSeqInsertable(out, *piece.si, f.seq);
+            break;
+        case TplPiece::Lval:
+            if (f.outlined)
+                out += "co_return ";
+            else if (f.shared) {
+                if (f.func->retvoid)
+                    out += ' ';
+                else {
+                    out += "_BLresult";
+                    AppendHex(out, f.seq);
+                    out += '=';
+                }
+            }
+            else if (f.call->slotted()) {
+                out += "::new(_BLret";
+                AppendHex(out, f.seq);
+                out += ".place())decltype(_BLret";
+                AppendHex(out, f.seq);
+                out += ")::type(";
+            }
+            else if (f.call->lval.s.empty())
+                out += ' ';
+            else {
+                AppendSeqInsertable(out, f.call->lval, f.callerSeq);
+                out += '=';
+            }
+            break;
+        case TplPiece::LvalEnd:
+            if (!f.outlined && !f.shared && f.call->slotted()) {
+                out += "),_BLret";
+                AppendHex(out, f.seq);
+                out += ".made()";
+            }
+            break;
+        case TplPiece::CallSeq:
+            AppendHex(out, f.seq + f.func->calls[piece.n].seqOffset);
+            break;
+        case TplPiece::Param:
+            if (f.outlined) {
+                const FuncParam& param = f.func->params[piece.n];
+                out += "static_cast<decltype(";
+                out.append(param.name.s, param.name.len);
+                out += ")&&>(";
+                out.append(param.name.s, param.name.len);
+                out += ')';
+            }
+            else if (f.shared) {
+                const FuncParam& param = f.func->params[piece.n];
+                bool ref = IsMutableRef(param.type);
+                out += ref ? "*_BLslot" : "static_cast<decltype(_BLslot";
+                AppendHex(out, f.seq);
+                out += '_';
+                out.append(param.name.s, param.name.len);
+                if (!ref) {
+                    out += ")&&>(_BLslot";
+                    AppendHex(out, f.seq);
+                    out += '_';
+                    out.append(param.name.s, param.name.len);
+                    out += ')';
+                }
+            }
+            else
+                AppendSeqInsertable(out, f.call->params[piece.n], f.callerSeq);
+            break;
+        case TplPiece::Call:
+        case TplPiece::Shared: {
+            const CallItem& callee = f.func->calls[piece.n];
+            size_t callerSeq = f.seq;
+            pushCall(out, callee, callerSeq + callee.seqOffset, callerSeq, stack);
+            break;
+        }
+        case TplPiece::SharedDecl: {
+            const CallItem& first = f.func->calls[piece.n];
+            appendSharedDecls(out, funcs_[first.funcIndex], f.seq + first.seqOffset);
+            break;
+        }
+        }
+    }
+}
+
+// The compiled BL_funcs of a library, parsed from its source or loaded from an Index. It isn't changed once built
+// so that it can be shared, the sources importing it copy the calls of its BL_funcs to link them.
+struct Library {
+    std::string path;                 // canonical, also its name in #line
+    std::vector<std::string> imports; // the libraries it imports directly or not, each one after those it imports
+    LibraryHashes hashes;             // of it and its imports when it was built
+    std::vector<FuncItem> funcs;
+    size_t bytes = 0;                 // about the memory it takes
+    std::string src;                  // a parsed library's nodes point into src and parser
+    std::unique_ptr<Parser> parser;
+    Arena arena{ 4096 };              // a loaded library's nodes, which point into the index
+};
+
+// The absolute path of a file without "." , ".." and links, the same whichever way a library is imported
+std::string CanonicalPath(const std::filesystem::path& path) {
+    std::error_code ec;
+    std::filesystem::path absolute = std::filesystem::absolute(path, ec);
+    std::filesystem::path canonical = std::filesystem::weakly_canonical(absolute, ec);
+    return (ec ? absolute.lexically_normal() : canonical).string();
+}
+
+// The hash of a library which can't be read
+const CacheKey k_missingFile{ 0, 0 };
+
+// The libraries of one transform: every file is read once and every library loaded once
+class Libraries {
+    struct File {
+        bool ok;
+        std::string data;
+        CacheKey hash; // k_missingFile if it can't be read
+    };
+
+    const Index::Impl* index_;
+    Cache::Impl* cache_;
+    std::unordered_map<std::string, File> files_;
+    std::unordered_map<std::string, std::shared_ptr<const Library>> loaded_;
+    std::vector<std::shared_ptr<const Library>> all_; // in the order they were loaded
+    std::vector<std::string> parsing_;                // the chain of libraries being parsed, to catch cycles
+    std::vector<std::string> tried_;                  // the paths of all the libraries load() was called for
+
+    std::shared_ptr<const Library> parse(const std::string& path, const File& file);
+
+public:
+    Libraries(const Index::Impl* index, Cache::Impl* cache) : index_(index), cache_(cache) {}
+
+    // nullptr if path can't be read
+    const File* read(const std::string& path) {
+        auto [it, inserted] = files_.try_emplace(path);
+        File& file = it->second;
+        if (inserted) {
+            MappedFile mapped;
+            file.ok = mapped.open(path.c_str());
+            file.hash = k_missingFile;
+            if (file.ok) {
+                file.data.assign(mapped.data(), mapped.size());
+                uint64_t h1 = k_hashSeed1, h2 = k_hashSeed2;
+                HashBytes(file.data.data(), file.data.size(), h1, h2);
+                file.hash = CacheKey{ HashFinal(h1), HashFinal(h2) };
+            }
+        }
+        return file.ok ? &file : nullptr;
+    }
+
+    CacheKey hash(const std::string& path) {
+        read(path);
+        return files_[path].hash;
+    }
+
+    // Are the files unchanged, the missing ones still missing
+    bool current(const LibraryHashes& hashes) {
+        for (auto& [path, h] : hashes) {
+            if (!(hash(path) == h))
+                return false;
+        }
+        return true;
+    }
+
+    // The library path imported at pos, from the index, the cache or its source
+    std::shared_ptr<const Library> load(const std::string& path, const char* pos);
+
+    const std::vector<std::shared_ptr<const Library>>& all() const { return all_; }
+
+    // Of the libraries loaded, then of the ones which failed, missing or with errors, so that a result failing on
+    // them is redone once they change
+    LibraryHashes hashes() {
+        LibraryHashes hashes;
+        for (auto& lib : all_)
+            hashes.emplace_back(lib->path, hash(lib->path));
+        for (auto& path : tried_) {
+            if (loaded_.find(path) == loaded_.end())
+                hashes.emplace_back(path, hash(path));
+        }
+        return hashes;
+    }
+};
+
+void Parser::link(Libraries& libs, std::string_view fileName) {
+    if (!imports_.empty()) {
+        std::filesystem::path dir = std::filesystem::path(fileName).parent_path();
+        for (auto& import : imports_)
+            importLibrary(libs, CanonicalPath(dir / import.name), import.pos);
+    }
+    prepare();
+}
+
+// Add the BL_funcs of the library path and of the ones it imports to funcs_, pos is where it's imported
+void Parser::importLibrary(Libraries& libs, const std::string& path, const char* pos) {
+    for (auto& lib : libraries_) {
+        if (lib->path == path)
+            return;
+    }
+    std::shared_ptr<const Library> lib = libs.load(path, pos);
+    for (auto& import : lib->imports)
+        importLibrary(libs, import, pos);
+    for (auto& func : lib->funcs) {
+        std::string_view name(func.name.s, func.name.len);
+        if (!name2Func_.insert(name, funcs_.size()))
+            throw BlError(pos, ("BL_func " + std::string(name) + " of '" + path + "' is also in another library").c_str());
+        FuncItem& imported = funcs_.emplace_back(func);
+        imported.calls = Span<CallItem>(arena_.copy(func.calls.p, func.calls.n), func.calls.n);
+        imported.imported = true;
+    }
+    libraries_.push_back(std::move(lib));
+}
+
+// Throw if the code outside the BL_funcs of a library isn't only blanks, comments and preprocessor lines
+void CheckLibraryCode(std::string_view s) {
+    Lexer lex(s.data(), s.size());
+    char c = lex.skipCommentsGet();
+    while (c) {
+        if (c == '#') {
+            // To the end of the line, which can be continued by '\'
+            char prev = c;
+            while ((c = lex.get()) && (c != '\n' || prev == '\\'))
+                prev = c;
+        }
+        else if (!IsSpaceChar(c))
+            throw BlError(lex.curP(), "Only BL_funcs, comments and preprocessor lines can be in a BL_func library");
+        c = lex.skipCommentsGet();
+    }
+}
+
+void Parser::compileLibrary(Library& lib) {
+    library_ = true;
+    for (auto& item : items_) {
+        if (item.kind == CODE)
+            CheckLibraryCode(item.s.s);
+        else if (item.kind == BL_call)
+            throw BlError(item.pos, "Can't use BL_call outside BL_func in a BL_func library");
+    }
+    for (size_t i : sorted_)
+        compile(funcs_[i], lib.path);
+    lib.funcs.assign(funcs_.begin(), funcs_.begin() + bodies_.size());
+    for (auto& imported : libraries_)
+        lib.imports.push_back(imported->path);
+}
+
+std::shared_ptr<const Library> Libraries::parse(const std::string& path, const File& file) {
+    if (std::find(parsing_.begin(), parsing_.end(), path) != parsing_.end())
+        return nullptr;
+    auto lib = std::make_shared<Library>();
+    lib->path = path;
+    lib->src = file.data;
+    parsing_.push_back(path);
+    try {
+        // The BL_funcs of a library are always expanded, the sources importing it don't generate functions
+        ParserOptions options;
+        options.cache = cache_;
+        options.alwaysExpand = true;
+        lib->parser = std::make_unique<Parser>(lib->src.data(), lib->src.size(), options);
+        lib->parser->link(*this, path);
+        lib->parser->compileLibrary(*lib);
+    }
+    catch (BlError& err) {
+        if (err.fileName.empty()) {
+            LineIndex(lib->src.data(), lib->src.size()).rowCol(err.pos, err.row, err.col);
+            err.fileName = path;
+        }
+        throw;
+    }
+    parsing_.pop_back();
+    for (auto& import : lib->imports)
+        lib->hashes.emplace_back(import, read(import)->hash);
+    lib->hashes.emplace_back(path, file.hash);
+    lib->bytes = sizeof(Library) + lib->src.size() * 4; // the source and about its nodes and templates
+    return lib;
+}
+
+// The format of an index written by writeIndex(): records of 64 bits fields, which refer to other records and
+// to strings by their offset in the file. The strings and seq positions are used where they are mapped.
+const char k_indexMagic[8] = { 'F', 'L', 'A', 'T', 'C', 'O', 'I', 'X' };
+const uint64_t k_indexFormat = 4;
+const uint64_t k_indexByteOrder = 0x0102030405060708ull;
+
+struct IndexStr {
+    uint64_t off, len;
+};
+
+struct IndexHeader {
+    char magic[8];
+    uint64_t byteOrder;
+    uint64_t format;
+    uint64_t sizeofSizeT;
+    IndexStr version;
+    uint64_t fileSize;
+    uint64_t h1, h2; // of the bytes following the header
+    uint64_t nLibs, libsOff;
+};
+
+struct IndexLib {
+    IndexStr path;
+    uint64_t h1, h2;               // of the library's contents
+    uint64_t nImports, importsOff; // indexes of IndexLib, each one less than the library's own
+    uint64_t nFuncs, funcsOff;
+};
+
+struct IndexSi {
+    IndexStr s;
+    uint64_t nPos, posOff;
+};
+
+struct IndexParam {
+    IndexStr type, name;
+};
+
+struct IndexCall {
+    IndexStr name;
+    IndexSi lval;
+    IndexSi declType;
+    IndexSi stmt;
+    uint64_t inExpr;
+    uint64_t nParams, paramsOff; // IndexSi
+};
+
+// Text: a, b are the offset and length, Insertable: a is the offset of an IndexSi, Param, Call and CallSeq: a is n
+struct IndexPiece {
+    uint64_t kind, a, b;
+};
+
+struct IndexFunc {
+    IndexStr name;
+    IndexStr retType;
+    uint64_t retvoid;
+    uint64_t shared;
+    uint64_t nParams, paramsOff;
+    uint64_t nCalls, callsOff;
+    uint64_t nPieces, piecesOff;
+};
+
+class IndexWriter {
+    std::string out_;
+
+public:
+    IndexWriter() : out_(sizeof(IndexHeader), '\0') {}
+
+    std::string& out() { return out_; }
+
+    uint64_t put(const void* p, size_t n) {
+        out_.resize((out_.size() + 7) & ~(size_t)7);
+        uint64_t off = out_.size();
+        out_.append((const char*)p, n);
+        return off;
+    }
+
+    template <typename T>
+    uint64_t array(const std::vector<T>& v) { return put(v.data(), v.size() * sizeof(T)); }
+
+    IndexStr str(std::string_view s) { return IndexStr{ put(s.data(), s.size()), s.size() }; }
+
+    IndexSi si(const SeqInsertable& si) {
+        return IndexSi{ str(si.s), si.seqPositions.size(), put(si.seqPositions.p, si.seqPositions.size() * sizeof(size_t)) };
+    }
+
+    IndexFunc func(const FuncItem& func) {
+        std::vector<IndexParam> params;
+        for (auto& param : func.params)
+            params.push_back(IndexParam{ str(std::string_view(param.type.s, param.type.len)), str(std::string_view(param.name.s, param.name.len)) });
+        std::vector<IndexCall> calls;
+        std::vector<IndexSi> args;
+        for (auto& call : func.calls) {
+            args.clear();
+            for (auto& arg : call.params)
+                args.push_back(si(arg));
+            calls.push_back(IndexCall{ str(call.name), si(call.lval), si(call.declType), si(call.stmt), call.inExpr,
+                                            args.size(), array(args) });
+        }
+        std::vector<IndexPiece> pieces;
+        for (auto& piece : func.tpl) {
+            IndexPiece rec{ piece.kind, 0, 0 };
+            if (piece.kind == TplPiece::Text) {
+                rec.a = put(piece.s, piece.n);
+                rec.b = piece.n;
+            }
+            else if (piece.kind == TplPiece::Insertable) {
+                IndexSi pieceSi = si(*piece.si);
+                rec.a = put(&pieceSi, sizeof(pieceSi));
+            }
+            else if (piece.kind == TplPiece::Param || piece.kind == TplPiece::Call || piece.kind == TplPiece::CallSeq)
+                rec.a = piece.n;
+            pieces.push_back(rec);
+        }
+        return IndexFunc{ str(std::string_view(func.name.s, func.name.len)), str(std::string_view(func.retType.s, func.retType.len)),
+                          func.retvoid, func.shared, params.size(), array(params), calls.size(), array(calls),
+                          pieces.size(), array(pieces) };
+    }
+};
+
+// An index is mapped as is. A damaged one fails to open by its hash, the references in it are still checked while
+// loading from it so that a wrong one only makes the libraries parsed.
+struct Index::Impl {
+    MappedFile file;
+    const IndexLib* libs = nullptr;
+    std::unordered_map<std::string, size_t> libIndexes; // by path
+
+    template <typename T>
+    const T* at(uint64_t off, uint64_t n) const {
+        size_t size = file.size();
+        if (off % alignof(T) != 0 || off > size || n > (size - off) / sizeof(T))
+            return nullptr;
+        return (const T*)(file.data() + off);
+    }
+
+    bool str(const IndexStr& rec, std::string_view& s) const {
+        const char* p = at<char>(rec.off, rec.len);
+        if (!p)
+            return false;
+        s = std::string_view(p, rec.len);
+        return true;
+    }
+
+    bool si(const IndexSi& rec, SeqInsertable& si) const {
+        const uint64_t* positions = at<uint64_t>(rec.posOff, rec.nPos);
+        if (!str(rec.s, si.s) || !positions)
+            return false;
+        for (uint64_t i = 0; i < rec.nPos; ++i) {
+            if (positions[i] > si.s.size() || (i > 0 && positions[i] < positions[i - 1]))
+                return false;
+        }
+        si.seqPositions = Span<size_t>((size_t*)positions, rec.nPos);
+        return true;
+    }
+
+    bool open(const char* fileName) {
+        libIndexes.clear();
+        libs = nullptr;
+        if (!file.open(fileName))
+            return false;
+        const IndexHeader* header = at<IndexHeader>(0, 1);
+        std::string_view ver;
+        if (!header || memcmp(header->magic, k_indexMagic, sizeof(k_indexMagic)) != 0 || header->byteOrder != k_indexByteOrder ||
+            header->format != k_indexFormat || header->sizeofSizeT != sizeof(size_t) || sizeof(size_t) != sizeof(uint64_t) ||
+            header->fileSize != file.size() || !str(header->version, ver) || ver != version())
+            return false;
+        uint64_t h1 = k_hashSeed1, h2 = k_hashSeed2;
+        HashBytes(file.data() + sizeof(IndexHeader), file.size() - sizeof(IndexHeader), h1, h2);
+        if (HashFinal(h1) != header->h1 || HashFinal(h2) != header->h2)
+            return false;
+        libs = at<IndexLib>(header->libsOff, header->nLibs);
+        if (!libs)
+            return false;
+        for (size_t i = 0; i < header->nLibs; ++i) {
+            std::string_view path;
+            if (!str(libs[i].path, path))
+                return false;
+            libIndexes.emplace(std::string(path), i);
+        }
+        return true;
+    }
+
+    bool func(const IndexFunc& rec, Arena& arena, FuncItem& func) const {
+        std::string_view name, retType;
+        const IndexParam* params = at<IndexParam>(rec.paramsOff, rec.nParams);
+        const IndexCall* calls = at<IndexCall>(rec.callsOff, rec.nCalls);
+        const IndexPiece* pieces = at<IndexPiece>(rec.piecesOff, rec.nPieces);
+        if (!str(rec.name, name) || !str(rec.retType, retType) || !params || !calls || !pieces)
+            return false;
+        std::vector<FuncParam> funcParams(rec.nParams);
+        for (size_t i = 0; i < rec.nParams; ++i) {
+            std::string_view type, paramName;
+            if (!str(params[i].type, type) || !str(params[i].name, paramName))
+                return false;
+            funcParams[i] = FuncParam{ Token{ type.data(), type.size() }, Token{ paramName.data(), paramName.size() } };
+        }
+        std::vector<CallItem> funcCalls(rec.nCalls);
+        std::vector<SeqInsertable> args;
+        for (size_t i = 0; i < rec.nCalls; ++i) {
+            const IndexSi* callArgs = at<IndexSi>(calls[i].paramsOff, calls[i].nParams);
+            CallItem& call = funcCalls[i];
+            if (!callArgs || !str(calls[i].name, call.name) || !si(calls[i].lval, call.lval) ||
+                !si(calls[i].declType, call.declType) || !si(calls[i].stmt, call.stmt))
+                return false;
+            call.inExpr = calls[i].inExpr != 0;
+            call.pos = call.name.data();
+            args.resize(calls[i].nParams);
+            for (size_t k = 0; k < args.size(); ++k) {
+                if (!si(callArgs[k], args[k]))
+                    return false;
+            }
+            call.params = Span<SeqInsertable>(arena, args);
+        }
+        std::vector<TplPiece> tpl(rec.nPieces);
+        for (size_t i = 0; i < rec.nPieces; ++i) {
+            const IndexPiece& piece = pieces[i];
+            TplPiece& tp = tpl[i];
+            tp = TplPiece{ (TplPiece::Kind)piece.kind, nullptr, 0, nullptr };
+            if (piece.kind == TplPiece::Text) {
+                tp.s = at<char>(piece.a, piece.b);
+                tp.n = piece.b;
+                if (!tp.s)
+                    return false;
+            }
+            else if (piece.kind == TplPiece::Insertable) {
+                const IndexSi* pieceSi = at<IndexSi>(piece.a, 1);
+                SeqInsertable s;
+                if (!pieceSi || !si(*pieceSi, s))
+                    return false;
+                tp.si = arena.copy(&s, 1);
+            }
+            else if (piece.kind == TplPiece::Param || piece.kind == TplPiece::Call || piece.kind == TplPiece::CallSeq) {
+                if (piece.a >= (piece.kind == TplPiece::Param ? rec.nParams : rec.nCalls))
+                    return false;
+                tp.n = piece.a;
+            }
+            else if (piece.kind != TplPiece::SeqHex && piece.kind != TplPiece::Lval && piece.kind != TplPiece::LvalEnd)
+                return false;
+        }
+        func = FuncItem{ .name = Token{ name.data(), name.size() }, .retType = Token{ retType.data(), retType.size() },
+                         .coType = {}, .params = Span<FuncParam>(arena, funcParams), .items = {}, .returns = {},
+                         .calls = Span<CallItem>(arena, funcCalls), .retvoid = rec.retvoid != 0, .seqCount = 0,
+                         .expandSize = 0, .tpl = Span<TplPiece>(arena, tpl), .imported = true, .suspends = true,
+                         .leaves = true, .plain = false, .shared = rec.shared != 0, .outline = false,
+                         .outlinable = false, .outlined = false, .coroutine = false };
+        return true;
+    }
+
+    // The library path if it's in the index and unchanged
+    std::shared_ptr<const Library> load(const std::string& path, Libraries& libraries) const {
+        auto it = libIndexes.find(path);
+        if (it == libIndexes.end())
+            return nullptr;
+        const IndexLib& rec = libs[it->second];
+        const uint64_t* imports = at<uint64_t>(rec.importsOff, rec.nImports);
+        const IndexFunc* funcs = at<IndexFunc>(rec.funcsOff, rec.nFuncs);
+        if (!imports || !funcs)
+            return nullptr;
+        auto lib = std::make_shared<Library>();
+        lib->path = path;
+        for (size_t i = 0; i < rec.nImports; ++i) {
+            std::string_view import;
+            if (imports[i] >= it->second || !str(libs[imports[i]].path, import))
+                return nullptr;
+            lib->imports.emplace_back(import);
+            lib->hashes.emplace_back(std::string(import), CacheKey{ libs[imports[i]].h1, libs[imports[i]].h2 });
+        }
+        lib->hashes.emplace_back(path, CacheKey{ rec.h1, rec.h2 });
+        if (!libraries.current(lib->hashes))
+            return nullptr;
+        lib->funcs.resize(rec.nFuncs);
+        for (size_t i = 0; i < rec.nFuncs; ++i) {
+            if (!func(funcs[i], lib->arena, lib->funcs[i]))
+                return nullptr;
+        }
+        return lib;
+    }
+};
+
+std::shared_ptr<const Library> Libraries::load(const std::string& path, const char* pos) {
+    auto it = loaded_.find(path);
+    if (it != loaded_.end())
+        return it->second;
+    if (std::find(tried_.begin(), tried_.end(), path) == tried_.end())
+        tried_.push_back(path);
+    const File* file = read(path);
+    if (!file)
+        throw BlError(pos, ("Can't read BL_func library '" + path + "'").c_str());
+
+    uint64_t h1 = k_hashSeed1, h2 = k_hashSeed2;
+    HashBytes("library", 7, h1, h2);
+    HashBytes(path.data(), path.size(), h1, h2);
+    CacheKey key{ HashFinal(h1), HashFinal(h2) };
+    std::shared_ptr<const Library> lib;
+    if (index_)
+        lib = index_->load(path, *this);
+    if (!lib && cache_) {
+        lib = cache_->findLibrary(key);
+        if (lib && !current(lib->hashes))
+            lib = nullptr;
+    }
+    if (!lib) {
+        lib = parse(path, *file);
+        if (!lib)
+            throw BlError(pos, ("BL_func library '" + path + "' is imported by itself, directly or not").c_str());
+        if (cache_)
+            cache_->insert(key, lib, lib->bytes);
+    }
+    loaded_.emplace(path, lib);
+    all_.push_back(lib);
+    return lib;
+}
+
+Profile::Profile() : impl_(new Impl) {}
+
+Profile::~Profile() = default;
+
+bool Profile::parse(std::string_view text) {
+    return impl_->parse(text);
+}
+
+Index::Index() : impl_(new Impl) {}
+
+Index::~Index() = default;
+
+bool Index::open(const char* fileName) {
+    return impl_->open(fileName);
+}
+
+Diagnostic ToDiagnostic(BlError& err, std::string_view src) {
+    if (err.fileName.empty() && err.pos)
+        LineIndex(src.data(), src.size()).rowCol(err.pos, err.row, err.col);
+    return Diagnostic{ .row = err.row, .col = err.col, .message = std::move(err.s), .fileName = std::move(err.fileName) };
+}
+
+bool writeIndex(const std::vector<std::string>& libraries, const char* fileName, std::vector<Diagnostic>& diagnostics) {
+    Libraries libs(nullptr, nullptr);
+    try {
+        for (auto& name : libraries) {
+            std::string path = CanonicalPath(name);
+            if (!libs.read(path)) {
+                diagnostics.push_back(Diagnostic{ .row = 0, .col = 0, .message = "Can't read BL_func library", .fileName = path });
+                return false;
+            }
+            libs.load(path, nullptr);
+        }
+    }
+    catch (BlError& err) {
+        diagnostics.push_back(ToDiagnostic(err, std::string_view()));
+        return false;
+    }
+
+    std::unordered_map<std::string, uint64_t> libIndexes;
+    for (auto& lib : libs.all())
+        libIndexes.emplace(lib->path, libIndexes.size());
+    IndexWriter writer;
+    std::vector<IndexLib> recs;
+    std::vector<uint64_t> imports;
+    std::vector<IndexFunc> funcs;
+    for (auto& lib : libs.all()) {
+        imports.clear();
+        for (auto& import : lib->imports)
+            imports.push_back(libIndexes[import]);
+        funcs.clear();
+        for (auto& func : lib->funcs)
+            funcs.push_back(writer.func(func));
+        const CacheKey& hash = lib->hashes.back().second;
+        recs.push_back(IndexLib{ writer.str(lib->path), hash.h1, hash.h2, imports.size(), writer.array(imports),
+                                 funcs.size(), writer.array(funcs) });
+    }
+    IndexHeader header{};
+    memcpy(header.magic, k_indexMagic, sizeof(k_indexMagic));
+    header.byteOrder = k_indexByteOrder;
+    header.format = k_indexFormat;
+    header.sizeofSizeT = sizeof(size_t);
+    header.version = writer.str(version());
+    header.nLibs = recs.size();
+    header.libsOff = writer.array(recs);
+    std::string& out = writer.out();
+    header.fileSize = out.size();
+    uint64_t h1 = k_hashSeed1, h2 = k_hashSeed2;
+    HashBytes(out.data() + sizeof(header), out.size() - sizeof(header), h1, h2);
+    header.h1 = HashFinal(h1);
+    header.h2 = HashFinal(h2);
+    memcpy(out.data(), &header, sizeof(header));
+
+    // Written to a temporary file renamed over the index, which other processes may have mapped
+    static std::atomic<unsigned> s_counter{ 0 };
+    char suffix[64];
+    snprintf(suffix, sizeof(suffix), ".tmp%zx%llx%x", std::hash<std::thread::id>{}(std::this_thread::get_id()),
+             (unsigned long long)std::chrono::steady_clock::now().time_since_epoch().count(), s_counter.fetch_add(1));
+    std::string tmp = std::string(fileName) + suffix;
+    FILE* f = fopen(tmp.c_str(), "wb");
+    bool ok = f && fwrite(out.data(), 1, out.size(), f) == out.size();
+    if (f && fclose(f) != 0)
+        ok = false;
+    std::error_code ec;
+    if (ok) {
+        std::filesystem::rename(tmp, fileName, ec);
+        ok = !ec;
+    }
+    if (!ok)
+        std::filesystem::remove(tmp, ec);
+    if (!ok)
+        diagnostics.push_back(Diagnostic{ .row = 0, .col = 0, .message = "Can't write the index", .fileName = fileName });
+    return ok;
+}
+
+Result transform(std::string_view src, std::string_view fileName, const Options& options) {
+    Result result;
+    result.ok = transform(src, fileName, options, result.output, result.diagnostics, &result.libraries);
+    return result;
+}
+
+bool TransformUncached(std::string_view src, std::string_view fileName, const Options& options, std::string& out,
+                      std::vector<Diagnostic>& diagnostics, Libraries& libs) {
+    try {
+        Parser parser(src.data(), src.size(), ParserOptions(options));
+        parser.link(libs, fileName);
+        out.reserve(out.size() + src.size() + src.size() / 2);
+        parser.gen(out, fileName);
+        parser.appendNotes(diagnostics);
+        return true;
+    }
+    catch (BlError& err) {
+        diagnostics.push_back(ToDiagnostic(err, src));
+        return false;
+    }
+}
+
+// The key of a whole result: everything the output depends on
+CacheKey ResultKey(std::string_view src, std::string_view fileName, const Options& options) {
+    uint64_t h1 = k_hashSeed1, h2 = k_hashSeed2;
+    HashBytes("result", 6, h1, h2);
+    HashBytes(options.alwaysExpand ? "E" : "", options.alwaysExpand ? 1 : 0, h1, h2);
+    uint64_t sharedMinBytes = options.sharedMinBytes;
+    HashBytes((const char*)&sharedMinBytes, sizeof(sharedMinBytes), h1, h2);
+    uint64_t maxInlineBytes = options.maxInlineBytes;
+    HashBytes((const char*)&maxInlineBytes, sizeof(maxInlineBytes), h1, h2);
+    HashBytes(options.profileGenerate ? "P" : "", options.profileGenerate ? 1 : 0, h1, h2);
+    HashBytes(options.instrument ? "I" : "", options.instrument ? 1 : 0, h1, h2);
+    HashBytes(options.warnCopies ? "C" : "", options.warnCopies ? 1 : 0, h1, h2);
+    uint64_t profileHash[2] = { 0, 0 };
+    if (options.profile) {
+        profileHash[0] = options.profile->impl().h1;
+        profileHash[1] = options.profile->impl().h2;
+    }
+    HashBytes((const char*)profileHash, sizeof(profileHash), h1, h2);
+    const char* ver = version();
+    HashBytes(ver, strlen(ver), h1, h2);
+    uint64_t format = outputFormat();
+    HashBytes((const char*)&format, sizeof(format), h1, h2);
+    HashBytes(fileName.data(), fileName.size(), h1, h2);
+    HashBytes(src.data(), src.size(), h1, h2);
+    return CacheKey{ HashFinal(h1), HashFinal(h2) };
+}
+
+bool transform(std::string_view src, std::string_view fileName, const Options& options, std::string& out,
+               std::vector<Diagnostic>& diagnostics, std::vector<std::string>* libraries) {
+    if (!src.data())
+        src = std::string_view("", 0);
+    Libraries libs(options.index ? &options.index->impl() : nullptr, options.cache ? &options.cache->impl() : nullptr);
+    auto addLibraries = [libraries](const LibraryHashes& hashes) {
+        if (libraries) {
+            for (auto& lib : hashes)
+                libraries->push_back(lib.first);
+        }
+    };
+    if (!options.cache) {
+        bool ok = TransformUncached(src, fileName, options, out, diagnostics, libs);
+        addLibraries(libs.hashes());
+        return ok;
+    }
+
+    // A result is reused while the libraries it imported are unchanged
+    Cache::Impl& cache = options.cache->impl();
+    CacheKey key = ResultKey(src, fileName, options);
+    if (auto result = cache.findResult(key)) {
+        if (libs.current(result->libraries)) {
+            out += result->output;
+            diagnostics.insert(diagnostics.end(), result->diagnostics.begin(), result->diagnostics.end());
+            addLibraries(result->libraries);
+            return result->ok;
+        }
+        cache.staleResult();
+    }
+    auto result = std::make_shared<CachedResult>();
+    result->ok = TransformUncached(src, fileName, options, result->output, result->diagnostics, libs);
+    result->libraries = libs.hashes();
+    out += result->output;
+    diagnostics.insert(diagnostics.end(), result->diagnostics.begin(), result->diagnostics.end());
+    addLibraries(result->libraries);
+    bool ok = result->ok;
+    cache.insert(key, std::shared_ptr<const CachedResult>(std::move(result)));
+    return ok;
+}
+
+const char* version() {
+    return "0.1";
+}
+
+// Bumped by every change of the code generated
+const unsigned k_outputFormat = 1;
+
+unsigned outputFormat() {
+    return k_outputFormat;
+}
+
+} // namespace flatco
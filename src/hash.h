@@ -0,0 +1,45 @@
+#pragma once
+
+#ifndef _flatco_hash_h_
+#define _flatco_hash_h_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// 128 bits hash of byte strings by two 64 bits lanes with different seeds, not cryptographic.
+// Several strings are hashed by calling HashBytes() for each one with the same lanes.
+const uint64_t k_hashSeed1 = 0x9e3779b97f4a7c15ull;
+const uint64_t k_hashSeed2 = 0x2545f4914f6cdd1dull;
+
+inline uint64_t HashMix(uint64_t h, uint64_t v) {
+    h ^= v * 0x87c37b91114253d5ull;
+    h = (h << 31) | (h >> 33);
+    return h * 0x4cf5ad432745937full + 0x52dce729;
+}
+
+inline uint64_t HashFinal(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    return h ^ (h >> 33);
+}
+
+inline void HashBytes(const char* p, size_t len, uint64_t& h1, uint64_t& h2) {
+    h1 = HashMix(h1, len);
+    h2 = HashMix(h2, ~(uint64_t)len);
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t v;
+        memcpy(&v, p + i, 8);
+        h1 = HashMix(h1, v);
+        h2 = HashMix(h2, v ^ h1);
+    }
+    uint64_t v = 0;
+    memcpy(&v, p + i, len - i);
+    h1 = HashMix(h1, v);
+    h2 = HashMix(h2, v ^ h1);
+}
+
+#endif /* !_flatco_hash_h_ */
@@ -0,0 +1,1707 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <assert.h>
+#include <vector>
+#include <string>
+#include <string_view>
+#include <set>
+#include <algorithm>
+#include <thread>
+#include <stdarg.h>
+#include <errno.h>
+#include <mutex>
+#include <chrono>
+#include <filesystem>
+#include <map>
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <signal.h>
+#endif
+#include "getopt.h"
+#include "libflatco.h"
+#include "parallel.h"
+#include "hash.h"
+#include "mapped.h"
+
+const char* const k_progname = "flatco";
+const char* const k_helpstr =
+"Usage:\n"
+"flatco <options> <input_filename>\n"
+"flatco <options> --batch <input_filename> <output_filename> [<input_filename> <output_filename> ...]\n"
+"flatco <options> --cc <compiler> <compiler_options>\n"
+"flatco --make-index <index_filename> <library_filename> [<library_filename> ...]\n"
+"  An argument @<file> is replaced by the whitespace separated (optionally quoted) words in <file>\n"
+"Options:\n"
+"  -o,  --output <output_filename> Specify output file name\n"
+"  -MD                             Write a Make/Ninja depfile <output_filename>.d listing the files read\n"
+"  -MF <depfile>                   Write the depfile to <depfile>, in batch mode one rule for all outputs\n"
+"  -MT <target>                    Target name in the depfile, default is the output file name\n"
+"  -b,  --batch                    Take pairs of input and output file names\n"
+"  -j,  --jobs <n>                 Number of parallel workers, default is number of cores, at most 1024\n"
+"       --cache-dir <dir>           Reuse outputs cached in <dir>, default is $FLATCO_CACHE_DIR if set\n"
+"       --cache-max-size <size>     Maximum size of the cache, suffix K/M/G allowed, default is 1G\n"
+"       --cache-hardlink            Hard link outputs to the cached files instead of copying them\n"
+"       --cache-stats               Display cache statistics\n"
+"       --cache-clear               Remove all cached files and statistics\n"
+"       --index <index>             Load the BL_func libraries from <index> instead of parsing them\n"
+"       --make-index <index>        Compile the BL_func libraries given, and the ones they import, to <index>\n"
+"       --always-expand             Expand every BL_call, instead of generating the BL_funcs which can't suspend\n"
+"                                   as always inlined functions\n"
+"       --shared-min-bytes <size>   Share one expansion between the BL_calls in a block of the BL_funcs\n"
+"                                   expanding to <size> bytes or more, suffix K/M/G allowed\n"
+"       --max-inline-bytes <size>   Generate the BL_funcs expanding to more than <size> bytes as coroutines which\n"
+"                                   their BL_calls co_await, and report these BL_calls, suffix K/M/G allowed\n"
+"       --profile-generate          Count the executions of every BL_call site, the program built appends the\n"
+"                                   counts to $FLATCO_PROFILE or flatco.profile when it exits, see flatco_rt.h\n"
+"       --profile-use <profile>     Outline the cold BL_call sites of <profile> and mark them [[unlikely]],\n"
+"                                   expand the hot ones\n"
+"       --instrument                Count and time the executions of every BL_call site, the program built dumps\n"
+"                                   them to $FLATCO_INSTRUMENT or stderr when it exits, see flatco_rt.h\n"
+"       --warn-copies               Report the variables a BL_call copies to parameters taken by value which\n"
+"                                   may be costly to copy\n"
+"       --serve <socket>            Serve transforms on the Unix domain socket <socket>, keeping up to\n"
+"                                   --cache-max-size of sources and parsed BL_funcs in memory\n"
+"       --connect <socket>          Transform by the server on <socket>, locally if it can't be reached\n"
+"       --watch <dir>               Flatten the .cxx files under <dir> into <name>.cxx.cpp files, in the directory\n"
+"                                   given by -o if any, and again whenever they or the files they read change\n"
+"       --cc <compiler> ...         Flatten the C++ source among the compiler's arguments and pipe it to the\n"
+"                                   compiler, which reads it from stdin. Must be the last flatco option.\n"
+"  -v,  --version                  Display version\n"
+"  -h,  --help                     Display this help\n"
+;
+
+static const char* short_opts = "o:bj:vh";
+
+namespace LongOpts {
+    enum {
+        version = 'v',
+        help = 'h',
+        output = 'o',
+        batch = 'b',
+        jobs = 'j',
+        depMD = 256,
+        depMF,
+        depMT,
+        cacheDir,
+        cacheMaxSize,
+        cacheHardlink,
+        cacheStats,
+        cacheClear,
+        serve,
+        connect,
+        watch,
+        index,
+        makeIndex,
+        alwaysExpand,
+        sharedMinBytes,
+        maxInlineBytes,
+        profileGenerate,
+        profileUse,
+        instrument,
+        warnCopies,
+    };
+}
+
+static const struct option long_opts[] = {
+    { "version", no_argument,       NULL, LongOpts::version },
+    { "help",    no_argument,       NULL, LongOpts::help    },
+
+    { "output",  required_argument, NULL, LongOpts::output  },
+    { "batch",   no_argument,       NULL, LongOpts::batch   },
+    { "jobs",    required_argument, NULL, LongOpts::jobs    },
+    { "MD",      no_argument,       NULL, LongOpts::depMD   },
+    { "MF",      required_argument, NULL, LongOpts::depMF   },
+    { "MT",      required_argument, NULL, LongOpts::depMT   },
+
+    { "cache-dir",      required_argument, NULL, LongOpts::cacheDir      },
+    { "cache-max-size", required_argument, NULL, LongOpts::cacheMaxSize  },
+    { "cache-hardlink", no_argument,       NULL, LongOpts::cacheHardlink },
+    { "cache-stats",    no_argument,       NULL, LongOpts::cacheStats    },
+    { "cache-clear",    no_argument,       NULL, LongOpts::cacheClear    },
+    { "serve",          required_argument, NULL, LongOpts::serve         },
+    { "connect",        required_argument, NULL, LongOpts::connect       },
+    { "watch",          required_argument, NULL, LongOpts::watch         },
+    { "index",          required_argument, NULL, LongOpts::index         },
+    { "make-index",     required_argument, NULL, LongOpts::makeIndex     },
+    { "always-expand",  no_argument,       NULL, LongOpts::alwaysExpand  },
+    { "shared-min-bytes", required_argument, NULL, LongOpts::sharedMinBytes },
+    { "max-inline-bytes", required_argument, NULL, LongOpts::maxInlineBytes },
+    { "profile-generate", no_argument,       NULL, LongOpts::profileGenerate },
+    { "profile-use",      required_argument, NULL, LongOpts::profileUse     },
+    { "instrument",       no_argument,       NULL, LongOpts::instrument     },
+    { "warn-copies",      no_argument,       NULL, LongOpts::warnCopies     },
+
+    { NULL,           no_argument,  NULL,  0                }
+};
+
+static const char* s_outFileName = nullptr;
+static const char* s_inFileName = nullptr;
+static bool s_batch = false;
+static unsigned s_jobs = 0;
+static bool s_depMD = false;
+static const char* s_depFileName = nullptr;
+static const char* s_depTarget = nullptr;
+static const char* s_cacheDir = nullptr;
+static uint64_t s_cacheMaxSize = 1ull << 30;
+static bool s_cacheHardlink = false;
+static bool s_cacheStats = false;
+static bool s_cacheClear = false;
+static const char* s_serveSocket = nullptr;
+static const char* s_connectSocket = nullptr;
+static const char* s_watchDir = nullptr;
+static flatco::Cache* s_memCache = nullptr; // parsed state kept between the transforms of --watch
+static const char* s_indexFileName = nullptr;
+static flatco::Index* s_index = nullptr;
+static const char* s_makeIndexFileName = nullptr;
+static std::vector<std::string> s_libraries;   // to compile to the index of --make-index
+static bool s_alwaysExpand = false;
+static uint64_t s_sharedMinBytes = 0;
+static uint64_t s_maxInlineBytes = 0;
+static bool s_profileGenerate = false;
+static std::string s_profileFileName;  // absolute, empty for none
+static flatco::Profile* s_profile = nullptr;
+static bool s_instrument = false;
+static bool s_warnCopies = false;
+static int s_ccArgc = 0;                // the compiler and its arguments after --cc
+static char* const* s_ccArgv = nullptr;
+
+// Options which change the generated output, part of the output cache key
+static std::string s_genOptions;
+
+struct FileJob {
+    const char* inFileName;
+    const char* outFileName;
+    std::string msg;
+    std::vector<std::string> deps; // files read to produce the output
+    unsigned jobs;                 // threads parsing and generating the file
+    int r;
+};
+
+static std::vector<FileJob> s_fileJobs;
+
+// Replace every @<file> argument by the words in <file>. Words are separated by blanks, a word can be
+// quoted with '"' to contain blanks.
+bool ExpandResponseFiles(int argc, char* const argv[], std::vector<std::string>& args) {
+    for (int i = 0; i < argc; ++i) {
+        const char* arg = argv[i];
+        if (i == 0 || arg[0] != '@') {
+            // -MD, -MF and -MT are spelled like the compilers' options, getopt knows them as long options
+            if (!strcmp(arg, "-MD") || !strcmp(arg, "-MF") || !strcmp(arg, "-MT"))
+                args.push_back(std::string("-") + arg);
+            else
+                args.emplace_back(arg);
+            continue;
+        }
+        FILE* f = fopen(arg + 1, "r");
+        if (!f) {
+            printf("Can't open response file '%s'.\n", arg + 1);
+            return false;
+        }
+        std::string word;
+        bool inWord = false, quoted = false;
+        int c;
+        while ((c = fgetc(f)) != EOF) {
+            if (c == '"')
+                quoted = !quoted;
+            else if (!quoted && (c == ' ' || c == '\t' || c == '\n' || c == '\r')) {
+                if (inWord)
+                    args.push_back(word);
+                word.clear();
+                inWord = false;
+                continue;
+            }
+            else
+                word += (char)c;
+            inWord = true;
+        }
+        if (inWord)
+            args.push_back(word);
+        fclose(f);
+    }
+    return true;
+}
+
+bool ParseSize(const char* s, uint64_t& size) {
+    char* end;
+    size = strtoull(s, &end, 10);
+    if (end == s)
+        return false;
+    switch (*end) {
+    case 'G': case 'g': size <<= 10; [[fallthrough]];
+    case 'M': case 'm': size <<= 10; [[fallthrough]];
+    case 'K': case 'k': size <<= 10; ++end; break;
+    default: break;
+    }
+    return *end == 0;
+}
+
+// A positive count of jobs, more than k_maxJobs are capped
+const unsigned long k_maxJobs = 1024;
+
+bool ParseJobs(const char* s, unsigned& jobs) {
+    if (!isdigit((unsigned char)*s))
+        return false;
+    char* end;
+    unsigned long n = strtoul(s, &end, 10);
+    if (*end || n == 0)
+        return false;
+    jobs = (unsigned)std::min(n, k_maxJobs);
+    return true;
+}
+
+int processing_cmd(int argc, char* const argv[]) {
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, short_opts, long_opts, NULL)) != -1) {
+        switch (opt) {
+        case LongOpts::help:
+            puts(k_helpstr);
+            return 1;
+
+        case LongOpts::version:
+            printf("%s: version %s\n", k_progname, flatco::version());
+            return 1;
+
+        case LongOpts::output:
+            s_outFileName = optarg;
+            break;
+
+        case LongOpts::batch:
+            s_batch = true;
+            break;
+
+        case LongOpts::depMD:
+            s_depMD = true;
+            break;
+
+        case LongOpts::depMF:
+            s_depFileName = optarg;
+            break;
+
+        case LongOpts::depMT:
+            s_depTarget = optarg;
+            break;
+
+        case LongOpts::jobs:
+            if (!ParseJobs(optarg, s_jobs)) {
+                printf("Invalid number of jobs '%s'.\n", optarg);
+                return 1;
+            }
+            break;
+
+        case LongOpts::cacheDir:
+            s_cacheDir = optarg;
+            break;
+
+        case LongOpts::cacheMaxSize:
+            if (!ParseSize(optarg, s_cacheMaxSize)) {
+                printf("Invalid cache size '%s'.\n", optarg);
+                return 1;
+            }
+            break;
+
+        case LongOpts::cacheHardlink:
+            s_cacheHardlink = true;
+            break;
+
+        case LongOpts::cacheStats:
+            s_cacheStats = true;
+            break;
+
+        case LongOpts::cacheClear:
+            s_cacheClear = true;
+            break;
+
+        case LongOpts::serve:
+            s_serveSocket = optarg;
+            break;
+
+        case LongOpts::connect:
+            s_connectSocket = optarg;
+            break;
+
+        case LongOpts::watch:
+            s_watchDir = optarg;
+            break;
+
+        case LongOpts::index:
+            s_indexFileName = optarg;
+            break;
+
+        case LongOpts::alwaysExpand:
+            s_alwaysExpand = true;
+            break;
+
+        case LongOpts::sharedMinBytes:
+            if (!ParseSize(optarg, s_sharedMinBytes)) {
+                printf("Invalid size '%s'.\n", optarg);
+                return 1;
+            }
+            break;
+
+        case LongOpts::maxInlineBytes:
+            if (!ParseSize(optarg, s_maxInlineBytes)) {
+                printf("Invalid size '%s'.\n", optarg);
+                return 1;
+            }
+            break;
+
+        case LongOpts::profileGenerate:
+            s_profileGenerate = true;
+            break;
+
+        case LongOpts::profileUse:
+            s_profileFileName = std::filesystem::absolute(optarg).string();
+            break;
+
+        case LongOpts::instrument:
+            s_instrument = true;
+            break;
+
+        case LongOpts::warnCopies:
+            s_warnCopies = true;
+            break;
+
+        case LongOpts::makeIndex:
+            s_makeIndexFileName = optarg;
+            break;
+
+        default:
+            puts("for more detail see help\n");
+            break;
+        }
+    }
+    if (!s_cacheDir)
+        s_cacheDir = getenv("FLATCO_CACHE_DIR");
+    if (s_alwaysExpand)
+        s_genOptions += "--always-expand\n";
+    if (s_sharedMinBytes) {
+        char buf[48];
+        snprintf(buf, sizeof(buf), "--shared-min-bytes=%llu\n", (unsigned long long)s_sharedMinBytes);
+        s_genOptions += buf;
+    }
+    if (s_maxInlineBytes) {
+        char buf[48];
+        snprintf(buf, sizeof(buf), "--max-inline-bytes=%llu\n", (unsigned long long)s_maxInlineBytes);
+        s_genOptions += buf;
+    }
+    if (s_profileGenerate)
+        s_genOptions += "--profile-generate\n";
+    if (s_instrument)
+        s_genOptions += "--instrument\n";
+    if (s_warnCopies)
+        s_genOptions += "--warn-copies\n";
+    if (s_ccArgc > 0) {
+        if (s_batch || optind < argc) {
+            puts("Input files can't be given with '--cc', they are among the compiler's arguments.");
+            return 1;
+        }
+        return 0;
+    }
+    if (s_serveSocket) {
+        if (s_batch || optind < argc) {
+            puts("Input files can't be given with '--serve', they come from the clients.");
+            return 1;
+        }
+        return 0;
+    }
+    if (s_makeIndexFileName) {
+        if (s_batch || optind >= argc) {
+            puts("Option '--make-index' takes the BL_func libraries to compile.");
+            return 1;
+        }
+        for (; optind < argc; ++optind)
+            s_libraries.push_back(argv[optind]);
+        return 0;
+    }
+    if (s_watchDir) {
+        if (s_batch || optind < argc) {
+            puts("Input files can't be given with '--watch', they are the .cxx files under the directory.");
+            return 1;
+        }
+        return 0;
+    }
+    if (optind >= argc)
+        return (s_cacheStats || s_cacheClear) ? 0 : 1;
+    if (!s_batch) {
+        s_inFileName = argv[optind++];
+        return 0;
+    }
+    if (s_outFileName) {
+        puts("Option '-o' can't be used with '--batch'.");
+        return 1;
+    }
+    if (s_depTarget && !s_depFileName) {
+        puts("Option '-MT' needs '-MF' in batch mode.");
+        return 1;
+    }
+    if ((argc - optind) % 2 != 0) {
+        puts("Input and output file names should be in pairs in batch mode.");
+        return 1;
+    }
+    for (; optind < argc; optind += 2)
+        s_fileJobs.push_back(FileJob{ .inFileName = argv[optind], .outFileName = argv[optind + 1], .msg = {}, .deps = {}, .jobs = 1, .r = 1 });
+    return 0;
+}
+
+void AppendMsg(std::string& msg, const char* fmt, ...) {
+    char buf[1024];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    msg += buf;
+}
+
+// "At row:col: message" lines, errors in a BL_func library are "In '<library>' at row:col: message"
+void AppendDiagnostics(std::string& msg, const std::vector<flatco::Diagnostic>& diagnostics) {
+    for (auto& diag : diagnostics) {
+        if (diag.fileName.empty())
+            AppendMsg(msg, "At %zu:%zu: %s\n", diag.row, diag.col, diag.message.c_str());
+        else if (diag.row == 0)
+            AppendMsg(msg, "In '%s': %s\n", diag.fileName.c_str(), diag.message.c_str());
+        else
+            AppendMsg(msg, "In '%s' at %zu:%zu: %s\n", diag.fileName.c_str(), diag.row, diag.col, diag.message.c_str());
+    }
+}
+
+bool ReadFile(const char* fileName, std::string& data) {
+    FILE* f = fopen(fileName, "rb");
+    if (!f)
+        return false;
+    fseek(f, 0, SEEK_END);
+    long len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    bool ok = (len >= 0);
+    if (ok) {
+        data.resize((size_t)len);
+        ok = fread(data.data(), 1, data.size(), f) == data.size();
+    }
+    fclose(f);
+    return ok;
+}
+
+// A suffix for temporary files unique among the threads and processes writing in the same directory
+std::string TempSuffix() {
+    static std::atomic<unsigned> s_counter{ 0 };
+    uint64_t t = (uint64_t)std::chrono::steady_clock::now().time_since_epoch().count();
+    size_t h = std::hash<std::thread::id>{}(std::this_thread::get_id());
+    char buf[64];
+    snprintf(buf, sizeof(buf), ".tmp%zx%llx%x", h, (unsigned long long)t, s_counter.fetch_add(1));
+    return buf;
+}
+
+// Write data to a temporary file and atomically rename it to fileName
+bool ReplaceFile(const std::filesystem::path& fileName, const std::string& data) {
+    std::filesystem::path tmp = fileName;
+    tmp += TempSuffix();
+    FILE* f = fopen(tmp.string().c_str(), "wb");
+    if (!f)
+        return false;
+    bool ok = fwrite(data.data(), 1, data.size(), f) == data.size();
+    ok = (fclose(f) == 0) && ok;
+    std::error_code ec;
+    if (ok) {
+        std::filesystem::rename(tmp, fileName, ec);
+        ok = !ec;
+    }
+    if (!ok)
+        std::filesystem::remove(tmp, ec);
+    return ok;
+}
+
+// Replace fileName by data unless it has already the same content, so that its mtime isn't touched
+bool UpdateFile(const char* fileName, const std::string& data) {
+    std::error_code ec;
+    if (std::filesystem::file_size(fileName, ec) == data.size() && !ec) {
+        std::string old;
+        if (ReadFile(fileName, old) && old == data)
+            return true;
+    }
+    return ReplaceFile(fileName, data);
+}
+
+// An exclusive lock between processes on the file path, created if needed, held till it's destroyed. Nothing is
+// locked if the file can't be opened.
+class FileLock {
+#ifdef _WIN32
+    HANDLE h_;
+
+public:
+    explicit FileLock(const std::filesystem::path& path) {
+        h_ = CreateFileW(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                         NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+        OVERLAPPED ov{};
+        if (h_ != INVALID_HANDLE_VALUE && !LockFileEx(h_, LOCKFILE_EXCLUSIVE_LOCK, 0, 1, 0, &ov)) {
+            CloseHandle(h_);
+            h_ = INVALID_HANDLE_VALUE;
+        }
+    }
+    ~FileLock() {
+        if (h_ != INVALID_HANDLE_VALUE)
+            CloseHandle(h_);
+    }
+#else
+    int fd_;
+
+public:
+    explicit FileLock(const std::filesystem::path& path) : fd_(open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644)) {
+        while (fd_ >= 0 && flock(fd_, LOCK_EX) != 0) {
+            if (errno != EINTR) {
+                close(fd_);
+                fd_ = -1;
+            }
+        }
+    }
+    ~FileLock() {
+        if (fd_ >= 0)
+            close(fd_);
+    }
+#endif
+    FileLock(const FileLock&) = delete;
+    FileLock& operator=(const FileLock&) = delete;
+};
+
+// Content addressed store of generated outputs. An entry is keyed by a hash of the input bytes, the input
+// file name (it appears in #line), the flatco version and output format, and the options changing the output.
+// Entries are plain files <dir>/<2 hex digits>/<30 hex digits>, the least recently used ones are evicted when the
+// cache grows over its maximum size. A hit touches the marker "<entry>.used" instead of the entry, which may be
+// linked to outputs whose mtimes must not change. Statistics are accumulated in memory and merged into
+// <dir>/stats under the lock <dir>/stats.lock when the process ends.
+class OutputCache {
+    struct Stats {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t stores = 0;
+        uint64_t evictions = 0;
+        uint64_t size = 0;
+        uint64_t hitNs = 0;
+        uint64_t missNs = 0;
+    };
+
+    std::filesystem::path dir_;
+    uint64_t maxSize_;
+    bool hardlink_;
+    std::mutex mutex_;
+    Stats delta_;
+
+    std::filesystem::path entryPath(const std::string& key) const {
+        return dir_ / key.substr(0, 2) / key.substr(2);
+    }
+
+    // The output of a source importing BL_func libraries is stored by a key which also hashes their contents.
+    // The entry of the source's own key is then a manifest "<key>.libs" listing the libraries.
+    static std::filesystem::path manifestPath(const std::filesystem::path& entry) {
+        std::filesystem::path manifest = entry;
+        manifest += ".libs";
+        return manifest;
+    }
+
+    static std::filesystem::path usedPath(const std::filesystem::path& entry) {
+        std::filesystem::path used = entry;
+        used += ".used";
+        return used;
+    }
+
+    static bool libraryKey(std::string& key, const std::vector<std::string>& libraries) {
+        uint64_t h1 = k_hashSeed1, h2 = k_hashSeed2;
+        HashBytes(key.data(), key.size(), h1, h2);
+        std::string data;
+        for (auto& lib : libraries) {
+            if (!ReadFile(lib.c_str(), data))
+                return false;
+            HashBytes(lib.data(), lib.size(), h1, h2);
+            HashBytes(data.data(), data.size(), h1, h2);
+        }
+        char buf[33];
+        snprintf(buf, sizeof(buf), "%016llx%016llx", (unsigned long long)HashFinal(h1), (unsigned long long)HashFinal(h2));
+        key = buf;
+        return true;
+    }
+
+    bool loadStats(Stats& stats) const {
+        FILE* f = fopen((dir_ / "stats").string().c_str(), "r");
+        if (!f)
+            return false;
+        char name[32];
+        unsigned long long v;
+        while (fscanf(f, "%31s %llu", name, &v) == 2) {
+            if (!strcmp(name, "hits")) stats.hits = v;
+            else if (!strcmp(name, "misses")) stats.misses = v;
+            else if (!strcmp(name, "stores")) stats.stores = v;
+            else if (!strcmp(name, "evictions")) stats.evictions = v;
+            else if (!strcmp(name, "size")) stats.size = v;
+            else if (!strcmp(name, "hit_ns")) stats.hitNs = v;
+            else if (!strcmp(name, "miss_ns")) stats.missNs = v;
+        }
+        fclose(f);
+        return true;
+    }
+
+    void saveStats(const Stats& stats) const {
+        std::error_code ec;
+        std::filesystem::create_directories(dir_, ec);
+        std::filesystem::path tmp = dir_ / ("stats" + TempSuffix());
+        FILE* f = fopen(tmp.string().c_str(), "w");
+        if (!f)
+            return;
+        fprintf(f, "hits %llu\nmisses %llu\nstores %llu\nevictions %llu\nsize %llu\nhit_ns %llu\nmiss_ns %llu\n",
+            (unsigned long long)stats.hits, (unsigned long long)stats.misses, (unsigned long long)stats.stores,
+            (unsigned long long)stats.evictions, (unsigned long long)stats.size, (unsigned long long)stats.hitNs,
+            (unsigned long long)stats.missNs);
+        fclose(f);
+        std::filesystem::rename(tmp, dir_ / "stats", ec);
+    }
+
+    // Remove the least recently used entries till the cache is under 90% of its maximum size
+    void evict(Stats& stats) const {
+        struct Entry {
+            std::filesystem::file_time_type time;
+            uint64_t size;
+            std::filesystem::path path;
+        };
+        std::vector<Entry> entries;
+        std::map<std::filesystem::path, std::filesystem::file_time_type> used;
+        uint64_t total = 0;
+        std::error_code ec;
+        for (auto it = std::filesystem::recursive_directory_iterator(dir_, ec); !ec && it != std::filesystem::recursive_directory_iterator(); it.increment(ec)) {
+            if (!it->is_regular_file(ec) || it.depth() != 1)
+                continue;
+            if (it->path().extension() == ".used") {
+                used[it->path()] = it->last_write_time(ec);
+                continue;
+            }
+            uint64_t size = it->file_size(ec);
+            entries.push_back(Entry{ it->last_write_time(ec), size, it->path() });
+            total += size;
+        }
+        // An entry was last used when it was stored or hit
+        for (auto& e : entries) {
+            auto u = used.find(usedPath(e.path));
+            if (u != used.end())
+                e.time = std::max(e.time, u->second);
+        }
+        std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) { return a.time < b.time; });
+        uint64_t limit = maxSize_ / 10 * 9;
+        for (auto& e : entries) {
+            if (total <= limit)
+                break;
+            if (std::filesystem::remove(e.path, ec)) {
+                total -= e.size;
+                ++stats.evictions;
+                std::filesystem::remove(usedPath(e.path), ec);
+            }
+        }
+        stats.size = total;
+    }
+
+public:
+    OutputCache(const char* dir, uint64_t maxSize, bool hardlink) : dir_(dir), maxSize_(maxSize), hardlink_(hardlink) {}
+
+    std::string key(const char* src, size_t len, const char* inFileName) const {
+        uint64_t h1 = k_hashSeed1, h2 = k_hashSeed2;
+        const char* version = flatco::version();
+        HashBytes(version, strlen(version), h1, h2);
+        uint64_t format = flatco::outputFormat();
+        HashBytes((const char*)&format, sizeof(format), h1, h2);
+        HashBytes(s_genOptions.data(), s_genOptions.size(), h1, h2);
+        HashBytes(inFileName, strlen(inFileName), h1, h2);
+        HashBytes(src, len, h1, h2);
+        char buf[33];
+        snprintf(buf, sizeof(buf), "%016llx%016llx", (unsigned long long)HashFinal(h1), (unsigned long long)HashFinal(h2));
+        return buf;
+    }
+
+    // Produce outFileName from the cache, return false if there is no such entry. The libraries imported are
+    // added to deps.
+    bool fetch(const std::string& key, const char* outFileName, uint64_t ns, std::vector<std::string>& deps) {
+        std::filesystem::path entry = entryPath(key);
+        std::string data;
+        if (ReadFile(manifestPath(entry).string().c_str(), data)) {
+            std::vector<std::string> libraries;
+            for (size_t pos = 0, end; (end = data.find('\n', pos)) != std::string::npos; pos = end + 1)
+                libraries.push_back(data.substr(pos, end - pos));
+            std::string libKey = key;
+            if (!libraryKey(libKey, libraries))
+                return false;
+            entry = entryPath(libKey);
+            if (!ReadFile(entry.string().c_str(), data))
+                return false;
+            deps.insert(deps.end(), libraries.begin(), libraries.end());
+        }
+        else if (!ReadFile(entry.string().c_str(), data))
+            return false;
+        std::string old;
+        if (!ReadFile(outFileName, old) || old != data) {
+            std::error_code ec;
+            bool ok = false;
+            if (hardlink_) {
+                std::filesystem::path tmp = outFileName;
+                tmp += TempSuffix();
+                std::filesystem::create_hard_link(entry, tmp, ec);
+                if (!ec) {
+                    std::filesystem::rename(tmp, outFileName, ec);
+                    ok = !ec;
+                    if (!ok)
+                        std::filesystem::remove(tmp, ec);
+                }
+            }
+            if (!ok && !ReplaceFile(outFileName, data))
+                return false;
+        }
+        if (FILE* f = fopen(usedPath(entry).string().c_str(), "wb"))
+            fclose(f);
+        std::lock_guard<std::mutex> lock(mutex_);
+        ++delta_.hits;
+        delta_.hitNs += ns;
+        return true;
+    }
+
+    void store(const std::string& key, const std::string& data, uint64_t ns, const std::vector<std::string>& libraries) {
+        std::filesystem::path entry = entryPath(key);
+        std::error_code ec;
+        std::filesystem::create_directories(entry.parent_path(), ec);
+        bool stored = true;
+        if (!libraries.empty()) {
+            std::string manifest;
+            for (auto& lib : libraries)
+                manifest += lib + '\n';
+            std::string libKey = key;
+            stored = ReplaceFile(manifestPath(entry), manifest) && libraryKey(libKey, libraries);
+            entry = entryPath(libKey);
+            std::filesystem::create_directories(entry.parent_path(), ec);
+        }
+        stored = stored && ReplaceFile(entry, data);
+        std::lock_guard<std::mutex> lock(mutex_);
+        ++delta_.misses;
+        delta_.missNs += ns;
+        if (stored) {
+            ++delta_.stores;
+            delta_.size += data.size();
+        }
+    }
+
+    void miss(uint64_t ns) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        ++delta_.misses;
+        delta_.missNs += ns;
+    }
+
+    // Merge the statistics of this process into the cache and evict entries if it's too big
+    void flush() {
+        if (delta_.hits == 0 && delta_.misses == 0)
+            return;
+        std::error_code ec;
+        std::filesystem::create_directories(dir_, ec);
+        FileLock lock(dir_ / "stats.lock");
+        Stats stats;
+        loadStats(stats);
+        stats.hits += delta_.hits;
+        stats.misses += delta_.misses;
+        stats.stores += delta_.stores;
+        stats.hitNs += delta_.hitNs;
+        stats.missNs += delta_.missNs;
+        stats.size += delta_.size;
+        if (stats.size > maxSize_)
+            evict(stats);
+        saveStats(stats);
+        delta_ = Stats{};
+    }
+
+    void clear() {
+        std::error_code ec;
+        for (auto& it : std::filesystem::directory_iterator(dir_, ec)) {
+            if (it.is_directory(ec) && it.path().filename().string().size() == 2)
+                std::filesystem::remove_all(it.path(), ec);
+        }
+        std::filesystem::remove(dir_ / "stats", ec);
+    }
+
+    void printStats() const {
+        Stats stats;
+        loadStats(stats);
+        uint64_t total = stats.hits + stats.misses;
+        printf("cache directory       %s\n", dir_.string().c_str());
+        printf("hits                  %llu\n", (unsigned long long)stats.hits);
+        printf("misses                %llu\n", (unsigned long long)stats.misses);
+        printf("hit rate              %.1f %%\n", total ? 100.0 * stats.hits / total : 0.0);
+        printf("files stored          %llu\n", (unsigned long long)stats.stores);
+        printf("files evicted         %llu\n", (unsigned long long)stats.evictions);
+        printf("cache size            %.1f MB (max %.1f MB)\n", stats.size / 1048576.0, maxSize_ / 1048576.0);
+        if (stats.misses > 0) {
+            double missMs = stats.missNs / 1e6 / stats.misses;
+            double hitMs = stats.hits ? stats.hitNs / 1e6 / stats.hits : 0.0;
+            printf("average miss time     %.3f ms\n", missMs);
+            printf("average hit time      %.3f ms\n", hitMs);
+            printf("time saved            %.3f s\n", stats.hits * (missMs - hitMs) / 1000.0);
+        }
+    }
+};
+
+static OutputCache* s_cache = nullptr;
+
+// Write all of p[0..n) to fd, false if the reader went away
+bool WriteAll(int fd, const char* p, size_t n) {
+#ifdef _WIN32
+    return false;
+#else
+    while (n > 0) {
+        ssize_t r = write(fd, p, n);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        p += r;
+        n -= (size_t)r;
+    }
+    return true;
+#endif
+}
+
+bool WriteAll(int fd, const std::string& data) {
+    return WriteAll(fd, data.data(), data.size());
+}
+
+// Read exactly n bytes from fd, false on errors or end of file
+bool ReadAll(int fd, void* data, size_t n) {
+#ifdef _WIN32
+    return false;
+#else
+    char* p = (char*)data;
+    while (n > 0) {
+        ssize_t r = read(fd, p, n);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return false;
+        p += r;
+        n -= (size_t)r;
+    }
+    return true;
+#endif
+}
+
+// The protocol of --serve, a client sends any number of requests on a connection and reads the response to each
+// one. Integers are in native byte order as both ends are on the same machine.
+//   request:  u32 length of the file name, file name, u32 options: 1 always expand, 2 profile generate,
+//             4 instrument, 8 warn copies, u64 shared min bytes, u64 max inline bytes, u32 length of the profile
+//             path, profile path, u64 length of the source, source
+//   response: u32 1 if ok else 0, u64 length, the output if ok else the diagnostics as "At row:col: message\n",
+//             u32 number of libraries imported, u32 length and path of each one, u32 number of notes if ok,
+//             u64 row, u64 col, u32 length and message of each one
+const uint32_t k_serveMaxName = 64 * 1024;
+
+// Transform by the server on socketName, false if it can't be reached. The diagnostics are formatted in
+// result.output if not ok, else they are the notes.
+bool TransformRemote(const char* socketName, const char* src, size_t len, const char* fileName, flatco::Result& result) {
+#ifdef _WIN32
+    return false;
+#else
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (strlen(socketName) >= sizeof(addr.sun_path))
+        return false;
+    strcpy(addr.sun_path, socketName);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return false;
+    if (connect(fd, (sockaddr*)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return false;
+    }
+    uint32_t nameLen = (uint32_t)strlen(fileName);
+    uint32_t flags = (s_alwaysExpand ? 1 : 0) | (s_profileGenerate ? 2 : 0) | (s_instrument ? 4 : 0) | (s_warnCopies ? 8 : 0);
+    uint32_t profileLen = (uint32_t)s_profileFileName.size();
+    uint64_t srcLen = len;
+    std::string request;
+    request.append((const char*)&nameLen, sizeof(nameLen));
+    request.append(fileName, nameLen);
+    request.append((const char*)&flags, sizeof(flags));
+    request.append((const char*)&s_sharedMinBytes, sizeof(s_sharedMinBytes));
+    request.append((const char*)&s_maxInlineBytes, sizeof(s_maxInlineBytes));
+    request.append((const char*)&profileLen, sizeof(profileLen));
+    request += s_profileFileName;
+    request.append((const char*)&srcLen, sizeof(srcLen));
+    bool sent = WriteAll(fd, request) && WriteAll(fd, src, len);
+    uint32_t okFlag = 0;
+    uint64_t outLen;
+    uint32_t nLibs = 0;
+    bool received = sent && ReadAll(fd, &okFlag, sizeof(okFlag)) && ReadAll(fd, &outLen, sizeof(outLen));
+    if (received) {
+        result.output.resize((size_t)outLen);
+        received = ReadAll(fd, result.output.data(), result.output.size()) && ReadAll(fd, &nLibs, sizeof(nLibs));
+    }
+    for (uint32_t i = 0; received && i < nLibs; ++i) {
+        uint32_t libLen;
+        received = ReadAll(fd, &libLen, sizeof(libLen)) && libLen <= k_serveMaxName;
+        if (received) {
+            std::string& lib = result.libraries.emplace_back(libLen, '\0');
+            received = ReadAll(fd, lib.data(), libLen);
+        }
+    }
+    uint32_t nNotes = 0;
+    if (received && okFlag)
+        received = ReadAll(fd, &nNotes, sizeof(nNotes));
+    for (uint32_t i = 0; received && i < nNotes; ++i) {
+        uint64_t row, col;
+        uint32_t msgLen;
+        received = ReadAll(fd, &row, sizeof(row)) && ReadAll(fd, &col, sizeof(col)) &&
+                   ReadAll(fd, &msgLen, sizeof(msgLen)) && msgLen <= k_serveMaxName;
+        if (received) {
+            flatco::Diagnostic& note = result.diagnostics.emplace_back();
+            note.row = (size_t)row;
+            note.col = (size_t)col;
+            note.message.resize(msgLen);
+            received = ReadAll(fd, note.message.data(), msgLen);
+        }
+    }
+    close(fd);
+    result.ok = (okFlag != 0);
+    if (!received)
+        result = flatco::Result();
+    return received;
+#endif
+}
+
+uint64_t NsSince(std::chrono::steady_clock::time_point start) {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+int ProcessFile(FileJob& job) {
+    const char* inFileName = job.inFileName;
+    const char* outFileName = job.outFileName;
+    std::string& msg = job.msg;
+    if (!outFileName) {
+        AppendMsg(msg, "No output file for '%s', use -o.\n", inFileName);
+        return 1;
+    }
+    auto start = std::chrono::steady_clock::now();
+    MappedFile in;
+    if (!in.open(inFileName)) {
+        AppendMsg(msg, "Can't open file '%s'.\n", inFileName);
+        return 1;
+    }
+    job.deps.push_back(inFileName);
+    const char* src = in.data();
+    size_t len = in.size();
+    std::string cacheKey;
+    if (s_cache) {
+        cacheKey = s_cache->key(src, len, inFileName);
+        if (s_cache->fetch(cacheKey, outFileName, NsSince(start), job.deps))
+            return 0;
+    }
+    int r = 1;
+    flatco::Result result;
+    bool remote = s_connectSocket && TransformRemote(s_connectSocket, src, len, inFileName, result);
+    if (!remote) {
+        flatco::Options options;
+        options.jobs = job.jobs;
+        options.cache = s_memCache;
+        options.index = s_index;
+        options.alwaysExpand = s_alwaysExpand;
+        options.sharedMinBytes = (size_t)s_sharedMinBytes;
+        options.maxInlineBytes = (size_t)s_maxInlineBytes;
+        options.profileGenerate = s_profileGenerate;
+        options.instrument = s_instrument;
+        options.warnCopies = s_warnCopies;
+        options.profile = s_profile;
+        result = flatco::transform(std::string_view(src, len), inFileName, options);
+    }
+    job.deps.insert(job.deps.end(), result.libraries.begin(), result.libraries.end());
+    // The diagnostics of a result which is ok are notes, a remote one formats its errors in the output
+    if (!remote || result.ok)
+        AppendDiagnostics(msg, result.diagnostics);
+    if (!result.ok) {
+        if (remote)
+            msg += result.output;
+    }
+    else if (UpdateFile(outFileName, result.output)) {
+        r = 0;
+        if (s_cache)
+            s_cache->store(cacheKey, result.output, NsSince(start), result.libraries);
+    }
+    else
+        AppendMsg(msg, "Can't write output file '%s'.\n", outFileName);
+    if (r != 0 && s_cache)
+        s_cache->miss(NsSince(start));
+    return r;
+}
+
+// Append a file name to a depfile, escaped the way make and ninja read it
+void AppendDepName(std::string& out, const std::string& name) {
+    for (size_t i = 0; i < name.size(); ++i) {
+        char c = name[i];
+        if (c == ' ' || c == '#') {
+            for (size_t j = i; j > 0 && name[j - 1] == '\\'; --j)
+                out += '\\';
+            out += '\\';
+        }
+        else if (c == '$')
+            out += '$';
+        out += c;
+    }
+}
+
+// Write one rule "<outputs>: <deps>" for the jobs. The targets are the output file names unless target is given.
+// A depfile named <output>.d is written for every output with -MD, one for all outputs with -MF.
+int WriteDepFile(const char* depFileName, const char* target, const FileJob* jobs, size_t n, std::string& msg) {
+    std::string depFile = depFileName ? depFileName : std::string(jobs[0].outFileName) + ".d";
+    std::string out;
+    if (target)
+        AppendDepName(out, target);
+    else {
+        for (size_t i = 0; i < n; ++i) {
+            if (i > 0)
+                out += ' ';
+            AppendDepName(out, jobs[i].outFileName);
+        }
+    }
+    out += ':';
+    std::set<std::string> seen;
+    for (size_t i = 0; i < n; ++i) {
+        for (auto& dep : jobs[i].deps) {
+            if (!seen.insert(dep).second)
+                continue;
+            out += " \\\n  ";
+            AppendDepName(out, dep);
+        }
+    }
+    out += '\n';
+    if (UpdateFile(depFile.c_str(), out))
+        return 0;
+    AppendMsg(msg, "Can't write depfile '%s'.\n", depFile.c_str());
+    return 1;
+}
+
+// Threads to use, -j or the number of cores
+unsigned JobCount() {
+    return s_jobs ? s_jobs : std::max(1u, std::thread::hardware_concurrency());
+}
+
+int ProcessBatch() {
+    unsigned jobs = JobCount();
+    // Threads left over by the files go to parsing them
+    unsigned parseJobs = std::max(1u, jobs / (unsigned)std::max<size_t>(1, s_fileJobs.size()));
+    for (auto& job : s_fileJobs)
+        job.jobs = parseJobs;
+    ParallelFor(s_fileJobs.size(), jobs, [](size_t i) {
+        FileJob& job = s_fileJobs[i];
+        job.r = ProcessFile(job);
+        if (job.r == 0 && s_depMD && !s_depFileName)
+            job.r = WriteDepFile(nullptr, nullptr, &job, 1, job.msg);
+    });
+
+    // Report in the order of the command line so that the output doesn't depend on scheduling
+    int r = 0;
+    for (auto& job : s_fileJobs) {
+        if (!job.msg.empty())
+            printf("%s: %s", job.inFileName, job.msg.c_str());
+        if (job.r != 0)
+            r = 1;
+    }
+    if (r == 0 && s_depFileName) {
+        std::string msg;
+        r = WriteDepFile(s_depFileName, s_depTarget, s_fileJobs.data(), s_fileJobs.size(), msg);
+        fputs(msg.c_str(), stdout);
+    }
+    return r;
+}
+
+// Serve one connection of --serve until the client closes it
+void ServeConnection(int fd, flatco::Cache& cache) {
+#ifndef _WIN32
+    std::string fileName;
+    std::string profileName;
+    std::string profileText;
+    std::string src;
+    std::string response;
+    std::vector<flatco::Diagnostic> diagnostics;
+    std::vector<std::string> libraries;
+    for (;;) {
+        uint32_t nameLen, flags, profileLen;
+        uint64_t sharedMinBytes, maxInlineBytes, srcLen;
+        if (!ReadAll(fd, &nameLen, sizeof(nameLen)) || nameLen > k_serveMaxName)
+            break;
+        fileName.resize(nameLen);
+        if (!ReadAll(fd, fileName.data(), nameLen) || !ReadAll(fd, &flags, sizeof(flags)) ||
+            !ReadAll(fd, &sharedMinBytes, sizeof(sharedMinBytes)) ||
+            !ReadAll(fd, &maxInlineBytes, sizeof(maxInlineBytes)) || !ReadAll(fd, &profileLen, sizeof(profileLen)) ||
+            profileLen > k_serveMaxName)
+            break;
+        profileName.resize(profileLen);
+        if (!ReadAll(fd, profileName.data(), profileLen) || !ReadAll(fd, &srcLen, sizeof(srcLen)) ||
+            srcLen > SIZE_MAX / 2)
+            break;
+        src.resize((size_t)srcLen);
+        if (!ReadAll(fd, src.data(), src.size()))
+            break;
+
+        // The profile is read again by every request, it's rewritten by the programs profiled
+        flatco::Profile profile;
+        bool profileOk = profileName.empty() ||
+                         (ReadFile(profileName.c_str(), profileText) && profile.parse(profileText));
+
+        flatco::Options options;
+        options.jobs = JobCount();
+        options.cache = &cache;
+        options.index = s_index;
+        options.alwaysExpand = (flags & 1) != 0;
+        options.sharedMinBytes = (size_t)sharedMinBytes;
+        options.maxInlineBytes = (size_t)maxInlineBytes;
+        options.profileGenerate = (flags & 2) != 0;
+        options.instrument = (flags & 4) != 0;
+        options.warnCopies = (flags & 8) != 0;
+        options.profile = profileName.empty() ? nullptr : &profile;
+        response.assign(sizeof(uint32_t) + sizeof(uint64_t), '\0');
+        diagnostics.clear();
+        libraries.clear();
+        uint32_t ok = 0;
+        if (!profileOk)
+            AppendMsg(response, "Can't read profile '%s'.\n", profileName.c_str());
+        else if (flatco::transform(src, fileName, options, response, diagnostics, &libraries))
+            ok = 1;
+        else
+            AppendDiagnostics(response, diagnostics);
+        uint64_t len = response.size() - sizeof(ok) - sizeof(len);
+        memcpy(response.data(), &ok, sizeof(ok));
+        memcpy(response.data() + sizeof(ok), &len, sizeof(len));
+        uint32_t nLibs = (uint32_t)libraries.size();
+        response.append((const char*)&nLibs, sizeof(nLibs));
+        for (auto& lib : libraries) {
+            uint32_t libLen = (uint32_t)lib.size();
+            response.append((const char*)&libLen, sizeof(libLen));
+            response += lib;
+        }
+        if (ok) {
+            uint32_t nNotes = (uint32_t)diagnostics.size();
+            response.append((const char*)&nNotes, sizeof(nNotes));
+            for (auto& note : diagnostics) {
+                uint64_t row = note.row, col = note.col;
+                uint32_t msgLen = (uint32_t)std::min<size_t>(note.message.size(), k_serveMaxName);
+                response.append((const char*)&row, sizeof(row));
+                response.append((const char*)&col, sizeof(col));
+                response.append((const char*)&msgLen, sizeof(msgLen));
+                response.append(note.message, 0, msgLen);
+            }
+        }
+        if (!WriteAll(fd, response))
+            break;
+    }
+    close(fd);
+#endif
+}
+
+// Resident server of --serve, one thread per connection sharing the in-memory cache. Runs until killed.
+int Serve(const char* socketName) {
+#ifdef _WIN32
+    puts("Option '--serve' isn't supported on Windows.");
+    return 1;
+#else
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (strlen(socketName) >= sizeof(addr.sun_path)) {
+        printf("Socket name '%s' is too long.\n", socketName);
+        return 1;
+    }
+    strcpy(addr.sun_path, socketName);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        printf("Can't create socket '%s'.\n", socketName);
+        return 1;
+    }
+    // A socket left by a server which is gone is replaced, one still answering is not
+    if (connect(fd, (sockaddr*)&addr, sizeof(addr)) == 0) {
+        printf("Socket '%s' is already served.\n", socketName);
+        close(fd);
+        return 1;
+    }
+    unlink(socketName);
+    if (bind(fd, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0) {
+        printf("Can't listen on socket '%s'.\n", socketName);
+        close(fd);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN); // a client going away fails the write instead
+    flatco::Cache cache((size_t)s_cacheMaxSize);
+    for (;;) {
+        int conn = accept(fd, nullptr, nullptr);
+        if (conn < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            printf("Can't accept on socket '%s'.\n", socketName);
+            close(fd);
+            return 1;
+        }
+        std::thread(ServeConnection, conn, std::ref(cache)).detach();
+    }
+#endif
+}
+
+// Inputs of --watch by their normalized path
+struct WatchedInput {
+    std::string outFileName;
+    std::vector<std::string> deps; // files read by the last flattening, canonical
+};
+
+class Watcher {
+    std::filesystem::path dir_;
+    std::filesystem::path outDir_;
+    int fd_ = -1;
+    std::map<int, std::filesystem::path> dirs_; // by watch descriptor
+    std::map<std::string, WatchedInput> inputs_;
+    std::set<std::string> pending_;             // inputs to flatten
+
+    static std::string normal(const std::filesystem::path& path) { return path.lexically_normal().string(); }
+
+    // Libraries are imported by canonical paths
+    static std::string canonical(const std::filesystem::path& path) {
+        std::error_code ec;
+        std::filesystem::path canonical = std::filesystem::weakly_canonical(path, ec);
+        return ec ? normal(path) : canonical.string();
+    }
+
+    static bool isInput(const std::filesystem::path& path) { return path.extension() == ".cxx"; }
+
+    void addInput(const std::filesystem::path& path) {
+        std::string name = normal(path);
+        auto& input = inputs_[name];
+        if (input.outFileName.empty()) {
+            std::filesystem::path out = outDir_ / path.lexically_relative(dir_);
+            out += ".cpp";
+            input.outFileName = out.string();
+        }
+        pending_.insert(name);
+    }
+
+    // Watch dir and the directories under it, queue the inputs in them
+    void addDir(const std::filesystem::path& dir) {
+#ifndef _WIN32
+        int wd = inotify_add_watch(fd_, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE);
+        if (wd < 0) {
+            printf("Can't watch directory '%s'.\n", dir.c_str());
+            return;
+        }
+        dirs_[wd] = dir;
+        std::error_code ec;
+        for (auto& entry : std::filesystem::directory_iterator(dir, ec)) {
+            if (entry.is_directory(ec))
+                addDir(entry.path());
+            else if (isInput(entry.path()) && entry.is_regular_file(ec))
+                addInput(entry.path());
+        }
+#endif
+    }
+
+    // Queue the inputs which read path
+    void changed(const std::filesystem::path& path) {
+        std::string name = canonical(path);
+        for (auto& [inName, input] : inputs_) {
+            if (std::find(input.deps.begin(), input.deps.end(), name) != input.deps.end())
+                pending_.insert(inName);
+        }
+    }
+
+    void flatten() {
+        std::vector<std::string> names(pending_.begin(), pending_.end());
+        pending_.clear();
+        std::vector<FileJob> jobs;
+        jobs.reserve(names.size());
+        for (auto& name : names) {
+            auto& input = inputs_[name];
+            std::error_code ec;
+            std::filesystem::create_directories(std::filesystem::path(input.outFileName).parent_path(), ec);
+            jobs.push_back(FileJob{ .inFileName = name.c_str(), .outFileName = input.outFileName.c_str(), .msg = {},
+                                    .deps = {}, .jobs = 1, .r = 1 });
+        }
+        ParallelFor(jobs.size(), JobCount(), [&](size_t i) { jobs[i].r = ProcessFile(jobs[i]); });
+        for (auto& job : jobs) {
+            if (!job.msg.empty())
+                printf("%s: %s", job.inFileName, job.msg.c_str());
+            // On errors the files read before are still watched, with the libraries which failed
+            auto& deps = inputs_[job.inFileName].deps;
+            if (job.r == 0)
+                deps.clear();
+            for (auto& dep : job.deps) {
+                std::string name = canonical(dep);
+                if (std::find(deps.begin(), deps.end(), name) == deps.end())
+                    deps.push_back(name);
+            }
+        }
+        fflush(stdout);
+    }
+
+public:
+    Watcher(const char* dir, const char* outDir) : dir_(dir), outDir_(outDir ? outDir : dir) {}
+
+    ~Watcher() {
+#ifndef _WIN32
+        if (fd_ >= 0)
+            close(fd_);
+#endif
+    }
+
+    int run() {
+#ifdef _WIN32
+        puts("Option '--watch' isn't supported on Windows.");
+        return 1;
+#else
+        std::error_code ec;
+        if (!std::filesystem::is_directory(dir_, ec)) {
+            printf("Can't open directory '%s'.\n", dir_.c_str());
+            return 1;
+        }
+        fd_ = inotify_init1(IN_CLOEXEC);
+        if (fd_ < 0) {
+            puts("Can't initialize inotify.");
+            return 1;
+        }
+        addDir(dir_);
+        alignas(inotify_event) char buf[64 * 1024];
+        for (;;) {
+            if (!pending_.empty())
+                flatten();
+            // Wait for events, then take the ones following within a moment so that a save by several writes
+            // or renames flattens once
+            int timeout = -1;
+            for (;;) {
+                pollfd pfd{ .fd = fd_, .events = POLLIN, .revents = 0 };
+                int n = poll(&pfd, 1, timeout);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n <= 0)
+                    break;
+                ssize_t len = read(fd_, buf, sizeof(buf));
+                if (len < 0 && errno == EINTR)
+                    continue;
+                if (len <= 0) {
+                    puts("Can't read inotify events.");
+                    return 1;
+                }
+                for (ssize_t i = 0; i < len;) {
+                    const inotify_event* ev = (const inotify_event*)(buf + i);
+                    i += sizeof(inotify_event) + ev->len;
+                    auto it = dirs_.find(ev->wd);
+                    if (ev->mask & IN_IGNORED) {
+                        if (it != dirs_.end())
+                            dirs_.erase(it);
+                        continue;
+                    }
+                    if (it == dirs_.end() || ev->len == 0)
+                        continue;
+                    std::filesystem::path path = it->second / ev->name;
+                    if (ev->mask & IN_ISDIR) {
+                        if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+                            addDir(path);
+                    }
+                    else if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                        pending_.erase(normal(path));
+                        inputs_.erase(normal(path));
+                    }
+                    else if (ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+                        if (isInput(path))
+                            addInput(path);
+                        changed(path);
+                    }
+                }
+                timeout = 20;
+            }
+        }
+#endif
+    }
+};
+
+// Compiler options whose value is the next argument, they are skipped when looking for the source
+static const char* const k_ccValueOptions[] = {
+    "-o", "-I", "-D", "-U", "-x", "-include", "-imacros", "-isystem", "-iquote", "-idirafter", "-iprefix",
+    "-iwithprefix", "-isysroot", "--sysroot", "-MF", "-MT", "-MQ", "-L", "-Xlinker", "-Xassembler",
+    "-Xpreprocessor", "-Xclang", "-arch", "-target", "-aux-info", "-dumpbase", "-dumpdir", "-T", "-u", "-z",
+};
+
+bool IsCcValueOption(const char* arg) {
+    for (const char* opt : k_ccValueOptions) {
+        if (!strcmp(arg, opt))
+            return true;
+    }
+    return false;
+}
+
+bool IsCxxSource(const std::string_view& arg) {
+    static const char* const exts[] = { ".cxx", ".cpp", ".cc", ".c++", ".cp", ".CPP", ".C" };
+    for (const char* ext : exts) {
+        size_t n = strlen(ext);
+        if (arg.size() > n && arg.substr(arg.size() - n) == ext)
+            return true;
+    }
+    return false;
+}
+
+// Add source and the libraries it imports to the first rule of the compiler's depfile, which only lists the
+// headers read from stdin
+bool AddDepToDepFile(const std::string& depFile, const char* source, const std::vector<std::string>& libraries) {
+    std::string data;
+    if (!ReadFile(depFile.c_str(), data))
+        return false;
+    size_t pos = data.find(": ");
+    if (pos == std::string::npos)
+        pos = data.find(":\n");
+    if (pos == std::string::npos)
+        return false;
+    std::string dep = " ";
+    AppendDepName(dep, source);
+    for (auto& lib : libraries) {
+        dep += ' ';
+        AppendDepName(dep, lib);
+    }
+    data.insert(pos + 1, dep);
+    return UpdateFile(depFile.c_str(), data);
+}
+
+// --cc: flatten the C++ source among the compiler's arguments in memory and compile it from stdin with
+// "-x c++ -". The directory of the source is the first -iquote directory, so that #include "..." finds
+// the same headers. When -c or -S have no -o, the output is named after the source instead of "-". The
+// compiler's exit code is returned.
+int RunCompiler(int argc, char* const argv[]) {
+#ifdef _WIN32
+    puts("Option '--cc' isn't supported on Windows.");
+    return 1;
+#else
+    const char* source = nullptr;
+    int sourceIndex = -1;
+    const char* output = nullptr;
+    const char* depFile = nullptr;
+    bool depMD = false;
+    char outputKind = 0; // 'c' or 'S'
+    for (int i = 1; i < argc; ++i) {
+        const char* arg = argv[i];
+        if (arg[0] != '-') {
+            if (IsCxxSource(arg)) {
+                if (source) {
+                    printf("Option '--cc' takes one C++ source, got '%s' and '%s'.\n", source, arg);
+                    return 1;
+                }
+                source = arg;
+                sourceIndex = i;
+            }
+        }
+        else if (IsCcValueOption(arg)) {
+            if (i + 1 < argc) {
+                if (!strcmp(arg, "-o"))
+                    output = argv[i + 1];
+                else if (!strcmp(arg, "-MF"))
+                    depFile = argv[i + 1];
+            }
+            ++i;
+        }
+        else if (!strcmp(arg, "-c") || !strcmp(arg, "-S"))
+            outputKind = arg[1];
+        else if (!strcmp(arg, "-MD") || !strcmp(arg, "-MMD"))
+            depMD = true;
+        else if (!strncmp(arg, "-MF", 3))
+            depFile = arg + 3;
+        else if (!strncmp(arg, "-o", 2))
+            output = arg + 2;
+    }
+    if (!source) {
+        puts("Option '--cc' found no C++ source among the compiler's arguments.");
+        return 1;
+    }
+
+    MappedFile in;
+    if (!in.open(source)) {
+        printf("Can't open file '%s'.\n", source);
+        return 1;
+    }
+    flatco::Options options;
+    options.jobs = JobCount();
+    options.index = s_index;
+    options.alwaysExpand = s_alwaysExpand;
+    options.sharedMinBytes = (size_t)s_sharedMinBytes;
+    options.maxInlineBytes = (size_t)s_maxInlineBytes;
+    options.profileGenerate = s_profileGenerate;
+    options.instrument = s_instrument;
+    options.warnCopies = s_warnCopies;
+    options.profile = s_profile;
+    flatco::Result result = flatco::transform(std::string_view(in.data(), in.size()), source, options);
+    if (!result.diagnostics.empty()) {
+        std::string msg;
+        AppendDiagnostics(msg, result.diagnostics);
+        printf("%s: %s", source, msg.c_str());
+        fflush(stdout);
+    }
+    if (!result.ok)
+        return 1;
+
+    std::filesystem::path sourcePath(source);
+    std::string sourceDir = sourcePath.parent_path().string();
+    std::string defaultOutput;
+    std::vector<std::string> args{ argv[0], "-iquote", sourceDir.empty() ? "." : sourceDir };
+    for (int i = 1; i < argc; ++i) {
+        if (i != sourceIndex) {
+            args.emplace_back(argv[i]);
+            continue;
+        }
+        // Later arguments, e.g. object files to link, keep their language
+        args.insert(args.end(), { "-x", "c++", "-", "-x", "none" });
+    }
+    if (!output && outputKind) {
+        defaultOutput = sourcePath.stem().string() + (outputKind == 'c' ? ".o" : ".s");
+        output = defaultOutput.c_str();
+        args.insert(args.end(), { "-o", defaultOutput });
+    }
+    std::vector<char*> argPtrs;
+    for (auto& arg : args)
+        argPtrs.push_back(arg.data());
+    argPtrs.push_back(nullptr);
+
+    int fds[2];
+    if (pipe(fds) != 0) {
+        puts("Can't create a pipe to the compiler.");
+        return 1;
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        puts("Can't start the compiler.");
+        return 1;
+    }
+    if (pid == 0) {
+        dup2(fds[0], 0);
+        close(fds[0]);
+        close(fds[1]);
+        execvp(argPtrs[0], argPtrs.data());
+        fprintf(stderr, "Can't run compiler '%s'.\n", argPtrs[0]);
+        _exit(127);
+    }
+    close(fds[0]);
+    signal(SIGPIPE, SIG_IGN); // a compiler failing early is reported by its exit code
+    WriteAll(fds[1], result.output);
+    close(fds[1]);
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            puts("Can't wait for the compiler.");
+            return 1;
+        }
+    }
+    int r = WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+    if (r == 0 && depMD && (depFile || output)) {
+        std::string depFileName;
+        if (depFile)
+            depFileName = depFile;
+        else
+            depFileName = std::filesystem::path(output).replace_extension(".d").string();
+        if (!AddDepToDepFile(depFileName, source, result.libraries)) {
+            printf("Can't add '%s' to depfile '%s'.\n", source, depFileName.c_str());
+            r = 1;
+        }
+    }
+    return r;
+#endif
+}
+
+int main(int argc,char* const* argv) {
+    // The compiler's arguments after --cc are passed on untouched
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--cc")) {
+            s_ccArgc = argc - i - 1;
+            s_ccArgv = argv + i + 1;
+            argc = i;
+            if (s_ccArgc == 0) {
+                puts("Option '--cc' needs a compiler.");
+                return 1;
+            }
+            break;
+        }
+    }
+    std::vector<std::string> args;
+    if (!ExpandResponseFiles(argc, argv, args))
+        return 1;
+    std::vector<char*> argPtrs;
+    for (auto& arg : args)
+        argPtrs.push_back(arg.data());
+    argPtrs.push_back(nullptr);
+    if (processing_cmd((int)args.size(), argPtrs.data()))
+        return 1;
+    if ((s_cacheStats || s_cacheClear) && !s_cacheDir) {
+        puts("No cache directory, use --cache-dir or set FLATCO_CACHE_DIR.");
+        return 1;
+    }
+    OutputCache cache(s_cacheDir ? s_cacheDir : "", s_cacheMaxSize, s_cacheHardlink);
+    if (s_cacheDir)
+        s_cache = &cache;
+    if (s_cacheClear)
+        cache.clear();
+    flatco::Index index;
+    if (s_indexFileName) {
+        if (!index.open(s_indexFileName)) {
+            printf("Can't open index '%s'.\n", s_indexFileName);
+            return 1;
+        }
+        s_index = &index;
+    }
+    flatco::Profile profile;
+    if (!s_profileFileName.empty()) {
+        std::string text;
+        if (!ReadFile(s_profileFileName.c_str(), text) || !profile.parse(text)) {
+            printf("Can't read profile '%s'.\n", s_profileFileName.c_str());
+            return 1;
+        }
+        s_profile = &profile;
+        // The cached outputs depend on the counts
+        uint64_t h1 = k_hashSeed1, h2 = k_hashSeed2;
+        HashBytes(text.data(), text.size(), h1, h2);
+        char buf[64];
+        snprintf(buf, sizeof(buf), "--profile-use=%016llx%016llx\n", (unsigned long long)HashFinal(h1),
+                 (unsigned long long)HashFinal(h2));
+        s_genOptions += buf;
+    }
+    int r = 0;
+    if (s_makeIndexFileName) {
+        std::vector<flatco::Diagnostic> diagnostics;
+        if (!flatco::writeIndex(s_libraries, s_makeIndexFileName, diagnostics)) {
+            std::string msg;
+            AppendDiagnostics(msg, diagnostics);
+            fputs(msg.c_str(), stdout);
+            r = 1;
+        }
+    }
+    else if (s_ccArgc > 0)
+        r = RunCompiler(s_ccArgc, s_ccArgv);
+    else if (s_serveSocket)
+        r = Serve(s_serveSocket);
+    else if (s_watchDir) {
+        flatco::Cache memCache((size_t)s_cacheMaxSize);
+        s_memCache = &memCache;
+        r = Watcher(s_watchDir, s_outFileName).run();
+    }
+    else if (s_batch)
+        r = ProcessBatch();
+    else if (s_inFileName) {
+        FileJob job{ .inFileName = s_inFileName, .outFileName = s_outFileName, .msg = {}, .deps = {}, .jobs = JobCount(), .r = 1 };
+        r = ProcessFile(job);
+        if (r == 0 && (s_depMD || s_depFileName))
+            r = WriteDepFile(s_depFileName, s_depTarget, &job, 1, job.msg);
+        fputs(job.msg.c_str(), stdout);
+    }
+    cache.flush();
+    if (s_cacheStats)
+        cache.printStats();
+	return r;
+}
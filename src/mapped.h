@@ -0,0 +1,89 @@
+#pragma once
+
+#ifndef _flatco_mapped_h_
+#define _flatco_mapped_h_
+
+#include <stddef.h>
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+// Read-only memory mapping of a whole file
+class MappedFile {
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+#ifdef _WIN32
+    HANDLE mapping_ = NULL;
+#endif
+
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile() {
+        if (size_ == 0)
+            return;
+#ifdef _WIN32
+        UnmapViewOfFile(data_);
+        CloseHandle(mapping_);
+#else
+        munmap((void*)data_, size_);
+#endif
+    }
+
+    bool open(const char* fileName) {
+        static const char s_empty[1] = "";
+#ifdef _WIN32
+        HANDLE file = CreateFileA(fileName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file == INVALID_HANDLE_VALUE)
+            return false;
+        LARGE_INTEGER size;
+        bool ok = GetFileSizeEx(file, &size);
+        if (ok && size.QuadPart > 0) {
+            mapping_ = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+            data_ = mapping_ ? (const char*)MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0) : nullptr;
+            if (data_)
+                size_ = (size_t)size.QuadPart;
+            else if (mapping_)
+                CloseHandle(mapping_);
+            ok = (data_ != nullptr);
+        }
+        else
+            data_ = s_empty;
+        CloseHandle(file);
+        return ok;
+#else
+        int fd = ::open(fileName, O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        bool ok = (fstat(fd, &st) == 0);
+        if (ok && st.st_size > 0) {
+            void* p = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            ok = (p != MAP_FAILED);
+            if (ok) {
+                data_ = (const char*)p;
+                size_ = (size_t)st.st_size;
+            }
+        }
+        else
+            data_ = s_empty;
+        close(fd);
+        return ok;
+#endif
+    }
+
+    const char* data() const { return data_; }
+    size_t size() const { return size_; }
+};
+
+#endif /* !_flatco_mapped_h_ */
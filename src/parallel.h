@@ -0,0 +1,35 @@
+#pragma once
+
+#ifndef _flatco_parallel_h_
+#define _flatco_parallel_h_
+
+#include <stddef.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+// Call f(0), f(1) ... f(n-1) on up to 'jobs' threads, the calling thread is one of them.
+template <typename F>
+void ParallelFor(size_t n, unsigned jobs, F&& f) {
+    if (jobs > n)
+        jobs = (unsigned)n;
+    if (jobs <= 1) {
+        for (size_t i = 0; i < n; ++i)
+            f(i);
+        return;
+    }
+    std::atomic<size_t> next{ 0 };
+    auto worker = [&]() {
+        size_t i;
+        while ((i = next.fetch_add(1, std::memory_order_relaxed)) < n)
+            f(i);
+    };
+    std::vector<std::thread> threads;
+    for (unsigned i = 1; i < jobs; ++i)
+        threads.emplace_back(worker);
+    worker();
+    for (auto& t : threads)
+        t.join();
+}
+
+#endif /* !_flatco_parallel_h_ */
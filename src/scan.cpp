@@ -0,0 +1,149 @@
+#include <stdlib.h>
+#include <string.h>
+#include "scan.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define FLATCO_SCAN_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define FLATCO_TARGET_AVX2
+#else
+#define FLATCO_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+const char* ScanAnyScalar(const char* p, const char* pe, const ScanSet& set) {
+    const char c0 = set.c[0], c1 = set.c[1], c2 = set.c[2], c3 = set.c[3], c4 = set.c[4];
+    for (; p < pe; ++p) {
+        char c = *p;
+        if (c == c0 || c == c1 || c == c2 || c == c3 || c == c4)
+            return p;
+    }
+    return pe;
+}
+
+#ifdef FLATCO_SCAN_X86
+
+static inline unsigned CountTrailingZeros(unsigned v) {
+#ifdef _MSC_VER
+    unsigned long i;
+    _BitScanForward(&i, v);
+    return i;
+#else
+    return (unsigned)__builtin_ctz(v);
+#endif
+}
+
+const char* ScanAnySSE2(const char* p, const char* pe, const ScanSet& set) {
+    const __m128i v0 = _mm_set1_epi8(set.c[0]), v1 = _mm_set1_epi8(set.c[1]), v2 = _mm_set1_epi8(set.c[2]);
+    const __m128i v3 = _mm_set1_epi8(set.c[3]), v4 = _mm_set1_epi8(set.c[4]);
+    for (; pe - p >= 16; p += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i*)p);
+        __m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(x, v0), _mm_cmpeq_epi8(x, v1)),
+            _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(x, v2), _mm_cmpeq_epi8(x, v3)), _mm_cmpeq_epi8(x, v4)));
+        unsigned mask = (unsigned)_mm_movemask_epi8(m);
+        if (mask)
+            return p + CountTrailingZeros(mask);
+    }
+    return ScanAnyScalar(p, pe, set);
+}
+
+FLATCO_TARGET_AVX2
+const char* ScanAnyAVX2(const char* p, const char* pe, const ScanSet& set) {
+    const __m256i v0 = _mm256_set1_epi8(set.c[0]), v1 = _mm256_set1_epi8(set.c[1]), v2 = _mm256_set1_epi8(set.c[2]);
+    const __m256i v3 = _mm256_set1_epi8(set.c[3]), v4 = _mm256_set1_epi8(set.c[4]);
+    for (; pe - p >= 32; p += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)p);
+        __m256i m = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(x, v0), _mm256_cmpeq_epi8(x, v1)),
+            _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(x, v2), _mm256_cmpeq_epi8(x, v3)), _mm256_cmpeq_epi8(x, v4)));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(m);
+        if (mask)
+            return p + CountTrailingZeros(mask);
+    }
+    return ScanAnySSE2(p, pe, set);
+}
+
+static bool CpuHasAVX2() {
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7)
+        return false;
+    __cpuid(info, 1);
+    bool osxsave = (info[2] & (1 << 27)) != 0, avx = (info[2] & (1 << 28)) != 0;
+    if (!osxsave || !avx || (_xgetbv(0) & 6) != 6)
+        return false;
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+
+#else
+
+const char* ScanAnySSE2(const char* p, const char* pe, const ScanSet& set) {
+    return ScanAnyScalar(p, pe, set);
+}
+
+const char* ScanAnyAVX2(const char* p, const char* pe, const ScanSet& set) {
+    return ScanAnyScalar(p, pe, set);
+}
+
+#endif
+
+bool ScanImplSupported(ScanImpl impl) {
+    switch (impl) {
+#ifdef FLATCO_SCAN_X86
+    case ScanImpl::SSE2: return true;
+    case ScanImpl::AVX2: return CpuHasAVX2();
+#else
+    case ScanImpl::SSE2: return false;
+    case ScanImpl::AVX2: return false;
+#endif
+    default: return true;
+    }
+}
+
+typedef const char* (*ScanAnyFn)(const char* p, const char* pe, const ScanSet& set);
+
+static ScanAnyFn s_scanAny = ScanAnyScalar;
+static const char* s_scanImplName = "scalar";
+
+bool SetScanImpl(ScanImpl impl) {
+    if (impl == ScanImpl::Auto)
+        impl = ScanImplSupported(ScanImpl::AVX2) ? ScanImpl::AVX2 : (ScanImplSupported(ScanImpl::SSE2) ? ScanImpl::SSE2 : ScanImpl::Scalar);
+    if (!ScanImplSupported(impl))
+        return false;
+    switch (impl) {
+    case ScanImpl::AVX2: s_scanAny = ScanAnyAVX2; s_scanImplName = "avx2"; break;
+    case ScanImpl::SSE2: s_scanAny = ScanAnySSE2; s_scanImplName = "sse2"; break;
+    default: s_scanAny = ScanAnyScalar; s_scanImplName = "scalar"; break;
+    }
+    return true;
+}
+
+const char* ScanImplName() {
+    return s_scanImplName;
+}
+
+static bool InitScanImpl() {
+    const char* env = getenv("FLATCO_SCAN");
+    if (env && !strcmp(env, "scalar"))
+        return SetScanImpl(ScanImpl::Scalar);
+    if (env && !strcmp(env, "sse2") && SetScanImpl(ScanImpl::SSE2))
+        return true;
+    if (env && !strcmp(env, "avx2") && SetScanImpl(ScanImpl::AVX2))
+        return true;
+    return SetScanImpl(ScanImpl::Auto);
+}
+
+static bool s_scanImplInited = InitScanImpl();
+
+const char* ScanAny(const char* p, const char* pe, const ScanSet& set) {
+    if (p >= pe)
+        return pe;
+    return s_scanAny(p, pe, set);
+}
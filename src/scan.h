@@ -0,0 +1,32 @@
+#pragma once
+
+#ifndef _flatco_scan_h_
+#define _flatco_scan_h_
+
+#include <stddef.h>
+
+// Up to 5 interesting chars, unused slots repeat one of the others
+struct ScanSet {
+    char c[5];
+
+    ScanSet(char c0, char c1, char c2, char c3, char c4) : c{ c0, c1, c2, c3, c4 } {}
+};
+
+enum class ScanImpl { Auto, Scalar, SSE2, AVX2 };
+
+// Return the first p in [p, pe) with *p in set, or pe if there is none
+const char* ScanAny(const char* p, const char* pe, const ScanSet& set);
+
+// Select the implementation used by ScanAny, Auto picks the best one supported by the CPU.
+// Return false if impl isn't supported. The initial implementation is Auto, or $FLATCO_SCAN
+// (scalar, sse2 or avx2) if it's set.
+bool SetScanImpl(ScanImpl impl);
+const char* ScanImplName();
+
+// Call a specific implementation, for benchmarks and tests; the SIMD ones require CPU support
+const char* ScanAnyScalar(const char* p, const char* pe, const ScanSet& set);
+const char* ScanAnySSE2(const char* p, const char* pe, const ScanSet& set);
+const char* ScanAnyAVX2(const char* p, const char* pe, const ScanSet& set);
+bool ScanImplSupported(ScanImpl impl);
+
+#endif /* !_flatco_scan_h_ */
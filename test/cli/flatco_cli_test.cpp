@@ -0,0 +1,103 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <filesystem>
+#include <string>
+#ifndef _WIN32
+#include <sys/wait.h>
+#endif
+
+// Tests of the flatco command line writing its output: a missing -o is an error, and an output is rewritten only
+// when its content changes
+
+namespace fs = std::filesystem;
+
+static int s_failures = 0;
+
+static void Check(bool ok, const char* what) {
+    if (!ok) {
+        printf("FAILED: %s\n", what);
+        ++s_failures;
+    }
+}
+
+static bool WriteFile(const fs::path& fileName, const std::string& s) {
+    FILE* f = fopen(fileName.string().c_str(), "wb");
+    if (!f)
+        return false;
+    bool ok = fwrite(s.data(), 1, s.size(), f) == s.size();
+    return fclose(f) == 0 && ok;
+}
+
+static std::string ReadFile(const fs::path& fileName) {
+    std::string s;
+    if (FILE* f = fopen(fileName.string().c_str(), "rb")) {
+        char buf[256];
+        for (size_t n; (n = fread(buf, 1, sizeof(buf), f)) > 0;)
+            s.append(buf, n);
+        fclose(f);
+    }
+    return s;
+}
+
+// The exit code of flatco run with args, its stdout in out, -1 if it didn't exit
+static int Flatco(const std::string& args, const fs::path& out) {
+    std::string cmd = std::string("\"") + FLATCO_EXE + "\" " + args + " > \"" + out.string() + "\"";
+    int rc = system(cmd.c_str());
+#ifndef _WIN32
+    rc = WIFEXITED(rc) ? WEXITSTATUS(rc) : -1;
+#endif
+    return rc;
+}
+
+static void TestMissingOutput(const fs::path& dir) {
+    fs::path src = dir / "s.cxx", msg = dir / "msg.txt";
+    WriteFile(src, "int x;\n");
+    Check(Flatco("\"" + src.string() + "\"", msg) == 1, "missing -o exits with 1");
+    Check(ReadFile(msg).find("-o") != std::string::npos, "missing -o reported");
+}
+
+static void TestUnchanged(const fs::path& dir) {
+    fs::path src = dir / "u.cxx", out = dir / "u.cpp", msg = dir / "msg.txt";
+    std::string args = "-o \"" + out.string() + "\" \"" + src.string() + "\"";
+    WriteFile(src, "BL_func(task) int F(int a) {\n    BL_return(a + 1);\n}\n");
+    Check(Flatco(args, msg) == 0, "first flatten");
+    std::string first = ReadFile(out);
+    Check(!first.empty(), "output written");
+
+    // Same content: the file keeps the mtime set back an hour
+    std::error_code ec;
+    auto old = fs::last_write_time(out, ec) - std::chrono::hours(1);
+    fs::last_write_time(out, old, ec);
+    Check(Flatco(args, msg) == 0, "second flatten");
+    Check(fs::last_write_time(out, ec) == old, "unchanged output not rewritten");
+
+    WriteFile(src, "BL_func(task) int F(int a) {\n    BL_return(a + 2);\n}\n");
+    Check(Flatco(args, msg) == 0, "flatten changed source");
+    Check(fs::last_write_time(out, ec) != old && ReadFile(out) != first, "changed output rewritten");
+
+    // No temporary file is left behind
+    size_t n = 0;
+    for (auto& entry : fs::directory_iterator(dir, ec)) {
+        (void)entry;
+        ++n;
+    }
+    Check(n == 3, "only source, output and messages in the directory");
+}
+
+int main() {
+    std::error_code ec;
+    fs::path dir = fs::temp_directory_path() / "flatco_cli_test";
+    fs::remove_all(dir, ec);
+    fs::create_directories(dir / "missing", ec);
+    fs::create_directories(dir / "unchanged", ec);
+    TestMissingOutput(dir / "missing");
+    TestUnchanged(dir / "unchanged");
+    fs::remove_all(dir, ec);
+    if (s_failures) {
+        printf("%d failed\n", s_failures);
+        return 1;
+    }
+    printf("ok\n");
+    return 0;
+}
@@ -1,8 +1,11 @@
 #include <coroutine>
 #include <iostream>
 #include <string.h>
+#include <string>
+#include <string_view>
 #include <chrono>
 #include "flatco.h"
+#include "text.bl.h"
 
 struct task {
     struct promise_type {
@@ -19,6 +22,26 @@ struct task {
     std::coroutine_handle<task::promise_type> handle_;
 };
 
+// A coroutine done when created, whose result is taken by co_await
+template <typename T>
+struct Ready {
+    struct promise_type {
+        T value{};
+        Ready get_return_object() noexcept { return { std::coroutine_handle<promise_type>::from_promise(*this) }; }
+        constexpr std::suspend_never initial_suspend() const noexcept { return {}; }
+        constexpr std::suspend_always final_suspend() const noexcept { return {}; }
+        void return_value(T v) noexcept { value = v; }
+        constexpr void unhandled_exception() const noexcept {}
+    };
+
+    ~Ready() { handle_.destroy(); }
+    constexpr bool await_ready() const noexcept { return true; }
+    constexpr void await_suspend(std::coroutine_handle<>) const noexcept {}
+    T await_resume() const noexcept { return handle_.promise().value; }
+
+    std::coroutine_handle<promise_type> handle_;
+};
+
 typedef void(*OnPacket)(const char* s);
 
 struct Filter {
@@ -72,11 +95,60 @@ struct GetText {
     const char* s_;
 };
 
+// Can't suspend, so generated as functions
+BL_func(task) bool HasYou(const char* s) {
+    BL_return(s != NULL && strstr(s, "you") != NULL);
+}
+
+BL_func(task) void SendIfYou(OnPacket onPacket, const char* s) {
+    bool you;
+    BL_call(you = HasYou(s));
+    if (you)
+        onPacket(s);
+}
+
+typedef std::string Str;
+
+BL_func(task) size_t TextLength(Str text) {
+    BL_return(text.size());
+}
+
+// Taken by value and only passed on, the parameter is moved by the BL_call instead of copied
+BL_func(task) size_t TaggedLength(Str text) {
+    size_t n;
+    BL_call(n = TextLength(text));
+    BL_return(n + sizeof("tagged ") - 1);
+}
+
+// Viewed before the BL_call, the parameter is copied to it, a move would leave the view dangling
+BL_func(task) size_t ViewedLength(Str text) {
+    std::string_view view = text;
+    const char* p = text.c_str();
+    size_t n;
+    BL_call(n = TextLength(text));
+    BL_return(n + view.size() + strlen(p));
+}
+
 BL_func(task) const char* AsyncGetText(GetText& getText, const char* t) {
     GetText& gt = getText.with_s(/*a parameter*/t);
     BL_return(co_await gt);
 }
 
+// Called twice in one block, the calls share one expansion
+BL_func(task, shared) const char* AsyncGetSharedText(GetText& getText, const char* t) {
+    GetText& gt = getText.with_s(t);
+    BL_return(co_await gt);
+}
+
+// Generated as a coroutine of type Ready<size_t>, the calls co_await it
+BL_func(Ready<size_t>, outline) size_t AsyncCountYou(const char* s) {
+    co_await std::suspend_never{};
+    size_t n = 0;
+    for (const char* p = s; (p = strstr(p, "you")) != NULL; p += 3)
+        ++n;
+    BL_return(n);
+}
+
 task Filter::run() {
     GetText getText = GetText(this);
     for (;;) {
@@ -87,8 +159,38 @@ task Filter::run() {
             if (strstr(s, "you"))
                 onPacket_(s);
             BL_call(s = AsyncGetText(getText, "Inline you"));
-            if (strstr(s, "you"))
-                onPacket_(s);
+            BL_call(SendIfYou(onPacket_, s));
+            size_t n;
+            BL_call(n = AsyncTextLength(s));
+            printf("length: %zu\n", n);
+            BL_call(s = AsyncGetSharedText(getText, "Shared you"));
+            BL_call(SendIfYou(onPacket_, s));
+            BL_call(n = AsyncCountYou(s));
+            printf("you: %zu\n", n);
+            BL_call(s = AsyncGetSharedText(getText, "Shared again you"));
+            BL_call(SendIfYou(onPacket_, s));
+            BL_call(n = TaggedLength(s));
+            printf("tagged length: %zu\n", n);
+            BL_call(n = ViewedLength(s));
+            printf("viewed length: %zu\n", n);
+            // Declared by the BL_call, its BL_return constructs it
+            size_t length = BL_call(AsyncTextLength(s));
+            printf("length: %zu\n", length);
+            // In an expression, expanded before the statement which takes its result
+            if (BL_call(AsyncTextLength(s)) == length)
+                printf("same length\n");
+            // A cast, not the condition of an if, before the call puts it in an expression
+            (void)BL_call(AsyncTextLength(s));
+            // Directly in a switch, its case needs braces
+            switch (length % 2) {
+            case 0: {
+                n = BL_call(AsyncTextLength(s)) / 2;
+                break;
+            }
+            default:
+                n = 0;
+            }
+            printf("half length: %zu\n", n);
         }
         catch (const char* err) {
             printf("except: %s\n", err);
@@ -0,0 +1,152 @@
+#include <stdio.h>
+#include <string.h>
+#include <filesystem>
+#include <string>
+#include <vector>
+#include "libflatco.h"
+#include "flatco_rt.h"
+
+// Tests of the options of flatco::transform() rating and timing the BL_call sites or generating on threads,
+// checked on the text generated, and of the dump of the timings by flatco_rt.h
+
+static int s_failures = 0;
+
+static void Check(bool ok, const char* what) {
+    if (!ok) {
+        printf("FAILED: %s\n", what);
+        ++s_failures;
+    }
+}
+
+static bool Contains(const std::string& s, const char* part) {
+    return s.find(part) != s.npos;
+}
+
+// Get is outlined unless a profile rates its sites, the BL_calls are at 8:17 and 9:17
+static const char* const k_source =
+    "#include \"flatco.h\"\n"
+    "BL_func(task, outline) int Get(Source& src) {\n"
+    "    int n = co_await src.next();\n"
+    "    BL_return(n + 1);\n"
+    "}\n"
+    "task Run(Source& src) {\n"
+    "    int a, b;\n"
+    "    BL_call(a = Get(src));\n"
+    "    BL_call(b = Get(src));\n"
+    "    co_return;\n"
+    "}\n";
+
+// The site of a profile run 100000 times is hot, the one run 3 times is cold: the hot one is expanded although
+// Get is outlined, the cold one is outlined and unlikely
+static void TestProfile() {
+    flatco::Profile profile;
+    Check(profile.parse("p.cxx\t8\t17\tGet\t100000\np.cxx\t9\t17\tGet\t3\n"), "profile parsed");
+    Check(!profile.parse("p.cxx\t8\t17\tGet\n"), "profile line without count refused");
+
+    flatco::Result plain = flatco::transform(k_source, "p.cxx");
+    Check(plain.ok, "transform without profile");
+    Check(Contains(plain.output, "a =co_await Get(src)") && Contains(plain.output, "b =co_await Get(src)"),
+          "both sites outlined without profile");
+    Check(!Contains(plain.output, "[[unlikely]]"), "no site unlikely without profile");
+
+    flatco::Options options;
+    options.profile = &profile;
+    flatco::Result rated = flatco::transform(k_source, "p.cxx", options);
+    Check(rated.ok, "transform with profile");
+    Check(!Contains(rated.output, "a =co_await Get(src)") && Contains(rated.output, "a =n + 1"),
+          "hot site expanded");
+    Check(Contains(rated.output, "[[unlikely]] b =co_await Get(src)"), "cold site outlined and unlikely");
+    bool noted = false;
+    for (auto& diagnostic : rated.diagnostics)
+        noted = noted || (diagnostic.row == 9 && Contains(diagnostic.message, "at a cold site"));
+    Check(noted, "cold site noted");
+
+    // Renamed, the sites aren't in the profile and keep the choice of the BL_func
+    flatco::Result moved = flatco::transform(k_source, "q.cxx", options);
+    Check(moved.ok && Contains(moved.output, "a =co_await Get(src)") && !Contains(moved.output, "[[unlikely]]"),
+          "sites not in profile unrated");
+}
+
+// Every site gets an entry of the table and a timer of its own
+static void TestInstrument() {
+    flatco::Options options;
+    options.instrument = true;
+    flatco::Result timed = flatco::transform(k_source, "p.cxx", options);
+    Check(timed.ok, "transform instrumented");
+    Check(Contains(timed.output, "static flatco::InstrumentSite _BLinstrument[] = "
+                                 "{{\"p.cxx\",8,17,\"Get\"},{\"p.cxx\",9,17,\"Get\"},};"), "site table");
+    Check(Contains(timed.output, "static flatco::InstrumentTable _BLinstrumentTable(_BLinstrument, 2);"),
+          "site table registered");
+    Check(Contains(timed.output, "flatco::SiteTimer _BLtimer0(_BLinstrument[0]);") &&
+          Contains(timed.output, "flatco::SiteTimer _BLtimer1(_BLinstrument[1]);"), "site timers");
+}
+
+static std::string ReadFile(FILE* f) {
+    std::string s;
+    char buf[256];
+    rewind(f);
+    for (size_t n; (n = fread(buf, 1, sizeof(buf), f)) > 0;)
+        s.append(buf, n);
+    return s;
+}
+
+// The dump of a table as generated, with a file name to quote
+static void TestDump() {
+    static flatco::InstrumentSite sites[] = { { "a \"b\".cxx", 8, 17, "Get" }, { "p.cxx", 9, 17, "Put" } };
+    flatco::InstrumentTable table(sites, 2);
+    for (int i = 0; i < 3; ++i)
+        flatco::SiteTimer timer(sites[0]);
+
+    std::string header = std::string("file,row,col,func,count,") + flatco::k_ticksUnit + "\n";
+    FILE* f = tmpfile();
+    flatco::DumpInstrument(f, false);
+    std::string csv = ReadFile(f);
+    fclose(f);
+    Check(csv.compare(0, header.size(), header) == 0, "CSV header");
+    Check(Contains(csv, "\n\"a \"\"b\"\".cxx\",8,17,Get,3,"), "CSV site timed");
+    Check(Contains(csv, "\n\"p.cxx\",9,17,Put,0,0\n"), "CSV site not run");
+
+    std::string fileName = (std::filesystem::temp_directory_path() / "flatco_lib_test.json").string();
+    Check(flatco::WriteInstrument(fileName.c_str()), "JSON written");
+    f = fopen(fileName.c_str(), "rb");
+    std::string json = f ? ReadFile(f) : std::string();
+    if (f)
+        fclose(f);
+    remove(fileName.c_str());
+    Check(json.compare(0, 9, "{\"unit\":\"") == 0 && Contains(json, flatco::k_ticksUnit), "JSON unit");
+    Check(Contains(json, "{\"file\":\"a \\\"b\\\".cxx\",\"row\":8,\"col\":17,\"func\":\"Get\",\"count\":3,"),
+          "JSON site timed");
+    Check(Contains(json, "{\"file\":\"p.cxx\",\"row\":9,\"col\":17,\"func\":\"Put\",\"count\":0,\"ticks\":0}"),
+          "JSON site not run");
+
+    // Unregistered, not dumped when the program exits
+    flatco::InstrumentTable::head() = table.next;
+}
+
+// Generated in chunks on threads, the output is the one of a single thread
+static void TestParallelGen() {
+    std::string src = "BL_func(task) int H(Source& src, int n) {\n    int v = co_await src.next();\n"
+                      "    BL_return(n + v);\n}\ntask Run(Source& src) {\n    int n = 0;\n";
+    for (int i = 0; i < 200; ++i)
+        src += "    BL_call(n = H(src, n));\n";
+    src += "    co_return;\n}\n";
+    flatco::Options options;
+    flatco::Result single = flatco::transform(src, "g.cxx", options);
+    options.jobs = 4;
+    options.parallelGenMinBytes = 1;
+    flatco::Result parallel = flatco::transform(src, "g.cxx", options);
+    Check(single.ok && parallel.ok && single.output == parallel.output, "parallel generation");
+}
+
+int main() {
+    TestProfile();
+    TestParallelGen();
+    TestInstrument();
+    TestDump();
+    if (s_failures) {
+        printf("%d failed\n", s_failures);
+        return 1;
+    }
+    printf("ok\n");
+    return 0;
+}
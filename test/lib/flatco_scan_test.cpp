@@ -0,0 +1,63 @@
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include "scan.h"
+
+// Tests of the implementations of ScanAny: every one supported by the CPU, called directly or selected by
+// SetScanImpl(), stops where the scalar one does, at every length and alignment around the vector widths
+
+static int s_failures = 0;
+
+static void Check(bool ok, const char* what) {
+    if (!ok) {
+        printf("FAILED: %s\n", what);
+        ++s_failures;
+    }
+}
+
+typedef const char* (*ScanAnyFn)(const char* p, const char* pe, const ScanSet& set);
+
+int main() {
+    static const struct { ScanImpl impl; const char* name; ScanAnyFn fn; } impls[] = {
+        { ScanImpl::Scalar, "scalar", ScanAnyScalar }, { ScanImpl::SSE2, "sse2", ScanAnySSE2 },
+        { ScanImpl::AVX2, "avx2", ScanAnyAVX2 },
+    };
+    const ScanSet set('B', '"', '\'', '/', 'B');
+    // Text without a char of the set, one of them put at every position in turn
+    std::string text(200, 'x');
+    for (size_t i = 0; i < text.size(); ++i)
+        text[i] = "abcdefgh ;{}()\n"[i % 15];
+
+    for (auto& it : impls) {
+        bool supported = ScanImplSupported(it.impl);
+        Check(SetScanImpl(it.impl) == supported, "SetScanImpl() as supported");
+        if (!supported) {
+            printf("%s not supported\n", it.name);
+            continue;
+        }
+        Check(strcmp(ScanImplName(), it.name) == 0, "ScanImplName() of the implementation set");
+        bool same = true;
+        for (size_t begin = 0; begin < 40; ++begin) {
+            for (size_t end = begin; end <= 100; ++end) {
+                for (size_t at = begin; at <= end; ++at) {
+                    std::string s = text;
+                    if (at < end)
+                        s[at] = "B\"'/"[at % 4];
+                    const char* p = s.data() + begin;
+                    const char* pe = s.data() + end;
+                    const char* expected = ScanAnyScalar(p, pe, set);
+                    same = same && expected == s.data() + at && it.fn(p, pe, set) == expected &&
+                           ScanAny(p, pe, set) == expected;
+                }
+            }
+        }
+        Check(same, it.name);
+    }
+    SetScanImpl(ScanImpl::Auto);
+    if (s_failures) {
+        printf("%d failed\n", s_failures);
+        return 1;
+    }
+    printf("ok\n");
+    return 0;
+}
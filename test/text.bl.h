@@ -0,0 +1,6 @@
+// BL_funcs imported by flatco_test.cxx
+#pragma once
+
+BL_func(task) size_t AsyncTextLength(const char* t) {
+    BL_return(t ? strlen(t) : 0);
+}